@@ -97,6 +97,22 @@ bool Args::paramsToHash(HashMap *configHash) {
   CONFIG_INSERT_STR(debug_bgu_nc);
   CONFIG_INSERT_STR(debug_bgu_overwrite);
   CONFIG_INSERT_STR(fractl_nc_file);
+  CONFIG_INSERT_STR(h_operator);
+  CONFIG_INSERT_BOOL(h_single_precision);
+  CONFIG_INSERT_STR(obs_ordering);
+  CONFIG_INSERT_BOOL(h_prescale_obs);
+  CONFIG_INSERT_BOOL(superob_radar);
+  CONFIG_INSERT_STR(fftw_wisdom_file);
+  CONFIG_INSERT_STR(state_layout);
+  CONFIG_INSERT_BOOL(fuse_transforms);
+  CONFIG_INSERT_STR(thread_schedule);
+  CONFIG_INSERT_STR(tn_preconditioner);
+  CONFIG_INSERT_BOOL(deterministic_reductions);
+  CONFIG_INSERT_BOOL(exact_line_search);
+  CONFIG_INSERT_STR(solver_type);
+  CONFIG_INSERT_INT(tn_recycle_vectors);
+  CONFIG_INSERT_INT(ensemble_size);
+  CONFIG_INSERT_BOOL(output_ensemble_members);
   CONFIG_INSERT_BOOL(horizontal_radar_appx);
   CONFIG_INSERT_BOOL(load_background);
   CONFIG_INSERT_BOOL(load_bg_coefficients);
@@ -280,6 +296,7 @@ bool Args::paramsToHash(HashMap *configHash) {
   CONFIG_INSERT_FLOAT(radar_sw_error);
   CONFIG_INSERT_FLOAT(rain_dbz);
   CONFIG_INSERT_FLOAT(sfmr_windspeed_error);
+  CONFIG_INSERT_FLOAT(superob_max_angle);
 
   for (int iter = 1; iter <= params.num_iterations; iter++) {
     CONFIG_INSERT_FLOAT_ARRAY(bg_qr_error, iter);
@@ -7,10 +7,12 @@
  */
 
 #include "CostFunction.h"
+#include <algorithm>
 #include <cmath>
 #include <iostream>
 #include <iomanip>
 #include <limits>
+#include <vector>
 #include "timing/gptl.h"
 #include "solver.inc"
 
@@ -19,11 +21,23 @@ CostFunction::CostFunction(const Projection& proj, const int& numObs, const int&
 {
 	mObs = numObs;
 	nState = stateSize;
+	deterministicReductions = false;
+	exactStep = false;
+	solver = S_SOLVER;
+	lbfgsHistory = 5;
+	recycleVectors = 0;
+	recycleStored = 0;
+	recycleCurrent = false;
+	recycleW = NULL;
+	recycleAW = NULL;
+	recycleL = NULL;
 }
 
 CostFunction::~CostFunction()
 {
-	
+	delete[] recycleW;
+	delete[] recycleAW;
+	delete[] recycleL;
 }
 
 void CostFunction::setNumObservations(const int& numObs)
@@ -63,15 +77,21 @@ bool CostFunction::minimize()
   //work vector or MT linesearch
   mt_work = new real[nState];
 
+  //the Hessian may have changed since the recycled space was built
+  recycleCurrent = false;
+
   // choose solver (currState is update by solver)
-  if (S_SOLVER == 1) {
+  if (solver == SOLVER_TRUNCATED_NEWTON) {
     cout << "SOLVER: Samurai Truncated Newton " << endl;
     truncatedNewton(currState, currGradient, ftol);
-  } else if (S_SOLVER == 2) {
+  } else if (solver == SOLVER_CONJUGATE_GRADIENT) {
     cout << "SOLVER: Samurai Conjugate Gradient " << endl;
     conjugateGradient(currState, currGradient, ftol, minimum);
+  } else if (solver == SOLVER_LBFGS) {
+    cout << "SOLVER: Samurai L-BFGS (history = " << lbfgsHistory << ")" << endl;
+    lbfgs(currState, currGradient, ftol);
   } else {
-    cout << "\tS_SOLVER = " << S_SOLVER << " is not a valid option. Using Samurai TN instead." << endl;
+    cout << "\tS_SOLVER = " << solver << " is not a valid option. Using Samurai TN instead." << endl;
     truncatedNewton(currState, currGradient, ftol);
   }
 
@@ -85,6 +105,339 @@ bool CostFunction::minimize()
 	return true;
 }
 
+// <a, b>
+real CostFunction::dotProduct(const real* a, const real* b)
+{
+  if (deterministicReductions) {
+    return vectorSum(nState, [&](const int64_t& j) { return a[j]*b[j]; });
+  }
+  real sum = 0.0;
+  #pragma omp parallel for reduction(+:sum)
+  #pragma acc parallel loop reduction(+:sum)
+  for (int j = 0; j < nState; j++) {
+    sum += a[j]*b[j];
+  }
+  return sum;
+}
+
+// y = x
+void CostFunction::copyVector(const real* x, real* y)
+{
+  #pragma omp parallel for
+  #pragma acc parallel loop gang vector vector_length(32)
+  for (int j = 0; j < nState; j++) {
+    y[j] = x[j];
+  }
+}
+
+// y = x + beta*y
+void CostFunction::xpby(const real* x, const real& beta, real* y)
+{
+  #pragma omp parallel for
+  #pragma acc parallel loop gang vector vector_length(32)
+  for (int j = 0; j < nState; j++) {
+    y[j] = x[j] + beta*y[j];
+  }
+}
+
+// w = x + alpha*y
+void CostFunction::waxpy(real* w, const real* x, const real& alpha, const real* y)
+{
+  #pragma omp parallel for
+  #pragma acc parallel loop gang vector vector_length(32)
+  for (int j = 0; j < nState; j++) {
+    w[j] = x[j] + alpha*y[j];
+  }
+}
+
+// X^T*Y (k x k) for interleaved blocks of k vectors. The partial sums of a fixed number
+// of state blocks are added in order, so the result does not depend on the number of threads
+void CostFunction::blockProduct(const int& k, const real* X, const real* Y, real* XtY)
+{
+  const int64_t nblocks = 256;
+  const int64_t blockSize = (nState + nblocks - 1) / nblocks;
+  std::vector<real> partial(nblocks*k*k, 0.0);
+  #pragma omp parallel for
+  for (int64_t blk = 0; blk < nblocks; blk++) {
+    real* sum = &partial[blk*k*k];
+    int64_t end = std::min((blk+1)*blockSize, (int64_t)nState);
+    for (int64_t n = blk*blockSize; n < end; n++) {
+      const real* x = X + n*k;
+      const real* y = Y + n*k;
+      for (int a = 0; a < k; a++) {
+	for (int b = 0; b < k; b++) sum[a*k+b] += x[a]*y[b];
+      }
+    }
+  }
+  for (int i = 0; i < k*k; i++) {
+    XtY[i] = 0.0;
+    for (int64_t blk = 0; blk < nblocks; blk++) XtY[i] += partial[blk*k*k+i];
+  }
+}
+
+// Y += X*coef for interleaved blocks of k vectors and a k x k coefficient matrix
+void CostFunction::blockUpdate(const int& k, const real* X, const real* coef, real* Y)
+{
+  #pragma omp parallel for
+  for (int64_t n = 0; n < nState; n++) {
+    const real* x = X + n*k;
+    real* y = Y + n*k;
+    for (int a = 0; a < k; a++) {
+      for (int b = 0; b < k; b++) y[b] += x[a]*coef[a*k+b];
+    }
+  }
+}
+
+// The CG update x += alpha*p, r -= alpha*Ap, returning <r, r>. With a diagonal preconditioner
+// Minv, z = Minv*r is also updated and <r, z> is returned in rz
+real CostFunction::cgUpdate(const real& alpha, const real* p, const real* Ap, real* x, real* r,
+			    const real* Minv, real* z, real& rz)
+{
+  real rr = 0.0;
+  real rzSum = 0.0;
+  if (deterministicReductions) {
+    #pragma omp parallel for
+    for (int j = 0; j < nState; j++) {
+      x[j] = x[j] + alpha*p[j];
+      r[j] = r[j] - alpha*Ap[j];
+      if (Minv != NULL) z[j] = Minv[j]*r[j];
+    }
+    rr = dotProduct(r, r);
+    if (Minv != NULL) rzSum = dotProduct(r, z);
+  } else {
+    #pragma omp parallel for reduction(+:rr,rzSum)
+    #pragma acc parallel loop gang vector vector_length(32) reduction(+:rr,rzSum)
+    for (int j = 0; j < nState; j++) {
+      x[j] = x[j] + alpha*p[j];
+      r[j] = r[j] - alpha*Ap[j];
+      rr += r[j]*r[j];
+      if (Minv != NULL) {
+        z[j] = Minv[j]*r[j];
+        rzSum += r[j]*z[j];
+      }
+    }
+  }
+  rz = (Minv != NULL) ? rzSum : rr;
+  return rr;
+}
+
+bool CostFunction::funcPreconditioner(real* Minv)
+{
+  // No preconditioner unless the cost function provides one
+  return false;
+}
+
+// Hessian products of k interleaved vectors, one at a time unless the cost function
+// provides a blocked version
+void CostFunction::funcHessianBlock(const int& k, real* X, real* HX)
+{
+  real* x = new real[nState];
+  real* hx = new real[nState];
+  for (int b = 0; b < k; b++) {
+    #pragma omp parallel for
+    for (int n = 0; n < nState; n++) x[n] = X[(int64_t)n*k+b];
+    funcHessian(x, hx);
+    #pragma omp parallel for
+    for (int n = 0; n < nState; n++) HX[(int64_t)n*k+b] = hx[n];
+  }
+  delete[] x;
+  delete[] hx;
+}
+
+// Eigenvalues d and eigenvectors (columns of V) of the symmetric n x n matrix A, which
+// is destroyed, by cyclic Jacobi rotations
+static void jacobiEigen(const int& n, real* A, real* d, real* V)
+{
+  for (int i = 0; i < n; i++) {
+    for (int j = 0; j < n; j++) V[i*n+j] = (i == j) ? 1.0 : 0.0;
+  }
+  for (int sweep = 0; sweep < 50; sweep++) {
+    real off = 0.0;
+    for (int p = 0; p < n; p++) {
+      for (int q = p+1; q < n; q++) off += A[p*n+q]*A[p*n+q];
+    }
+    if (off < 1.0e-30) break;
+    for (int p = 0; p < n; p++) {
+      for (int q = p+1; q < n; q++) {
+	if (A[p*n+q] == 0.0) continue;
+	real theta = (A[q*n+q] - A[p*n+p]) / (2.0*A[p*n+q]);
+	real t = (theta >= 0 ? 1.0 : -1.0) / (fabs(theta) + sqrt(theta*theta + 1.0));
+	real c = 1.0 / sqrt(t*t + 1.0);
+	real s = t*c;
+	for (int k = 0; k < n; k++) {
+	  real akp = A[k*n+p], akq = A[k*n+q];
+	  A[k*n+p] = c*akp - s*akq;
+	  A[k*n+q] = s*akp + c*akq;
+	}
+	for (int k = 0; k < n; k++) {
+	  real apk = A[p*n+k], aqk = A[q*n+k];
+	  A[p*n+k] = c*apk - s*aqk;
+	  A[q*n+k] = s*apk + c*aqk;
+	}
+	for (int k = 0; k < n; k++) {
+	  real vkp = V[k*n+p], vkq = V[k*n+q];
+	  V[k*n+p] = c*vkp - s*vkq;
+	  V[k*n+q] = s*vkp + c*vkq;
+	}
+      }
+    }
+  }
+  for (int i = 0; i < n; i++) d[i] = A[i*n+i];
+}
+
+// Form W^T*A*W for the recycled space and its Cholesky factor, dropping the vectors that
+// are numerically dependent on the ones before them
+void CostFunction::recycleFactor()
+{
+  const int k = recycleStored;
+  const int ld = recycleVectors;
+  std::vector<real> E(k*k), row(k);
+  std::vector<int> keep;
+  for (int i = 0; i < k; i++) {
+    for (int j = 0; j <= i; j++) {
+      E[i*k+j] = E[j*k+i] = 0.5*(dotProduct(recycleW + (int64_t)i*nState, recycleAW + (int64_t)j*nState)
+				+ dotProduct(recycleW + (int64_t)j*nState, recycleAW + (int64_t)i*nState));
+    }
+  }
+  for (int j = 0; j < k; j++) {
+    int kept = keep.size();
+    real pivot = E[j*k+j];
+    for (int a = 0; a < kept; a++) {
+      real sum = E[j*k+keep[a]];
+      for (int b = 0; b < a; b++) sum -= row[b]*recycleL[a*ld+b];
+      row[a] = sum/recycleL[a*ld+a];
+      pivot -= row[a]*row[a];
+    }
+    if (pivot <= 1.0e-10*E[j*k+j]) continue;
+    for (int a = 0; a < kept; a++) recycleL[kept*ld+a] = row[a];
+    recycleL[kept*ld+kept] = sqrt(pivot);
+    keep.push_back(j);
+  }
+  for (int a = 0; a < (int)keep.size(); a++) {
+    if (keep[a] == a) continue;
+    copyVector(recycleW + (int64_t)keep[a]*nState, recycleW + (int64_t)a*nState);
+    copyVector(recycleAW + (int64_t)keep[a]*nState, recycleAW + (int64_t)a*nState);
+  }
+  recycleStored = keep.size();
+}
+
+// mu = (W^T*A*W)^-1 * basis^T * v, where the basis is W or A*W
+void CostFunction::recycleProject(const real* basis, const real* v, real* mu)
+{
+  const int k = recycleStored;
+  const int ld = recycleVectors;
+  for (int i = 0; i < k; i++) mu[i] = dotProduct(basis + (int64_t)i*nState, v);
+  for (int i = 0; i < k; i++) {
+    for (int j = 0; j < i; j++) mu[i] -= recycleL[i*ld+j]*mu[j];
+    mu[i] /= recycleL[i*ld+i];
+  }
+  for (int i = k-1; i >= 0; i--) {
+    for (int j = i+1; j < k; j++) mu[i] -= recycleL[j*ld+i]*mu[j];
+    mu[i] /= recycleL[i*ld+i];
+  }
+}
+
+// Build the recycled space from m steps of (preconditioned) CG. With the Lanczos vectors
+// v_j = z_j/sqrt(<r_j, z_j>) the CG coefficients give the tridiagonal T with
+// M^-1*A*V = V*T + t*v_m*e_m^T, so A*V needs no further Hessian products. The vectors lose
+// their orthogonality once the largest Ritz values converge, so the Ritz vectors of the
+// largest eigenvalues come from a Rayleigh-Ritz step on the M-weighted Gram matrix of V
+void CostFunction::recycleExtract(const int& m, const real* lanczos, const real* lanczosAlpha,
+				  const real* lanczosBeta, const real* Minv)
+{
+  GPTLstart("CostFunction::recycleExtract");
+  std::vector<real> T(m*m, 0.0), G(m*m), K(m*m), lambda(m), U(m*m);
+  for (int j = 0; j < m; j++) {
+    T[j*m+j] = 1.0/lanczosAlpha[j];
+    if (j > 0) T[j*m+j] += lanczosBeta[j-1]/lanczosAlpha[j-1];
+    if (j < m-1) T[j*m+j+1] = T[(j+1)*m+j] = -sqrt(lanczosBeta[j])/lanczosAlpha[j];
+  }
+  const real t = -sqrt(lanczosBeta[m-1])/lanczosAlpha[m-1];
+
+  // G = V^T*M*V over v_0..v_m, then V^T*A*V = G*T + t*G_m*e_m^T symmetrized
+  std::vector<real> Gm((m+1)*(m+1));
+  for (int a = 0; a <= m; a++) {
+    const real* va = lanczos + (int64_t)a*nState;
+    for (int b = 0; b <= a; b++) {
+      const real* vb = lanczos + (int64_t)b*nState;
+      Gm[a*(m+1)+b] = Gm[b*(m+1)+a] = vectorSum(nState, [&](const int64_t& n) {
+	  return (Minv != NULL) ? va[n]*vb[n]/Minv[n] : va[n]*vb[n]; });
+    }
+  }
+  for (int a = 0; a < m; a++) {
+    for (int b = 0; b < m; b++) {
+      G[a*m+b] = Gm[a*(m+1)+b];
+      real sum = (b == m-1) ? t*Gm[a*(m+1)+m] : 0.0;
+      for (int c = 0; c < m; c++) sum += Gm[a*(m+1)+c]*T[c*m+b];
+      K[a*m+b] = sum;
+    }
+  }
+  for (int a = 0; a < m; a++) {
+    for (int b = 0; b < a; b++) K[a*m+b] = K[b*m+a] = 0.5*(K[a*m+b] + K[b*m+a]);
+  }
+
+  // Orthonormal basis Q = U*lambda^-1/2 of the numerically independent part of V
+  jacobiEigen(m, G.data(), lambda.data(), U.data());
+  real lambdaMax = *std::max_element(lambda.begin(), lambda.end());
+  std::vector<int> cols;
+  for (int i = 0; i < m; i++) {
+    if (lambda[i] > 1.0e-8*lambdaMax) cols.push_back(i);
+  }
+  const int r = cols.size();
+  std::vector<real> Q(m*r), Kr(r*r), theta(r), Y(r*r);
+  for (int a = 0; a < m; a++) {
+    for (int i = 0; i < r; i++) Q[a*r+i] = U[a*m+cols[i]]/sqrt(lambda[cols[i]]);
+  }
+  for (int i = 0; i < r; i++) {
+    for (int l = 0; l < r; l++) {
+      real sum = 0.0;
+      for (int a = 0; a < m; a++) {
+	for (int b = 0; b < m; b++) sum += Q[a*r+i]*K[a*m+b]*Q[b*r+l];
+      }
+      Kr[i*r+l] = sum;
+    }
+  }
+  jacobiEigen(r, Kr.data(), theta.data(), Y.data());
+
+  std::vector<int> order(r);
+  for (int i = 0; i < r; i++) order[i] = i;
+  std::sort(order.begin(), order.end(), [&](const int& a, const int& b) { return theta[a] > theta[b]; });
+
+  // w = V*s and A*w = M*(V*T*s + t*s_m*v_m) with s = Q*y
+  recycleStored = std::min(recycleVectors, r);
+  std::vector<real> coef(m), acoef(m);
+  const real* vm = lanczos + (int64_t)m*nState;
+  for (int i = 0; i < recycleStored; i++) {
+    const int e = order[i];
+    for (int a = 0; a < m; a++) {
+      coef[a] = 0.0;
+      for (int l = 0; l < r; l++) coef[a] += Q[a*r+l]*Y[l*r+e];
+    }
+    for (int a = 0; a < m; a++) {
+      acoef[a] = 0.0;
+      for (int b = 0; b < m; b++) acoef[a] += T[a*m+b]*coef[b];
+    }
+    const real am = t*coef[m-1];
+    real* w = recycleW + (int64_t)i*nState;
+    real* aw = recycleAW + (int64_t)i*nState;
+    #pragma omp parallel for
+    for (int n = 0; n < nState; n++) {
+      real sum = 0.0, asum = am*vm[n];
+      for (int j = 0; j < m; j++) {
+	sum += coef[j]*lanczos[(int64_t)j*nState+n];
+	asum += acoef[j]*lanczos[(int64_t)j*nState+n];
+      }
+      w[n] = sum;
+      aw[n] = (Minv != NULL) ? asum/Minv[n] : asum;
+    }
+  }
+  recycleFactor();
+  recycleCurrent = true;
+  cout << "\tRecycled space: " << recycleStored << " Ritz vectors from " << m << " Lanczos steps ("
+       << r << " independent), largest Ritz value " << theta[order[0]] << endl;
+  GPTLstop("CostFunction::recycleExtract");
+}
+
 void CostFunction::truncatedNewton(real* qstate, real* g, const real ftol)
 {
 
@@ -99,12 +452,15 @@ void CostFunction::truncatedNewton(real* qstate, real* g, const real ftol)
   int j;
   int verbose, neg_curve;
   int ls_ret;
+  int i, lanczosSteps;
+  bool precondition = false, deflate = false, collect = false;
+  bool gradientEvaluated = false, confirmStep = false;
 
   real cg_tol;
   real f_init, f_val;
   real n_init_grad, n_grad, grad_dot;
   real gg;
-  real rr, pAp, rr_m1, r_norm, r0_norm, rel_resid;
+  real rr, rz, pAp, rz_m1, r_norm, r0_norm, rel_resid;
   real beta, alpha;
   real initstep;
 
@@ -112,7 +468,10 @@ void CostFunction::truncatedNewton(real* qstate, real* g, const real ftol)
   real *p = new real[nState];
   real *Ap = new real[nState];
   real *r = new real[nState];
-#pragma acc data create(x[0:nState],p[0:nState],Ap[0:nState],r[0:nState])
+  real *Minv = new real[nState];
+  real *zp = new real[nState];
+  real *z = r;
+#pragma acc data create(x[0:nState],p[0:nState],Ap[0:nState],r[0:nState],Minv[0:nState],zp[0:nState])
 
 
   GPTLstart("CostFunction::TruncNewton");
@@ -122,6 +481,15 @@ void CostFunction::truncatedNewton(real* qstate, real* g, const real ftol)
   outer_itmax = S_MAXITER;
   verbose = S_VERBOSE;
 
+  //Krylov recycling: the Ritz vectors come from the first steps of an undeflated solve
+  const int lanczosMax = 4*recycleVectors;
+  real *lanczos = NULL;
+  std::vector<real> lanczosAlpha(lanczosMax), lanczosBeta(lanczosMax), mu(recycleVectors);
+  if (recycleVectors > 0 && recycleW == NULL) {
+    recycleW = new real[(int64_t)recycleVectors*nState];
+    recycleAW = new real[(int64_t)recycleVectors*nState];
+    recycleL = new real[recycleVectors*recycleVectors];
+  }
 
   //cumulative total of inner cg its  
   total_cg_its = 0;
@@ -136,14 +504,13 @@ void CostFunction::truncatedNewton(real* qstate, real* g, const real ftol)
     //only have to do on the first iteration if using MT line search
   #pragma acc data copyin(qstate[:nState]) copyout(g[:nState]) 
   {
-    if (its == 0) f_val = funcValueAndGradient(qstate, g);
+    if (its == 0) {
+      f_val = funcValueAndGradient(qstate, g);
+      gradientEvaluated = true;
+    }
     
     //calculate the norm of the current gradient
-    grad_dot = 0.0;
-    #pragma acc parallel loop reduction(+:grad_dot)
-    for (j = 0; j  < nState; j++) {
-      grad_dot +=  g[j]*g[j];
-    }
+    grad_dot = dotProduct(g, g);
     n_grad = sqrt(grad_dot);
 
     //collect initial values on first iteration
@@ -158,6 +525,20 @@ void CostFunction::truncatedNewton(real* qstate, real* g, const real ftol)
     //Newton conv. check	 
     gg = n_grad/n_init_grad;
 
+    //The exact step carries g forward from the recursive CG residual, which drifts from
+    //the true residual, so confirm convergence with an evaluated gradient. If they
+    //disagree, take this iteration's step with the line search
+    confirmStep = false;
+    if (gg < ftol && !gradientEvaluated) {
+      f_val = funcValueAndGradient(qstate, g);
+      gradientEvaluated = true;
+      grad_dot = dotProduct(g, g);
+      n_grad = sqrt(grad_dot);
+      gg = n_grad/n_init_grad;
+      cout << "\tNewton Iteration: " << its << "\tEvaluated J = " << f_val << "\tResidual = " << n_grad << endl;
+      confirmStep = (gg >= ftol);
+    }
+
     //cout << "gg = " << gg << endl;
   }
 
@@ -166,11 +547,14 @@ void CostFunction::truncatedNewton(real* qstate, real* g, const real ftol)
       cout << "\tFound minimum in " << its << " outer Newton iterations." << endl;
       cout << "\t(and a total of " << total_cg_its << " inner CG iterations.)" << endl;
 	   
-      #pragma acc exit data delete(x,p,Ap,r)
+      #pragma acc exit data delete(x,p,Ap,r,Minv,zp)
       delete[] x;
       delete[] p;
       delete[] Ap;
       delete[] r;
+      delete[] Minv;
+      delete[] zp;
+      delete[] lanczos;
 
       GPTLstop("CostFunction::TruncNewton");
       cout << "\tFINAL  ||g(X)||/||g(X0)|| = " << gg << endl;
@@ -178,17 +562,42 @@ void CostFunction::truncatedNewton(real* qstate, real* g, const real ftol)
     } //end conv. check
 
     //CG INNER LOOP
-    // Use non-preconditioned CG to solve linear system for Newton direction: d_k
+    // Use CG to solve linear system for Newton direction: d_k
     // H_k * d_k = -g_k, where H is the Hessian and g is the gradient
+    // With a diagonal preconditioner M, z = M^-1 r replaces r in the directions. The Hessian
+    // does not change between Newton iterations, so M is only computed on the first one
+    if (its == 0) {
+      precondition = funcPreconditioner(Minv);
+      z = precondition ? zp : r;
+#pragma acc update device(Minv[0:nState]) if(precondition)
+    }
+    // Deflate with the recycled space if there is one, refreshing A*W once per minimize().
+    // Otherwise keep the first Lanczos vectors of this solve to build it
+    deflate = (recycleStored > 0);
+    if (deflate && !recycleCurrent) {
+      for (i = 0; i < recycleStored; i++) {
+	funcHessian(recycleW + (int64_t)i*nState, recycleAW + (int64_t)i*nState);
+      }
+      cout << "\tRecycled space: " << recycleStored << " Hessian products to refresh A*W" << endl;
+      recycleFactor();
+      recycleCurrent = true;
+      deflate = (recycleStored > 0);
+    }
+    collect = (recycleVectors > 0 && !deflate);
+    if (collect && lanczos == NULL) lanczos = new real[(int64_t)(lanczosMax+1)*nState];
+    lanczosSteps = 0;
     //init
   #pragma acc data copyin(g[0:nState])
   {
+    #pragma omp parallel for
     #pragma acc parallel loop gang vector vector_length(32) private(j)
     for (j = 0; j < nState; j++) {
       x[j] = 0.0;      // zero initial guess (x_0) for CG
       r[j] = -g[j];          //initial residual r0 = b -Ax = -g 
-      p[j] = r[j];    //inital direction po = r0 
+      if (precondition) z[j] = Minv[j]*r[j];
+      p[j] = z[j];    //inital direction po = z0
     }
+    rz = precondition ? dotProduct(r, z) : grad_dot;
     r0_norm = n_grad;
 
     neg_curve = 0; //negative curvature check 
@@ -198,36 +607,56 @@ void CostFunction::truncatedNewton(real* qstate, real* g, const real ftol)
     }
 
   }
+    if (deflate) {
+      //Galerkin initial guess from the recycled space, x0 = W*(W^T*A*W)^-1*W^T*b,
+      //so that r0 = b - A*x0 is orthogonal to W
+      recycleProject(recycleW, r, mu.data());
+      for (i = 0; i < recycleStored; i++) {
+	waxpy(x, x, mu[i], recycleW + (int64_t)i*nState);
+	waxpy(r, r, -mu[i], recycleAW + (int64_t)i*nState);
+      }
+      if (precondition) {
+	#pragma omp parallel for
+	for (j = 0; j < nState; j++) z[j] = Minv[j]*r[j];
+      }
+      rz = dotProduct(r, z);
+      //p0 = z0 - W*(W^T*A*W)^-1*(A*W)^T*z0
+      copyVector(z, p);
+      recycleProject(recycleAW, z, mu.data());
+      for (i = 0; i < recycleStored; i++) waxpy(p, p, -mu[i], recycleW + (int64_t)i*nState);
+    }
+    if (collect) {
+      //first Lanczos vector z0/sqrt(<r0, z0>)
+      #pragma omp parallel for
+      for (j = 0; j < nState; j++) lanczos[j] = z[j]/sqrt(rz);
+    }
     //CG LOOP
     for (cg_its = 0; cg_its < cg_itmax; cg_its ++){
 
       //update search direction
       if (cg_its == 0) {
-	//rr = <r0, r0>
-	rr = grad_dot;
-	//already have set p0 to r0	
+	//rz = <r0, z0>, which is <r0, r0> without a preconditioner
+	//already have set p0 to z0
       } else {
-	// rr calculated at end of last loop
-	//Beta = <r_k, r_k>/<r_k-1, r_k-1>         
-	beta = rr/rr_m1;
-	// p_k = r_k + beta*p_k-1
-        #pragma acc parallel loop gang vector vector_length(32)
-	for (int j = 0; j < nState; j++) {
-  	   p[j] = r[j] + beta*p[j];
+	// rz calculated at end of last loop
+	//Beta = <r_k, z_k>/<r_k-1, z_k-1>
+	beta = rz/rz_m1;
+	// p_k = z_k + beta*p_k-1
+	xpby(z, beta, p);
+	// keep p_k A-orthogonal to the recycled space
+	if (deflate) {
+	  recycleProject(recycleAW, z, mu.data());
+	  for (i = 0; i < recycleStored; i++) waxpy(p, p, -mu[i], recycleW + (int64_t)i*nState);
 	}
       }
 
       //Find A*p
       funcHessian(p, Ap);
 
-      // alpha = <r_k, r_k>  / <Ap_k, p_k> 
-      pAp = 0.0;
-      #pragma acc parallel loop reduction(+:pAp)
-      for (j=0; j < nState; j++) {
-	  pAp += p[j]*Ap[j];
-      }
+      // alpha = <r_k, z_k>  / <Ap_k, p_k>
+      pAp = dotProduct(p, Ap);
      
-      alpha = rr/pAp;
+      alpha = rz/pAp;
 
       //check for negative curvature
       if (pAp < 0) {
@@ -238,16 +667,37 @@ void CostFunction::truncatedNewton(real* qstate, real* g, const real ftol)
 	 }
       }
       
-      //update x and r and compute <r_k+1, r_k+1>
+      //update x and r and compute <r_k+1, r_k+1> and <r_k+1, z_k+1>
       //x_k+! = x_k + alpha*p_k
       //r_k+1 = r_k - alpha*A*p_k
-      rr_m1 = rr;
-      rr = 0.0;
-      #pragma acc parallel loop gang vector vector_length(32) reduction(+:rr)
-      for (int j=0; j< nState; j++){
-	x[j] = x[j] + alpha*p[j];
-	r[j] = r[j] - alpha*Ap[j];  
-	rr += r[j]*r[j];
+      //z_k+1 = M^-1*r_k+1
+      rz_m1 = rz;
+      rr = cgUpdate(alpha, p, Ap, x, r, precondition ? Minv : NULL, z, rz);
+
+      //The Hessian is not exactly symmetric (the filters are applied as their own adjoints),
+      //so restore W^T*r = 0 with another Galerkin correction of x and r
+      if (deflate) {
+	recycleProject(recycleW, r, mu.data());
+	for (i = 0; i < recycleStored; i++) {
+	  waxpy(x, x, mu[i], recycleW + (int64_t)i*nState);
+	  waxpy(r, r, -mu[i], recycleAW + (int64_t)i*nState);
+	}
+	if (precondition) {
+	  #pragma omp parallel for
+	  for (j = 0; j < nState; j++) z[j] = Minv[j]*r[j];
+	}
+	rr = dotProduct(r, r);
+	rz = precondition ? dotProduct(r, z) : rr;
+      }
+
+      //CG coefficients and the next Lanczos vector z_k+1/sqrt(<r_k+1, z_k+1>)
+      if (collect && lanczosSteps == cg_its && cg_its < lanczosMax && pAp > 0 && rz > 0) {
+	lanczosAlpha[cg_its] = alpha;
+	lanczosBeta[cg_its] = rz/rz_m1;
+	real *v = lanczos + (int64_t)(cg_its+1)*nState;
+	#pragma omp parallel for
+	for (j = 0; j < nState; j++) v[j] = z[j]/sqrt(rz);
+	lanczosSteps = cg_its + 1;
       }
 	   
       //CG cconvergence check
@@ -263,8 +713,24 @@ void CostFunction::truncatedNewton(real* qstate, real* g, const real ftol)
 
       if (neg_curve) break; //this is only at its = 0 => otherwise we already left the loop
 
+      //<r, z> can lose sign with the preconditioner, since the filtered Hessian is not
+      //exactly symmetric. Stop here and keep x
+      if (precondition && !(rz > 0)) {
+	std::cerr << "Warning: preconditioned CG broke down at iteration " << cg_its + 1 << endl;
+	break;
+      }
+
     } //end of CG loop 
     total_cg_its += cg_its + 1;
+    cout << "\tNewton Iteration: " << its << "\t" << std::min(cg_its + 1, cg_itmax) << " inner CG iterations"
+	 << (precondition ? " (preconditioned)" : "");
+    if (deflate) cout << " (deflated with " << recycleStored << " Ritz vectors)";
+    cout << endl;
+
+    if (collect && !neg_curve && lanczosSteps > 0) {
+      recycleExtract(lanczosSteps, lanczos, lanczosAlpha.data(), lanczosBeta.data(),
+		     precondition ? Minv : NULL);
+    }
 
     //Update Newton step 
     //qstate_new = q_state + alpha*d_k
@@ -274,7 +740,20 @@ void CostFunction::truncatedNewton(real* qstate, real* g, const real ftol)
     //Use MT linesearch instead (input state, gradient, search dir, fval, initstep)
     //also returns the gradient
 #pragma acc update host(x[0:nState])
-    ls_ret = MTLineSearch(qstate, g, x, &f_val, initstep); 
+    ls_ret = -1;
+    if (exactStep && !confirmStep) {
+      //The CG residual is r = -g - H*x, so the Hessian product along the
+      //Newton direction is known without another evaluation
+#pragma acc update host(r[0:nState])
+      #pragma omp parallel for
+      for (j = 0; j < nState; j++) {
+        Ap[j] = -g[j] - r[j];
+      }
+#pragma acc update device(Ap[0:nState])
+      ls_ret = exactLineSearch(qstate, g, x, Ap, &f_val);
+      gradientEvaluated = (ls_ret < 0);
+    }
+    if (ls_ret < 0) ls_ret = MTLineSearch(qstate, g, x, &f_val, initstep); 
 
 
   } //end of Netwon loop
@@ -284,11 +763,14 @@ void CostFunction::truncatedNewton(real* qstate, real* g, const real ftol)
   GPTLstop("CostFunction::TruncNewton");
 
 
-  #pragma acc exit data delete(r,x,p,Ap)
+  #pragma acc exit data delete(r,x,p,Ap,Minv,zp)
   delete[] r;
   delete[] x;
   delete[] p;
   delete[] Ap;
+  delete[] Minv;
+  delete[] zp;
+  delete[] lanczos;
 
   return;
 
@@ -302,6 +784,7 @@ void CostFunction::conjugateGradient(real* q, real* xi, const real ftol, real fr
 
 	real gg, gam, fq, dgg, gy, gd, dd, yy, dy, sy, sg, eta;
 	real n_init_grad, n_grad;;
+	bool exact = false;
 
 
 	real* g = new real[nState];
@@ -309,6 +792,7 @@ void CostFunction::conjugateGradient(real* q, real* xi, const real ftol, real fr
 	real* y = new real[nState]; //added for alternative beta calculation
 	real* s = new real[nState]; //added for alternative beta calculation
 	real*q_prev = new  real[nState]; //added for alternative beta calculation
+	real* Hh = exactStep ? new real[nState] : NULL; //Hessian times the search direction
 
 	verbose = S_VERBOSE;
 
@@ -319,13 +803,10 @@ void CostFunction::conjugateGradient(real* q, real* xi, const real ftol, real fr
 	funcGradient(q, xi); //now xi is the gradient
 
 	//AB - find the norm of the initial gradient - its own loop for now
-	n_init_grad = 0.0;
-	for (j=0; j< nState; j++) {
-	  n_init_grad += xi[j]*xi[j];
-	}
-	n_init_grad = sqrt(n_init_grad);
+	n_init_grad = sqrt(dotProduct(xi, xi));
 	cout << "\tINIT NORM GRADIENT = " << n_init_grad << endl;
 
+	#pragma omp parallel for
 	for (j=0; j<nState; j++) {
 	 	g[j] = -xi[j]; // g are search directions - start with negative gradient
 		xi[j] = h[j] = g[j];  //set xi and h to neg gradient also 
@@ -344,7 +825,18 @@ void CostFunction::conjugateGradient(real* q, real* xi, const real ftol, real fr
 		   minimizing f(q + alpha*xi) xi_new = q + alpha*xi
 		*/
 
-		dlinmin(q, xi, fret);
+		exact = false;
+		if (exactStep) {
+		  /* exact step along h for the quadratic cost: the gradient at q is -g,
+		     and the new gradient -g + alpha*H*h is left in Hh */
+		  funcHessian(h, Hh);
+		  #pragma omp parallel for
+		  for (j=0; j<nState; j++) s[j] = -g[j];
+		  fret = fq;
+		  exact = (exactLineSearch(q, s, h, Hh, &fret) == 0);
+		  if (exact) copyVector(s, Hh);
+		}
+		if (!exact) dlinmin(q, xi, fret);
 
 		/*convergence check */
 		if (S_CG_CONV_TYPE ==1) {
@@ -357,11 +849,7 @@ void CostFunction::conjugateGradient(real* q, real* xi, const real ftol, real fr
 			cout << "FINAL step size convergence value = " << gg << endl;
 
 			//Let's also see what the relative gradient norm is
-			n_grad = 0.0;
-			for (j=0; j< nState; j++) {
-			  n_grad += g[j]*g[j];
-			}
-			n_grad = sqrt(n_grad);
+			n_grad = sqrt(dotProduct(g, g));
 			dd = n_grad/n_init_grad;
 			cout << "(Note: Relative norm of gradient = " << dd << ")" << endl;
 			
@@ -370,6 +858,7 @@ void CostFunction::conjugateGradient(real* q, real* xi, const real ftol, real fr
       delete[] y;
       delete[] s;
       delete[] q_prev;
+      delete[] Hh;
 			GPTLstop("CostFunction::ConjugateGradient");
 
 			return;
@@ -386,6 +875,7 @@ void CostFunction::conjugateGradient(real* q, real* xi, const real ftol, real fr
 		      delete[] y;
 		      delete[] s;
 		      delete[] q_prev;
+		      delete[] Hh;
 		      GPTLstop("CostFunction::ConjugateGradient");
 
 		      cout << "FINAL  ||g(X)||/||g(X0)|| = " << gg << endl;
@@ -396,16 +886,16 @@ void CostFunction::conjugateGradient(real* q, real* xi, const real ftol, real fr
 
 
 		fq = fret;
-		/* calculate new gradient (xi) */
-		funcGradient(q, xi);
+		/* calculate new gradient (xi), already known after an exact step */
+		if (exact) {
+		  copyVector(Hh, xi);
+		} else {
+		  funcGradient(q, xi);
+		}
 
 		//AB: for checking rel norm of the gradient
 		if (S_CG_CONV_TYPE != 1) {
-		  n_grad = 0.0;
-		  for (j=0; j< nState; j++) {
-		    n_grad += xi[j]*xi[j];
-		  }
-		  n_grad = sqrt(n_grad);
+		  n_grad = sqrt(dotProduct(xi, xi));
 		  dd = n_grad/n_init_grad;
 		  if (verbose) cout << "\t\t\tRelative norm of gradient = " << dd << endl;
 		  if (verbose) cout << "\t\t\tNorm of gradient = " << n_grad << endl;
@@ -416,10 +906,8 @@ void CostFunction::conjugateGradient(real* q, real* xi, const real ftol, real fr
 		dgg = gg = gy = gd = yy = dy = sy = sg = dd= 0.0;
 		switch(S_BETA_TYPE) {
 		    case 1: // Polak-Ribiere (PR) - original choice in Samurai
-		      for (j=0; j<nState; j++) {
-						gg += g[j]*g[j]; // beta denominator 
-						dgg += (xi[j]+g[j])*xi[j]; // numerator
-		      }
+		      gg = dotProduct(g, g); // beta denominator
+		      dgg = vectorSum(nState, [&](const int64_t& j) { return (xi[j]+g[j])*xi[j]; }); // numerator
 		      if (gg == 0.0) {  //unlikely
 		        GPTLstop("CostFunction::ConjugateGradient");
 						return;
@@ -428,10 +916,8 @@ void CostFunction::conjugateGradient(real* q, real* xi, const real ftol, real fr
 		      //cout << "\tAB Beta: " << gam << endl;
 		      break;
 		   case 2: // Polak-Ribiere-Polyak (PRP+)  - same as PR +  restart
-		      for (j=0; j<nState; j++) {
-						gg += g[j]*g[j]; // beta denominator 
-						dgg += (xi[j]+g[j])*xi[j]; // numerator
-		      }
+		      gg = dotProduct(g, g); // beta denominator
+		      dgg = vectorSum(nState, [&](const int64_t& j) { return (xi[j]+g[j])*xi[j]; }); // numerator
 		      if (gg == 0.0) {  //unlikely
 		        GPTLstop("CostFunction::ConjugateGradient");
 						return;
@@ -441,10 +927,8 @@ void CostFunction::conjugateGradient(real* q, real* xi, const real ftol, real fr
 		      gam = CF_MAX(gam, 0.0); //added to 'restart' if gam is negative 
 		      break;
 		   case 3: /* Fletcher-Reeves (FR) */
-		     for (j=0; j<nState; j++) {
-		       gg += g[j]*g[j]; // beta denominator 
-		       dgg += xi[j]*xi[j]; // numerator
-		     }
+		     gg = dotProduct(g, g); // beta denominator
+		     dgg = dotProduct(xi, xi); // numerator
 		     if (gg == 0.0) {  //unlikely
 		       GPTLstop("CostFunction::ConjugateGradient");
 		       return;
@@ -453,11 +937,9 @@ void CostFunction::conjugateGradient(real* q, real* xi, const real ftol, real fr
 		     break;
 		   case 4: /*Dai-Yuan (DY) - this may need a special linesearch...*/
 		     /* need to define y */
-		     for (j=0; j < nState; j++) {
-		       y[j] = xi[j] + g[j];
-		       dgg +=  xi[j]*xi[j]; /*DY beta numerator*/ 
-		       gg +=  y[j]*h[j]; /*DY denominator*/
-		     }
+		     waxpy(y, xi, 1.0, g);
+		     dgg = dotProduct(xi, xi); /*DY beta numerator*/
+		     gg = dotProduct(y, h); /*DY denominator*/
 		     if (gg == 0.0) {  //unlikely :)
 		       GPTLstop("CostFunction::ConjugateGradient");
 		       return;
@@ -466,15 +948,13 @@ void CostFunction::conjugateGradient(real* q, real* xi, const real ftol, real fr
 		     break;
     	 case 5: /* Hager-Zhang (HZ) */
 		     /* need to define y */
-		     for (j=0; j< nState; j++) {
-		       y[j] = xi[j] + g[j];
-		       dy += y[j]*h[j];  
-		       yy += y[j]*y[j];
-		       gy += xi[j]*y[j];
-		       gd += xi[j]*h[j];
-		       gg += g[j]*g[j];
-		       dd += h[j]*h[j];
-		     }
+		     waxpy(y, xi, 1.0, g);
+		     dy = dotProduct(y, h);
+		     yy = dotProduct(y, y);
+		     gy = dotProduct(xi, y);
+		     gd = dotProduct(xi, h);
+		     gg = dotProduct(g, g);
+		     dd = dotProduct(h, h);
 		     if (dy == 0.0) { 
 		       cout << "\tAB - HZ error in dy" << endl;
 		       GPTLstop("CostFunction::ConjugateGradient");
@@ -490,16 +970,14 @@ void CostFunction::conjugateGradient(real* q, real* xi, const real ftol, real fr
 		     gam = CF_MAX(gam, eta);
 		     break;
 		   case 6: //Dai-Kou ((DK) 2013
-		     for (j=0; j< nState; j++) {
-		       y[j] = xi[j] + g[j];
-		       s[j] = q[j] - q_prev[j];
-		       dy += y[j]*h[j];  
-		       yy += y[j]*y[j];
-		       gy += xi[j]*y[j];
-                       sy += s[j]*y[j];
-		       sg += s[j]*xi[j];
-		       q_prev[j] = q[j]; //for next iteration
-		     }
+		     waxpy(y, xi, 1.0, g);
+		     waxpy(s, q, -1.0, q_prev);
+		     dy = dotProduct(y, h);
+		     yy = dotProduct(y, y);
+		     gy = dotProduct(xi, y);
+		     sy = dotProduct(s, y);
+		     sg = dotProduct(s, xi);
+		     copyVector(q, q_prev); //for next iteration
 
 		     gam = (gy/dy)-((yy/sy)*(sg/dy));
 		     break;
@@ -508,6 +986,7 @@ void CostFunction::conjugateGradient(real* q, real* xi, const real ftol, real fr
 
 		/* Update the new search direction (xi) 
 		   and h[i] is the prev. search direction */
+		#pragma omp parallel for
 		for (j=0; j<nState; j++) {
 			g[j] = -xi[j];
 			xi[j] = h[j] = g[j] + gam*h[j];
@@ -519,12 +998,290 @@ void CostFunction::conjugateGradient(real* q, real* xi, const real ftol, real fr
 	delete[] y;
 	delete[] s;
 	delete[] q_prev;
+	delete[] Hh;
 
 	cout << "Iterations exceeded in inner minimization loop" << endl;
 	GPTLstop("CostFunction::ConjugateGradient");
 	return;
 }
 
+/* Limited-memory BFGS (Nocedal and Wright, Algorithms 7.4 and 7.5). The
+   inverse Hessian is approximated from the last lbfgsHistory pairs
+   s = q_k+1 - q_k and y = g_k+1 - g_k by the two-loop recursion, starting
+   from s.y/y.y of the newest pair times the identity. The step is found
+   with the MT line search, which also returns the new gradient */
+void CostFunction::lbfgs(real* qstate, real* g, const real ftol)
+{
+  // qstate = current state (updated here)
+  // g = current gradient
+  // ftol = desired solving tolerance
+
+  GPTLstart("CostFunction::LBFGS");
+
+  int its, i, j, k;
+  int stored, newest;
+  int ls_ret;
+  int verbose = S_VERBOSE;
+
+  real f_val, n_init_grad, n_grad, gg;
+  real sy, yy, gamma, beta;
+  real initstep = 1.0;
+
+  const int m = lbfgsHistory;
+  real *d = new real[nState];
+  real *q_prev = new real[nState];
+  real *g_prev = new real[nState];
+  real *Hd = exactStep ? new real[nState] : NULL;
+  real *S = new real[(int64_t)m*nState];
+  real *Y = new real[(int64_t)m*nState];
+  real *rho = new real[m];
+  real *alpha = new real[m];
+  real *s, *y;
+
+#pragma acc data copyin(qstate[:nState]) copyout(g[:nState])
+  {
+    f_val = funcValueAndGradient(qstate, g);
+  }
+  n_init_grad = sqrt(dotProduct(g, g));
+
+  // the pairs are kept in a ring, newest is the slot of the last one
+  stored = 0;
+  newest = m - 1;
+  gamma = 1.0;
+
+  for (its = 0; its < S_MAXITER; its++) {
+
+    n_grad = sqrt(dotProduct(g, g));
+    gg = n_grad/n_init_grad;
+    cout << "\tL-BFGS Iteration: " << its << "\tJ = " << f_val << "\tResidual = " << n_grad << endl;
+
+    if (gg < ftol) {
+      cout << "\tMinimum J: " << f_val << endl;
+      cout << "\tFound minimum in " << its << " L-BFGS iterations." << endl;
+      cout << "\tFINAL  ||g(X)||/||g(X0)|| = " << gg << endl;
+      break;
+    }
+
+    // Two-loop recursion for the search direction d = -H_k*g. The recursion is
+    // linear, so starting from -g gives the direction without a final negation
+    #pragma omp parallel for
+    for (j = 0; j < nState; j++) d[j] = -g[j];
+    for (i = 0; i < stored; i++) {
+      k = (newest - i + m) % m;
+      alpha[k] = rho[k]*dotProduct(S + (int64_t)k*nState, d);
+      waxpy(d, d, -alpha[k], Y + (int64_t)k*nState);
+    }
+    #pragma omp parallel for
+    for (j = 0; j < nState; j++) d[j] *= gamma;
+    for (i = stored - 1; i >= 0; i--) {
+      k = (newest - i + m) % m;
+      beta = rho[k]*dotProduct(Y + (int64_t)k*nState, d);
+      waxpy(d, d, alpha[k] - beta, S + (int64_t)k*nState);
+    }
+
+    copyVector(qstate, q_prev);
+    copyVector(g, g_prev);
+    ls_ret = -1;
+    if (exactStep) {
+      funcHessian(d, Hd);
+      if (exactLineSearch(qstate, g, d, Hd, &f_val) == 0) ls_ret = 1;
+    }
+    if (ls_ret < 0) ls_ret = MTLineSearch(qstate, g, d, &f_val, initstep);
+    if (ls_ret != 1) {
+      // no acceptable step along d, restart from steepest descent or give up
+      if (stored == 0) {
+        cout << "\tL-BFGS: no acceptable step along the steepest descent direction" << endl;
+        cout << "\tMinimum J: " << f_val << endl;
+        cout << "\tFINAL  ||g(X)||/||g(X0)|| = " << sqrt(dotProduct(g, g))/n_init_grad << endl;
+        break;
+      }
+      cout << "\tL-BFGS: line search failed, discarding the " << stored << " stored pairs" << endl;
+      stored = 0;
+      gamma = 1.0;
+      continue;
+    }
+
+    // Store the new pair, skipping it if the curvature condition fails
+    k = (newest + 1) % m;
+    s = S + (int64_t)k*nState;
+    y = Y + (int64_t)k*nState;
+    waxpy(s, qstate, -1.0, q_prev);
+    waxpy(y, g, -1.0, g_prev);
+    sy = dotProduct(s, y);
+    yy = dotProduct(y, y);
+    if (sy > 0.0) {
+      newest = k;
+      rho[k] = 1.0/sy;
+      gamma = sy/yy;
+      stored = std::min(stored + 1, m);
+    } else if (verbose) {
+      cout << "\t\tL-BFGS: skipping pair with s.y = " << sy << endl;
+    }
+  }
+
+  if (its == S_MAXITER) cout << "Iterations exceeded in L-BFGS: " << its << endl;
+
+  delete[] d;
+  delete[] q_prev;
+  delete[] g_prev;
+  delete[] Hd;
+  delete[] S;
+  delete[] Y;
+  delete[] rho;
+  delete[] alpha;
+
+  GPTLstop("CostFunction::LBFGS");
+}
+
+// Solve A*X = B for the k x k symmetric positive definite A by Cholesky, overwriting B
+// with X. Returns false if A is not numerically positive definite
+static bool choleskySolve(const int& k, const real* A, real* B)
+{
+  std::vector<real> L(k*k, 0.0);
+  for (int j = 0; j < k; j++) {
+    real d = A[j*k+j];
+    for (int l = 0; l < j; l++) d -= L[j*k+l]*L[j*k+l];
+    if (d <= 1.0e-14*fabs(A[j*k+j])) return false;
+    L[j*k+j] = sqrt(d);
+    for (int i = j+1; i < k; i++) {
+      real s = A[i*k+j];
+      for (int l = 0; l < j; l++) s -= L[i*k+l]*L[j*k+l];
+      L[i*k+j] = s/L[j*k+j];
+    }
+  }
+  for (int c = 0; c < k; c++) {
+    for (int i = 0; i < k; i++) {
+      real s = B[i*k+c];
+      for (int l = 0; l < i; l++) s -= L[i*k+l]*B[l*k+c];
+      B[i*k+c] = s/L[i*k+i];
+    }
+    for (int i = k-1; i >= 0; i--) {
+      real s = B[i*k+c];
+      for (int l = i+1; l < k; l++) s -= L[l*k+i]*B[l*k+c];
+      B[i*k+c] = s/L[i*k+i];
+    }
+  }
+  return true;
+}
+
+/* Block conjugate gradient (O'Leary 1980) for the Hessian system H*X = B with k
+   right-hand sides interleaved as X[n*k+b], starting from X = 0. Each iteration
+   applies the Hessian to the whole block of directions at once. When a right-hand
+   side converges it is dropped and the iteration restarts with the rest, which keeps
+   P^T*H*P well conditioned. Returns the number of block iterations */
+int CostFunction::blockConjugateGradient(const int& k, const real* B, real* X)
+{
+  GPTLstart("CostFunction::blockConjugateGradient");
+
+  int its = 0;
+  int verbose = S_VERBOSE;
+  const real tol = S_INNER_CONV_TOL;
+  int64_t n;
+  int a, b, i;
+
+  real *R = new real[(int64_t)k*nState];
+  std::vector<real> G(k*k), bnorm(k);
+  std::vector<int> active;
+  blockProduct(k, B, B, G.data());
+  for (b = 0; b < k; b++) {
+    bnorm[b] = sqrt(G[b*k+b]);
+    if (bnorm[b] > 0.0) active.push_back(b);
+  }
+  #pragma omp parallel for
+  for (n = 0; n < (int64_t)k*nState; n++) {
+    X[n] = 0.0;
+    R[n] = B[n];
+  }
+
+  while (!active.empty() and (its < S_INNER_MAXITER)) {
+    // Gather the active columns of X and R into blocks of width ka
+    const int ka = active.size();
+    real *Xa = new real[(int64_t)ka*nState];
+    real *Ra = new real[(int64_t)ka*nState];
+    real *P = new real[(int64_t)ka*nState];
+    real *Q = new real[(int64_t)ka*nState];
+    std::vector<real> RtR(ka*ka), RtRnew(ka*ka), PtQ(ka*ka), coef(ka*ka);
+    #pragma omp parallel for
+    for (n = 0; n < nState; n++) {
+      for (int a = 0; a < ka; a++) {
+	Xa[n*ka+a] = X[n*k+active[a]];
+	Ra[n*ka+a] = P[n*ka+a] = R[n*k+active[a]];
+      }
+    }
+    blockProduct(ka, Ra, Ra, RtR.data());
+
+    std::vector<int> converged;
+    bool breakdown = false;
+    while (converged.empty() and (its < S_INNER_MAXITER)) {
+      its++;
+      funcHessianBlock(ka, P, Q);
+
+      // alpha = (P^T*H*P)^-1 * R^T*R
+      blockProduct(ka, P, Q, PtQ.data());
+      for (a = 0; a < ka; a++) {
+	for (b = 0; b < a; b++) PtQ[a*ka+b] = PtQ[b*ka+a] = 0.5*(PtQ[a*ka+b] + PtQ[b*ka+a]);
+      }
+      coef = RtR;
+      if (!choleskySolve(ka, PtQ.data(), coef.data())) {
+	cout << "\tBlock CG: P^T*H*P is not positive definite, stopping" << endl;
+	breakdown = true;
+	break;
+      }
+      // X += P*alpha, R -= Q*alpha
+      blockUpdate(ka, P, coef.data(), Xa);
+      for (i = 0; i < ka*ka; i++) coef[i] = -coef[i];
+      blockUpdate(ka, Q, coef.data(), Ra);
+      blockProduct(ka, Ra, Ra, RtRnew.data());
+
+      real worst = 0.0;
+      for (a = 0; a < ka; a++) {
+	real rel = sqrt(RtRnew[a*ka+a])/bnorm[active[a]];
+	worst = std::max(worst, rel);
+	if (rel < tol) converged.push_back(a);
+      }
+      if (verbose) cout << "\t\tBlock CG iteration " << its << ": " << ka << " active, max rel_resid = " << worst << endl;
+
+      // beta = (R^T*R)^-1 * R_new^T*R_new, P = R + P*beta
+      coef = RtRnew;
+      if (!choleskySolve(ka, RtR.data(), coef.data())) {
+	breakdown = true;
+	break;
+      }
+      // Q is free once R is updated, so build the new directions there
+      #pragma omp parallel for
+      for (n = 0; n < (int64_t)ka*nState; n++) Q[n] = Ra[n];
+      blockUpdate(ka, P, coef.data(), Q);
+      std::swap(P, Q);
+      RtR = RtRnew;
+    }
+
+    // Scatter back and drop the converged columns
+    #pragma omp parallel for
+    for (n = 0; n < nState; n++) {
+      for (int a = 0; a < ka; a++) {
+	X[n*k+active[a]] = Xa[n*ka+a];
+	R[n*k+active[a]] = Ra[n*ka+a];
+      }
+    }
+    delete[] Xa;
+    delete[] Ra;
+    delete[] P;
+    delete[] Q;
+    if (breakdown) break;
+    for (i = (int)converged.size()-1; i >= 0; i--) active.erase(active.begin() + converged[i]);
+  }
+
+  if (active.empty()) {
+    cout << "\tBlock CG: " << k << " right-hand sides converged in " << its << " block iterations" << endl;
+  } else {
+    cout << "\tBlock CG: " << active.size() << " of " << k << " right-hand sides not converged after "
+	 << its << " block iterations" << endl;
+  }
+  delete[] R;
+  GPTLstop("CostFunction::blockConjugateGradient");
+  return its;
+}
+
 /* line minimization - using derivatives */
 void CostFunction::dlinmin(real* &p, real* &xi, real &fret)
 {
@@ -535,15 +1292,14 @@ void CostFunction::dlinmin(real* &p, real* &xi, real &fret)
 	int verbose = S_VERBOSE;
 
 	// Fill the temporary state vector
-	for (j=0; j<nState; j++) {
-		tempState[j] = p[j];
-		tempGradient[j] = xi[j];
-	}
+	copyVector(p, tempState);
+	copyVector(xi, tempGradient);
 	ax = 0.0;
 	xx = 1.0;
 	xmin = 0.0;
 	mnbrack(ax,xx,bx,fa,fx,fb);
 	fret = dbrent(ax,xx,bx,TOL,xmin);
+	#pragma omp parallel for
 	for (j=0; j<nState; j++) {
 		xi[j] *= xmin;
 		p[j] += xi[j];
@@ -557,9 +1313,8 @@ void CostFunction::dlinmin(real* &p, real* &xi, real &fret)
 real CostFunction::f1dim(const real x)
 {
   GPTLstart("CostFunction::f1dim");
-	int j;
 	real f1 = 0.0;
-	for (j=0; j<nState; j++) xt[j] = tempState[j] + x*tempGradient[j];
+	waxpy(xt, tempState, x, tempGradient);
 	f1 = funcValue(xt);
 	
 	
@@ -571,14 +1326,10 @@ real CostFunction::f1dim(const real x)
 real CostFunction::df1dim(const real x)
 {
   GPTLstart("CostFunction::df1dim");
-	int j;
 	real df1 = 0.0;
-	for (j=0; j<nState; j++) {
-		xt[j] = tempState[j] + x*tempGradient[j];
-		df[j] = 0;
-	}
+	waxpy(xt, tempState, x, tempGradient);
 	funcGradient(xt, df);
-	for (j=0; j<nState; j++) df1 += df[j]*tempGradient[j];
+	df1 = dotProduct(df, tempGradient);
 
 
   GPTLstop("CostFunction::df1dim");
@@ -591,21 +1342,15 @@ real CostFunction::f1dim_and_df1dim(const real x, real *grad)
 
   GPTLstart("CostFunction::f1dim_and_df1dim");
 
-  int j;
   real df1 = 0.0;
   real f1 = 0.0;
-  for (j=0; j<nState; j++) {
-    xt[j] = tempState[j] + x*tempGradient[j];
-    df[j] = 0;
-  }
+  waxpy(xt, tempState, x, tempGradient);
   #pragma acc data copyin(xt[0:nState]) copyout(df[0:nState]) 
   {
   f1 = funcValueAndGradient(xt, df);  
   }
 
-  for (j=0; j<nState; j++) {
-    df1 += df[j]*tempGradient[j]; 
-  }
+  df1 = dotProduct(df, tempGradient);
 
   *grad = df1;
 
@@ -791,6 +1536,36 @@ void CostFunction::mnbrack(real &ax, real &bx, real &cx,
   GPTLstop("CostFunction::mnbrack");
 }
 
+/* Exact step for the quadratic cost along the search direction s, given
+   the Hessian product Hs. The minimizer is alpha = -g.s/s.Hs and the cost
+   and gradient follow from the quadratic without another evaluation.
+   Returns -1 and leaves x, g and fval untouched if the curvature along s
+   is not positive */
+
+int CostFunction::exactLineSearch(real* x, real* g, const real* s, const real* Hs, real* fval)
+{
+  GPTLstart("CostFunction::exactLineSearch");
+
+  int verbose = S_VERBOSE;
+  real gs = dotProduct(g, s);
+  real sHs = dotProduct(s, Hs);
+  if (sHs <= 0.0) {
+    cout << "\t\tExact LS: non-positive curvature " << sHs << " along the search direction" << endl;
+    GPTLstop("CostFunction::exactLineSearch");
+    return -1;
+  }
+
+  real alpha = -gs / sHs;
+  waxpy(x, x, alpha, s);
+  waxpy(g, g, alpha, Hs);
+  *fval += alpha * gs + 0.5 * alpha * alpha * sHs;
+
+  if (verbose) cout << "\t\tExact LS: step = " << alpha << endl;
+
+  GPTLstop("CostFunction::exactLineSearch");
+  return 0;
+}
+
 //More-and Thuente line search
 /* Translation of minpack subroutine cvsrch, whose
    purpose is to find a step which satisfies 
@@ -807,7 +1582,7 @@ int CostFunction::MTLineSearch(real* &x, real* &g, real *s, real *fval, real ini
   // fval = function values (input/output)
   // initstep = initial step length (should be 1.0 for Newton)
 
-  int j, i;
+  int i;
   int n, bracket, stage1, max_funcs, infoc;
   int reason; // 0 = continue, 1= success, -3 = not search dir, 3 = halted, 4 = halted at max funcs
               // 5 = step at upper bound, 6 = step at lower bound, 7 = halted rtol
@@ -831,11 +1606,7 @@ int CostFunction::MTLineSearch(real* &x, real* &g, real *s, real *fval, real ini
 {
 
   //compute dginit <g,s> (inital gradient in the search direction)
-  dginit = 0.0;
-  #pragma acc parallel loop reduction(+:dginit)
-  for (j=0; j< nState; j++){
-    dginit += g[j]*s[j];
-  }
+  dginit = dotProduct(g, s);
   
   if (dginit >= 0.0) {
     cout << "Search direction is not a descent direction! dginit = " << dginit << endl;
@@ -874,10 +1645,7 @@ int CostFunction::MTLineSearch(real* &x, real* &g, real *s, real *fval, real ini
   step = initstep;
 
   //copy the orig x into the work vector
-  #pragma acc parallel loop private(j)
-  for (j=0; j<nState; j++) {
-    mt_work[j] = x[j];
-  }
+  copyVector(x, mt_work);
 
   //Begin iteration
   for (i=0; i< max_funcs; i++){
@@ -903,19 +1671,12 @@ int CostFunction::MTLineSearch(real* &x, real* &g, real *s, real *fval, real ini
     //  Evaluate the function and gradient at step and compute the directional derivative.
     //the orig x was copied into the work vector
     //x = x-orig + step * s;
-    #pragma acc parallel loop private(j)
-    for (j = 0; j<nState; j++) {
-      x[j] = mt_work[j] + step*s[j];
-    }
+    waxpy(x, mt_work, step, s);
     *fval = funcValueAndGradient(x, g); //f is func value at x is g is gradient at x
     ls_cnt ++;
     n_feval++; 
     //compute dg = <g,s>
-    dg = 0.0;
-    #pragma acc parallel loop reduction(+:dg)
-    for (j = 0; j< nState; j++){
-      dg += g[j]*s[j];
-    }
+    dg = dotProduct(g, s);
     ftest1 = finit + step*dgtest;
 
     //to compare with PETSc -tao_ls_monitor
@@ -38,15 +38,59 @@ protected:
 	real* df;
 	real* mt_work;
 	const Projection& projection;
+	// Sum the vector reductions in fixed blocks, independent of the number of threads
+	bool deterministicReductions;
+	// Take the exact step of the quadratic cost instead of searching along the direction
+	bool exactStep;
+	// Minimization algorithm, S_SOLVER unless set at run time, and the L-BFGS history length
+	int solver;
+	int lbfgsHistory;
+
+	enum SolverTypes {
+		SOLVER_TRUNCATED_NEWTON = 1,
+		SOLVER_CONJUGATE_GRADIENT = 2,
+		SOLVER_LBFGS = 3
+	};
+
+	// Krylov recycling for the truncated Newton inner CG. Up to recycleVectors Ritz vectors W
+	// of an earlier solve and A*W deflate the later solves. recycleL is the Cholesky factor
+	// of W^T*A*W, and A*W is recomputed once per minimize() since the Hessian changes between
+	// the outer analysis iterations
+	int recycleVectors;
+	int recycleStored;
+	bool recycleCurrent;
+	real* recycleW;
+	real* recycleAW;
+	real* recycleL;
 
 
 	virtual real funcValue(real* state) = 0;
 	virtual void funcGradient(real* state, real* gradient) = 0;
 	virtual real funcValueAndGradient(real* state, real* gradient) = 0;
 	virtual void funcHessian(real *x, real *hessian) = 0;
+	virtual bool funcPreconditioner(real *Minv);
+	virtual void funcHessianBlock(const int& k, real* X, real* HX);
+
+	// Threaded vector kernels over the state vector used by the solvers
+	template <typename Term> real vectorSum(const int64_t& size, const Term& term);
+	real dotProduct(const real* a, const real* b);
+	void copyVector(const real* x, real* y);
+	void xpby(const real* x, const real& beta, real* y);
+	void waxpy(real* w, const real* x, const real& alpha, const real* y);
+	real cgUpdate(const real& alpha, const real* p, const real* Ap, real* x, real* r,
+		      const real* Minv, real* z, real& rz);
+	// Kernels over k state vectors interleaved as X[n*k+b]
+	void blockProduct(const int& k, const real* X, const real* Y, real* XtY);
+	void blockUpdate(const int& k, const real* X, const real* coef, real* Y);
 
 	void truncatedNewton(real* q, real* xi, const real ftol);
 	void conjugateGradient(real* q, real* xi, const real ftol, real funcMin);
+	void lbfgs(real* qstate, real* g, const real ftol);
+	int blockConjugateGradient(const int& k, const real* B, real* X);
+	void recycleFactor();
+	void recycleProject(const real* basis, const real* v, real* mu);
+	void recycleExtract(const int& m, const real* lanczos, const real* lanczosAlpha,
+			    const real* lanczosBeta, const real* Minv);
 	void dlinmin(real* &p, real* &xi, real &fret);
 	real f1dim(const real x);
 	real df1dim(const real x);
@@ -59,6 +103,7 @@ protected:
 	void mnbrack(real &ax, real &bx, real &cx,
 				 real &fa, real &fb, real &fc);
 	int MTLineSearch(real* &x, real* &g, real *s, real *fval, real initstep);
+	int exactLineSearch(real* x, real* g, const real* s, const real* Hs, real* fval);
 	int MTcstep(real *stx, real *fx, real *dx, real* sty, real *fy, real *dy,
 		    real *stp, real *fp, real *dp, int *bracket, real *stepmin,
 		    real *stepmax);
@@ -76,4 +121,29 @@ private:
 	#pragma acc declare create(mObs,nState)
 };
 
+// Sum of term(n) for n in [0, size). In the deterministic mode the terms are summed in a
+// fixed number of blocks and the block sums are added in order
+template <typename Term>
+real CostFunction::vectorSum(const int64_t& size, const Term& term)
+{
+  real sum = 0.0;
+  if (deterministicReductions) {
+    const int64_t nblocks = 256;
+    const int64_t blockSize = (size + nblocks - 1) / nblocks;
+    real blockSum[nblocks];
+    #pragma omp parallel for
+    for (int64_t b = 0; b < nblocks; b++) {
+      real bsum = 0.0;
+      int64_t end = (b+1)*blockSize < size ? (b+1)*blockSize : size;
+      for (int64_t n = b*blockSize; n < end; n++) bsum += term(n);
+      blockSum[b] = bsum;
+    }
+    for (int64_t b = 0; b < nblocks; b++) sum += blockSum[b];
+  } else {
+    #pragma omp parallel for reduction(+:sum)
+    for (int64_t n = 0; n < size; n++) sum += term(n);
+  }
+  return sum;
+}
+
 #endif
@@ -6,7 +6,17 @@
  *
  */
 
+#include <cassert>
 #include <cmath>
+#include <algorithm>
+#include <map>
+#include <mutex>
+#include <random>
+#include <tuple>
+#include <unistd.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 #include <euclid/GeographicLib/TransverseMercatorExact.hpp>
 
 #include "CostFunction3D.h"
@@ -16,6 +26,64 @@
 
 #define INDEX(i, j, k, idim, jdim, vdim, var) ((vdim) * ((idim) * ((jdim) * (k) + j) + i) + var)
 #define KINDEX(i,dim,var) (dim * var + i)
+// Index of a node coefficient in the state vectors, in either state layout
+#define SINDEX(i, j, k, var) ((i) * iStride + (j) * jStride + (k) * kStride + (var) * varStride)
+// Observations per call to obsBasisWeights, and the weight of node n of an axis (0 = i, 1 = j, 2 = k)
+// for observation o of the block
+#define OBS_BLOCK 128
+#define BWEIGHT(w, axis, deriv, n, o) ((w)[(((axis) * 2 + (deriv)) * 4 + (n)) * OBS_BLOCK + (o)])
+
+// Random sign of entry n of a probe vector, from the splitmix64 finalizer so it is reproducible
+static inline real probeSign(uint64_t n)
+{
+  n = (n ^ (n >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  n = (n ^ (n >> 27)) * 0x94d049bb133111ebULL;
+  n ^= n >> 31;
+  return (n & 1) ? 1.0 : -1.0;
+}
+
+// Index of the calling thread's FFT buffers
+static inline int fftThread()
+{
+#ifdef _OPENMP
+  return omp_get_thread_num();
+#else
+  return 0;
+#endif
+}
+
+// Applies the configured schedule to the schedule(runtime) loops of a transform for its
+// lifetime, then restores the caller's schedule, which is shared with any embedding application
+class TransformSchedule
+{
+public:
+  TransformSchedule(const int& kind, const int& chunk) {
+#ifdef _OPENMP
+    omp_get_schedule(&savedKind, &savedChunk);
+    omp_set_schedule((omp_sched_t)kind, chunk);
+#endif
+  }
+  ~TransformSchedule() {
+#ifdef _OPENMP
+    omp_set_schedule(savedKind, savedChunk);
+#endif
+  }
+private:
+#ifdef _OPENMP
+  omp_sched_t savedKind;
+  int savedChunk;
+#endif
+};
+
+// Number of threads to allocate per-thread buffers for
+static inline int maxThreads()
+{
+#ifdef _OPENMP
+  return omp_get_max_threads();
+#else
+  return 1;
+#endif
+}
 
 CostFunction3D::CostFunction3D(const Projection& proj, const int& numObs, const int& stateSize)
   : CostFunction(proj, numObs, stateSize)
@@ -41,6 +109,12 @@ CostFunction3D::CostFunction3D(const Projection& proj, const int& numObs, const
   rankHash[PERIODIC] = 1;
   rankHash[R3] = 3;
 
+  // Set up the observation operator hash
+  hOperatorHash["csr"] = H_CSR;
+  hOperatorHash["matrix_free"] = H_MATRIX_FREE;
+  hOperatorHash["compact"] = H_COMPACT;
+  hOperatorHash["csc"] = H_CSC;
+
   // Set the derivative array
   derivative[0][0] = 0;
   derivative[0][1] = 0;
@@ -61,6 +135,53 @@ CostFunction3D::CostFunction3D(const Projection& proj, const int& numObs, const
   // Use the full basis unless otherwise specified
   basisappx = 0;
 
+  // The H matrix is built on the first call to initState
+  H = NULL;
+  IH = NULL;
+  JH = NULL;
+  I2H = NULL;
+  mPtr = NULL;
+  mVal = NULL;
+  Hnode = NULL;
+  Hbasis = NULL;
+  Hterm = NULL;
+  HtermBasis = NULL;
+  HtermVar = NULL;
+  HtermWeight = NULL;
+  HbinPtr = NULL;
+  HbinObs = NULL;
+  obsOrder = NULL;
+  obsRank = NULL;
+  IH32 = NULL;
+  JH32 = NULL;
+  I2H32 = NULL;
+  mPtr32 = NULL;
+  mVal32 = NULL;
+  Hsingle = NULL;
+  HT = NULL;
+  FFTplanned = false;
+  FFTthreads = 0;
+  fusedScratch = NULL;
+  fusedPencils = fusedRows = 0;
+  scheduleKind = 1; // omp_sched_static
+  scheduleChunk = 0;
+  FFTin = NULL;
+  FFTout = NULL;
+  iForward = iBackward = jForward = jBackward = kForward = kBackward = NULL;
+  iTileForward = iTileBackward = jSlabForward = jSlabBackward = NULL;
+  obsScaled = NULL;
+  stateVarMajor = false;
+  ioState = NULL;
+  Hvalid = false;
+  Hcompact = false;
+  HsinglePrecision = false;
+  HprescaleObs = false;
+  fuseTransforms = false;
+  blockWidth = 0;
+  blockState = NULL;
+  blockObs = NULL;
+  hOperator = H_CSR;
+
 }
 
 CostFunction3D::~CostFunction3D()
@@ -82,9 +203,14 @@ void CostFunction3D::finalize()
   #pragma acc exit data delete(CTHTd)
   delete[] CTHTd;
   delete[] stateU;
-  #pragma acc exit data delete(obsData)
+  #pragma acc exit data delete(obsData,obsScaled)
   delete[] obsData;
+  delete[] obsScaled;
   delete[] obsVector;
+  delete[] obsOrder;
+  delete[] obsRank;
+  obsOrder = NULL;
+  obsRank = NULL;
   delete[] HCq;
   #pragma acc exit data delete(innovation)
   delete[] innovation;
@@ -93,15 +219,14 @@ void CostFunction3D::finalize()
   delete[] stateA;
   delete[] stateB;
   delete[] stateC;
+  delete[] ioState;
+  delete[] blockState;
+  delete[] blockObs;
+  delete[] iBasisTable;
+  delete[] jBasisTable;
+  delete[] kBasisTable;
   // deallocate Clean-up the data that correspond to the H matrix
-  #pragma acc exit data delete(mPtr,mVal,I2H)
-  delete[] mPtr;
-  delete[] mVal;
-  delete[] I2H;
-  #pragma acc exit data delete(H,JH,IH)
-  delete[] H;
-  delete[] JH;
-  delete[] IH;
+  freeHmatrix();
 
   if (basisappx > 0) {
     delete[] basis0;
@@ -111,23 +236,42 @@ void CostFunction3D::finalize()
     delete[] iGamma[var];
     delete[] jGamma[var];
     delete[] kGamma[var];
+    delete[] iGammaRow[var];
+    delete[] jGammaRow[var];
+    delete[] kGammaRow[var];
+    delete[] iGammaCol[var];
+    delete[] jGammaCol[var];
+    delete[] kGammaCol[var];
+    delete[] iGammaIndex[var];
+    delete[] jGammaIndex[var];
+    delete[] kGammaIndex[var];
     delete[] iL[var];
     delete[] jL[var];
     delete[] kL[var];
   }
 
-  fftw_destroy_plan(iForward);
-  fftw_destroy_plan(iBackward);
-  fftw_destroy_plan(jForward);
-  fftw_destroy_plan(jBackward);
-  fftw_destroy_plan(kForward);
-  fftw_destroy_plan(kBackward);
-  fftw_free(iFFTin);
-  fftw_free(jFFTin);
-  fftw_free(kFFTin);
-  fftw_free(iFFTout);
-  fftw_free(jFFTout);
-  fftw_free(kFFTout);
+  if (FFTplanned) {
+    if (iForward != NULL) fftw_destroy_plan(iForward);
+    if (iBackward != NULL) fftw_destroy_plan(iBackward);
+    if (jForward != NULL) fftw_destroy_plan(jForward);
+    if (jBackward != NULL) fftw_destroy_plan(jBackward);
+    if (kForward != NULL) fftw_destroy_plan(kForward);
+    if (kBackward != NULL) fftw_destroy_plan(kBackward);
+    if (iTileForward != NULL) fftw_destroy_plan(iTileForward);
+    if (iTileBackward != NULL) fftw_destroy_plan(iTileBackward);
+    if (jSlabForward != NULL) fftw_destroy_plan(jSlabForward);
+    if (jSlabBackward != NULL) fftw_destroy_plan(jSlabBackward);
+    for (int t = 0; t < FFTthreads; t++) {
+      fftw_free(FFTin[t]);
+      fftw_free(FFTout[t]);
+    }
+    delete[] FFTin;
+    delete[] FFTout;
+  }
+  if (fusedScratch != NULL) {
+    for (int t = 0; t < FFTthreads; t++) delete[] fusedScratch[t];
+    delete[] fusedScratch;
+  }
 
   fftw_cleanup();
 }
@@ -135,6 +279,9 @@ void CostFunction3D::finalize()
 void CostFunction3D::initialize(HashMap* config,
 				real* bgU, real* obs, ReferenceState* ref)
 {
+  // New observations, so any H from a previous initialize is rebuilt
+  freeHmatrix();
+
   // Initialize number of variables
   varDim = 7;
   derivDim = 4;
@@ -190,6 +337,67 @@ void CostFunction3D::initialize(HashMap* config,
   kBCL[6] = bcHash[(*configHash)["k_qr_bcL"]];
   kBCR[6] = bcHash[(*configHash)["k_qr_bcR"]];
 
+  // Storage of the observation operator
+  if (hOperatorHash.count((*configHash)["h_operator"])) {
+    hOperator = hOperatorHash[(*configHash)["h_operator"]];
+  } else {
+    hOperator = H_CSR;
+  }
+  if (hOperator == H_MATRIX_FREE)
+    cout << "Using matrix-free observation operator\n";
+  HsinglePrecision = ((hOperator == H_COMPACT) and isTrue("h_single_precision"));
+  HprescaleObs = isTrue("h_prescale_obs");
+  exactStep = isTrue("exact_line_search");
+
+  // The fused transform, the blocked reductions and the Krylov recycling run on the host
+#ifdef _OPENACC
+  fuseTransforms = false;
+  deterministicReductions = false;
+  recycleVectors = 0;
+#else
+  fuseTransforms = isTrue("fuse_transforms");
+  deterministicReductions = isTrue("deterministic_reductions");
+  recycleVectors = max(0, std::stoi((*configHash)["tn_recycle_vectors"]));
+#endif
+
+  // Minimization algorithm, the one selected at build time unless given here
+  std::string solverType = (*configHash)["solver_type"];
+  if (solverType.compare(0, 16, "truncated_newton") == 0) {
+    solver = SOLVER_TRUNCATED_NEWTON;
+  } else if (solverType.compare(0, 18, "conjugate_gradient") == 0) {
+    solver = SOLVER_CONJUGATE_GRADIENT;
+  } else if (solverType.compare(0, 5, "lbfgs") == 0) {
+    solver = SOLVER_LBFGS;
+    size_t history = solverType.find(',');
+    if (history != std::string::npos) lbfgsHistory = max(1, std::stoi(solverType.substr(history+1)));
+  }
+
+  // Optional diagonal preconditioner for the truncated Newton solver
+  std::string tnPreconditioner = (*configHash)["tn_preconditioner"];
+  preconditioner = PRECONDITION_NONE;
+  preconditionerProbes = 4;
+  if (tnPreconditioner.compare(0, 11, "column_norm") == 0) {
+    preconditioner = PRECONDITION_COLUMN_NORM;
+  } else if (tnPreconditioner.compare(0, 8, "diagonal") == 0) {
+    preconditioner = PRECONDITION_DIAGONAL;
+    size_t probes = tnPreconditioner.find(',');
+    if (probes != std::string::npos) preconditionerProbes = max(1, std::stoi(tnPreconditioner.substr(probes+1)));
+  }
+
+#ifdef _OPENMP
+  // The loops over the pencils of the transforms use schedule(runtime), set by
+  // TransformSchedule while they run
+  std::string schedule = (*configHash)["thread_schedule"];
+  scheduleKind = omp_sched_static;
+  if (schedule.compare(0, 7, "dynamic") == 0) {
+    scheduleKind = omp_sched_dynamic;
+  } else if (schedule.compare(0, 6, "guided") == 0) {
+    scheduleKind = omp_sched_guided;
+  }
+  size_t comma = schedule.find(',');
+  scheduleChunk = (comma != std::string::npos) ? std::stoi(schedule.substr(comma+1)) : 0;
+#endif
+
   // Define the Reference state
   refstate = ref;
 
@@ -220,6 +428,7 @@ void CostFunction3D::initialize(HashMap* config,
 
   // Adjust the internal, variable domain to include boundaries
   adjustInternalDomain(1);
+  setStateLayout();
 
   // Define nodes with internal domain
   int nodes = iDim * jDim * kDim;
@@ -244,6 +453,7 @@ void CostFunction3D::initialize(HashMap* config,
   int64_t vector_size = mObs*(7+varDim*derivDim);
   obsVector  = new real[vector_size];
   obsData    = new real[mObs];
+  if (HprescaleObs) obsScaled = new real[mObs];
   HCq        = new real[mObs+nodes];
   innovation = new real[mObs+nodes];
   bgState    = new real[nState];
@@ -251,6 +461,7 @@ void CostFunction3D::initialize(HashMap* config,
   stateA = new real[nState];
   stateB = new real[nState];
   stateC = new real[nState];
+  if (fuseTransforms) setupFusedScratch();
 
   if (iBCL[0] == PERIODIC) {
     iLDim = iDim-2;
@@ -279,14 +490,38 @@ void CostFunction3D::initialize(HashMap* config,
     iL[var] = new real[iRank[var]*iLDim];
     jL[var] = new real[jRank[var]*jLDim];
     kL[var] = new real[kRank[var]*kLDim];
-    iGamma[var] = new real[iRank[var] * iDim];
-    jGamma[var] = new real[jRank[var] * jDim];
-    kGamma[var] = new real[kRank[var] * kDim];
+    iGamma[var] = new real[2*gammaEntries*iRank[var]];
+    jGamma[var] = new real[2*gammaEntries*jRank[var]];
+    kGamma[var] = new real[2*gammaEntries*kRank[var]];
+    iGammaIndex[var] = new int[2*gammaEntries*iRank[var]];
+    jGammaIndex[var] = new int[2*gammaEntries*jRank[var]];
+    kGammaIndex[var] = new int[2*gammaEntries*kRank[var]];
+    iGammaRow[var] = new int[2*iRank[var]];
+    jGammaRow[var] = new int[2*jRank[var]];
+    kGammaRow[var] = new int[2*kRank[var]];
+    iGammaCol[var] = new int[2*iDim];
+    jGammaCol[var] = new int[2*jDim];
+    kGammaCol[var] = new int[2*kDim];
     kRankMax = max(kRank[var],kRankMax);
   }
 
   cout << "kRankMax: " << kRankMax << "\n";
 
+  // The grid and mish points fall at the same few offsets in every cell, so the basis is tabulated once
+  iBasisTable = fillBasisTable(iDim, iMin, DI, DIrecip, iBCL, iBCR);
+  jBasisTable = fillBasisTable(jDim, jMin, DJ, DJrecip, jBCL, jBCR);
+  kBasisTable = fillBasisTable(kDim, kMin, DK, DKrecip, kBCL, kBCR);
+
+  // Sort the obs along a space filling curve so H and its transpose access nearby nodes
+  if (isEqual("obs_ordering", "morton")) {
+    sortObservations();
+  } else {
+    delete[] obsOrder;
+    delete[] obsRank;
+    obsOrder = NULL;
+    obsRank = NULL;
+  }
+
   /* Precalculate the basis functions for lookup table option
      basisappx = configHash->value("spline_approximation").toInt();
      if (basisappx > 0) {
@@ -295,24 +530,7 @@ void CostFunction3D::initialize(HashMap* config,
      fillBasisLookup();
      } */
 
-  // Initialize the Fourier transforms
-
-  int ierr;
-  iFFTin = (double*) fftw_malloc(sizeof(double) * iDim);
-  iFFTout = (fftw_complex*) fftw_malloc(sizeof(fftw_complex) * iDim);
-  iForward = fftw_plan_dft_r2c_1d(iDim, iFFTin, iFFTout, FFTW_MEASURE);
-  iBackward = fftw_plan_dft_c2r_1d(iDim, iFFTout, iFFTin, FFTW_MEASURE);
-
-  jFFTin = (double*) fftw_malloc(sizeof(double) * jDim);
-  jFFTout = (fftw_complex*) fftw_malloc(sizeof(fftw_complex) * jDim);
-  jForward = fftw_plan_dft_r2c_1d(jDim, jFFTin, jFFTout, FFTW_MEASURE);
-  jBackward = fftw_plan_dft_c2r_1d(jDim, jFFTout, jFFTin, FFTW_MEASURE);
-
-  kFFTin = (double*) fftw_malloc(sizeof(double) * kDim);
-  kFFTout = (fftw_complex*) fftw_malloc(sizeof(fftw_complex) * kDim);
-  kForward = fftw_plan_dft_r2c_1d(kDim, kFFTin, kFFTout, FFTW_MEASURE);
-  kBackward = fftw_plan_dft_c2r_1d(kDim, kFFTout, kFFTin, FFTW_MEASURE);
-
+  // The Fourier transforms are planned in initState, once we know whether they are needed
 }
 
 void CostFunction3D::initState(const int iteration)
@@ -399,8 +617,10 @@ void CostFunction3D::initState(const int iteration)
      if ((jBCL[var] == PERIODIC) and (jMaxWavenumber[var] >= 0)) UseFFT=true;
      if ((iBCL[var] == PERIODIC) and (iMaxWavenumber[var] >= 0)) UseFFT=true;
   }
-  if(UseFFT)
+  if(UseFFT) {
     cout << "PERIODIC boundaries and maximum wavenumber enforcement will enable FFtransform() \n";
+    if (!FFTplanned) setupFFT();
+  }
 
 
   // Set up the spline matrices
@@ -446,6 +666,9 @@ void CostFunction3D::initState(const int iteration)
   {
 		SAtransform(SBError, meshError);
 	}
+	// The error data is indexed in the interleaved layout
+	interleaveState(meshError, SBError);
+	std::swap(SBError, meshError);
 	variance.setMeshData(meshError);
 	delete[] SBError;
 	// variance.writeDebugNc("debug.out/std_errors_SA.nc", false, meshError);
@@ -454,9 +677,7 @@ void CostFunction3D::initState(const int iteration)
 
     if ((*configHash)["load_bg_coefficients"] == "true") {
 
-      for (int64_t n = 0; n < nState; n++) {
-	stateA[n] = bgFields[n];
-      }
+      deinterleaveState(bgFields, stateA);
     } else {
       // SB Transform on the original bg fields	(Mish to Mesh)
       // variance.writeDebugNc("debug.out/bgU_orig.nc", true, bgFields);		// mish sized DEBUG
@@ -486,7 +707,7 @@ void CostFunction3D::initState(const int iteration)
       for (int jIndex = 0; jIndex < jDim; jIndex++) {
 				for (int kIndex = 0; kIndex < kDim; kIndex++) {
 // 	  			int bIndex = varDim * iDim * jDim*kIndex + varDim * iDim * jIndex + varDim * iIndex + var;
-	  			int64_t bIndex = INDEX(iIndex, jIndex, kIndex, iDim, jDim, varDim, var);
+	  			int64_t bIndex = SINDEX(iIndex, jIndex, kIndex, var);
 // 	  			*bIndex = INDEX(iIndex, jIndex, kIndex, iDim, jDim, varDim, var);
 	  			bgStdDev[bIndex] = variance.meshValueAt(var, iIndex, jIndex, kIndex);
 				}
@@ -501,7 +722,7 @@ void CostFunction3D::initState(const int iteration)
       for (int jIndex = 0; jIndex < jDim; jIndex++) {
 				for (int kIndex = 0; kIndex < kDim; kIndex++) {
 // 	  			int bIndex = varDim * iDim * jDim * kIndex + varDim * iDim * jIndex + varDim * iIndex + var;
-	  			int64_t bIndex = INDEX(iIndex, jIndex, kIndex, iDim, jDim, varDim, var);
+	  			int64_t bIndex = SINDEX(iIndex, jIndex, kIndex, var);
 //                 int64_t *bIndex = (int64_t *)malloc(sizeof(int64_t));
 // 	  			*bIndex = INDEX(iIndex, jIndex, kIndex, iDim, jDim, varDim, var);
 	  			varScale += bgState[bIndex] * bgState[bIndex];
@@ -523,14 +744,14 @@ void CostFunction3D::initState(const int iteration)
   // Load the obs locally and weight the nonlinear observation operators by interpolated bg fields
   obAdjustments();
 
-  // Calculate the H matrix operator
+  // Calculate the H matrix operator (reused if the obs and grid are unchanged)
   calcHmatrix();
 
   // d = y - HXb
   calcInnovation();
 
   // Output the original background field
-  outputAnalysis("background", bgState);
+  outputAnalysis("background", interleavedState(bgState));
 
   cout << "Beginning analysis...\n";
 
@@ -571,19 +792,20 @@ real CostFunction3D::funcValue(real* state)
 
   	GPTLstart("CostFunction3D::funcValue:other");
   	// Compute inner product of state vector
-  	#pragma omp parallel for reduction(+:qIP)
-  	#pragma acc parallel loop reduction(+:qIP)
-  	for (int n = 0; n < nState; n++) {
-    	qIP += state[n]*state[n];
-  	}
+  	qIP = dotProduct(state, state);
 
   	// Subtract d from HCq to yield mObs length vector and compute inner product
+  	if (deterministicReductions) {
+  	  obIP = vectorSum(mObs, [&](const int64_t& m) {
+  	      return (HCq[m]-innovation[m])*(obsData[m])*(HCq[m]-innovation[m]); });
+  	} else {
   	#pragma omp parallel for reduction(+:obIP)
   	#pragma acc parallel loop reduction(+:obIP) private(obIndex,m)
   	for (m = 0; m < mObs; m++) {
     	//obIP += (HCq[m]-innovation[m])*(obsVector[obIndex])*(HCq[m]-innovation[m]);
     	obIP += (HCq[m]-innovation[m])*(obsData[m])*(HCq[m]-innovation[m]);
   	}
+  	}
   	GPTLstop("CostFunction3D::funcValue:other");
 	}
 
@@ -621,6 +843,7 @@ void CostFunction3D::funcGradient(real* state, real* gradient)
   	GPTLstop("CostFunction3D::funcGradient:SCtransform");
 
   	GPTLstart("CostFunction3D::funcGradient:gradient");
+  	#pragma omp parallel for
   	#pragma acc parallel loop gang vector vector_length(32) private(n)
   	for (n = 0; n < nState; n++) {
     	gradient[n] = state[n] + stateC[n] - CTHTd[n];
@@ -641,7 +864,7 @@ real CostFunction3D::funcValueAndGradient(real* state, real *gradient)
   GPTLstart("CostFunction3D::funcValueAndGradient");
   real qIP, obIP;
   real J;
-  int n, m;
+  int m;
 
   #pragma acc data present(state[0:nState],gradient[0:nState])
   {
@@ -654,19 +877,20 @@ real CostFunction3D::funcValueAndGradient(real* state, real *gradient)
 
   	//Func Value
   	// Compute inner product of state vector
-  	//#pragma omp parallel for reduction(+:qIP)
-  	#pragma acc parallel loop reduction(+:qIP)
-  	for (n = 0; n < nState; n++) {
-    	qIP += state[n]*state[n];
-  	}
+  	qIP = dotProduct(state, state);
   	// Subtract d from HCq to yield mObs length vector and compute inner product
-  	//#pragma omp parallel for reduction(+:obIP)
+  	if (deterministicReductions) {
+  	  obIP = vectorSum(mObs, [&](const int64_t& m) {
+  	      return (HCq[m]-innovation[m])*(obsData[m])*(HCq[m]-innovation[m]); });
+  	} else {
+  	#pragma omp parallel for reduction(+:obIP)
   	#pragma acc parallel loop reduction(+:obIP) private(m)
   	for (m = 0; m < mObs; m++) {
 			//int obIndex = m*(7+varDim*derivDim) + 1;
     	//obIP += (HCq[m]-innovation[m])*(obsVector[obIndex])*(HCq[m]-innovation[m]);
     	obIP += (HCq[m]-innovation[m])*(obsData[m])*(HCq[m]-innovation[m]);
   	}
+  	}
   	//function value J
   	J = 0.5*(qIP + obIP);
 
@@ -676,6 +900,7 @@ real CostFunction3D::funcValueAndGradient(real* state, real *gradient)
   	SAtransform(stateA, stateB);
   	SCtransform(stateB, stateC);
   	//calc gradient
+  	#pragma omp parallel for
   	#pragma acc parallel loop gang vector vector_length(32)
   	for (int n = 0; n < nState; n++) {
     	gradient[n] = state[n] + stateC[n] - CTHTd[n];
@@ -705,6 +930,7 @@ void CostFunction3D::funcHessian(real* x, real *hessian)
     SCtransform(stateB, stateC);
 
     // [I + C^T*H^T*R^-1*H*Q]x
+    #pragma omp parallel for
     #pragma acc parallel loop gang vector vector_length(32)
     for (int n = 0; n < nState; n++) {
     	hessian[n] = x[n] + stateC[n];
@@ -714,14 +940,226 @@ void CostFunction3D::funcHessian(real* x, real *hessian)
 
 }
 
+bool CostFunction3D::funcPreconditioner(real* Minv)
+{
+  if (preconditioner == PRECONDITION_NONE) return false;
+  GPTLstart("CostFunction3D::funcPreconditioner");
+
+  if (preconditioner == PRECONDITION_COLUMN_NORM) {
+    // The squared column norms of H weighted by R^-1 and scaled by the background error,
+    // the diagonal of D*H^T*R^-1*H*D. This leaves out the spline, filter and Fourier
+    // transforms of C, so it costs about one transpose of H. The observations are binned by
+    // the k base node of their stencil, which covers four planes, so the bins of one pass over
+    // every fourth plane write to separate planes and each node is summed in a fixed order
+    std::vector<integer> binPtr(kDim+2, 0), binObs(mObs);
+    std::vector<int> obsBin(mObs);
+    #pragma omp parallel for
+    for (int64_t m0 = 0; m0 < mObs; m0 += OBS_BLOCK) {
+      int count = (int)min((int64_t)OBS_BLOCK, mObs - m0);
+      int base[3*OBS_BLOCK];
+      real weights[24*OBS_BLOCK];
+      obsBasisWeights(m0, count, base, weights);
+      for (int o = 0; o < count; o++) obsBin[m0 + o] = base[2*OBS_BLOCK + o]+1;
+    }
+    for (int64_t m = 0; m < mObs; m++) binPtr[obsBin[m]+1]++;
+    for (int b = 0; b <= kDim; b++) binPtr[b+1] += binPtr[b];
+    for (int64_t m = 0; m < mObs; m++) binObs[binPtr[obsBin[m]]++] = m;
+    for (int b = kDim+1; b > 0; b--) binPtr[b] = binPtr[b-1];
+    binPtr[0] = 0;
+
+    #pragma omp parallel for
+    for (int n = 0; n < nState; n++) {
+      Minv[n] = 0.;
+    }
+    for (int pass = 0; pass < 4; pass++) {
+      #pragma omp parallel
+      {
+        int base[3*OBS_BLOCK];
+        real weights[24*OBS_BLOCK];
+        real column[64];
+        #pragma omp for schedule(dynamic)
+        for (int bin = pass; bin <= kDim; bin += 4) {
+          for (integer p = binPtr[bin]; p < binPtr[bin+1]; p++) {
+            integer m = binObs[p];
+            integer mi = m*(7+varDim*derivDim);
+            obsBasisWeights(m, 1, base, weights);
+            for (int var = 0; var < varDim; var++) {
+              // The row of H for this variable, summed over the derivative terms
+              bool used = false;
+              for (int n = 0; n < 64; n++) column[n] = 0.;
+              for (int d = 0; d < derivDim; d++) {
+                real weight = obsVector[mi + (7*(d+1)) + var];
+                if (!weight) continue;
+                used = true;
+                for (int c = 0; c < 4; c++) {
+                  real kw = weight * BWEIGHT(weights, 2, derivative[d][2], c, 0);
+                  if (!kw) continue;
+                  for (int b = 0; b < 4; b++) {
+                    real jkw = kw * BWEIGHT(weights, 1, derivative[d][1], b, 0);
+                    if (!jkw) continue;
+                    for (int a = 0; a < 4; a++) {
+                      column[(c*4 + b)*4 + a] += jkw * BWEIGHT(weights, 0, derivative[d][0], a, 0);
+                    }
+                  }
+                }
+              }
+              if (!used) continue;
+              for (int c = 0; c < 4; c++) {
+                for (int b = 0; b < 4; b++) {
+                  for (int a = 0; a < 4; a++) {
+                    real h = column[(c*4 + b)*4 + a];
+                    if (!h) continue;
+                    Minv[SINDEX(base[0]+a, base[OBS_BLOCK]+b, base[2*OBS_BLOCK]+c, var)] += obsData[m] * h * h;
+                  }
+                }
+              }
+            }
+          }
+        }
+      }
+    }
+    #pragma omp parallel for
+    for (int n = 0; n < nState; n++) {
+      Minv[n] = 1. / (1. + bgStdDev[n] * bgStdDev[n] * Minv[n]);
+    }
+  } else {
+    // Estimate the diagonal as the mean of v*(Av) over random sign vectors v. The exact
+    // diagonal is at least one, which also bounds the estimate away from zero
+    real* v = new real[nState];
+    real* Av = new real[nState];
+    #pragma omp parallel for
+    for (int n = 0; n < nState; n++) {
+      Minv[n] = 0.;
+    }
+    for (int probe = 0; probe < preconditionerProbes; probe++) {
+      #pragma omp parallel for
+      for (int n = 0; n < nState; n++) {
+        v[n] = probeSign((uint64_t)probe * nState + n);
+      }
+      #pragma acc data copyin(v[0:nState]) copyout(Av[0:nState])
+      {
+        funcHessian(v, Av);
+      }
+      #pragma omp parallel for
+      for (int n = 0; n < nState; n++) {
+        Minv[n] += v[n] * Av[n];
+      }
+    }
+    #pragma omp parallel for
+    for (int n = 0; n < nState; n++) {
+      Minv[n] = 1. / max((real)1., Minv[n] / preconditionerProbes);
+    }
+    delete[] v;
+    delete[] Av;
+  }
+
+  real minDiag = 1e34, maxDiag = 0.;
+  for (int n = 0; n < nState; n++) {
+    minDiag = min(minDiag, 1. / Minv[n]);
+    maxDiag = max(maxDiag, 1. / Minv[n]);
+  }
+  cout << "Diagonal preconditioner range: " << minDiag << " to " << maxDiag << "\n";
+
+  GPTLstop("CostFunction3D::funcPreconditioner");
+  return true;
+}
+
+/* The Hessian products of k vectors interleaved as X[n*k+b]. The transforms are applied one
+   member at a time, but H and H^T are applied to the whole block so the matrix is streamed
+   once per product instead of once per member */
+void CostFunction3D::funcHessianBlock(const int& k, real* X, real* HX)
+{
+  GPTLstart("CostFunction3D::HessianBlock");
+  reserveBlock(k);
+  transformBlock(k, X, blockState);
+  HtransformBlock(k, blockState, blockObs);
+  calcHTransposeBlock(k, blockObs, blockState);
+  transposeBlock(k, blockState, HX);
+
+  // [I + C^T*H^T*R^-1*H*Q]X
+  #pragma omp parallel for
+  for (int64_t n = 0; n < (int64_t)k*nState; n++) {
+    HX[n] += X[n];
+  }
+  GPTLstop("CostFunction3D::HessianBlock");
+}
+
+/* Spread of an ensemble of analyses with perturbed observations and background. Each member
+   perturbs the observations by eps from N(0, R) and the background by C*xi with xi from
+   N(0, I) in the control space, and its analysis perturbation dq solves
+   (I + C^T*H^T*R^-1*H*C) dq = xi + C^T*H^T*R^-1*eps, that is
+   dq = xi + A^-1*C^T*H^T*R^-1*(eps - H*C*xi). Its covariance is the analysis error covariance
+   (I - KH)B(I - KH)^T + KRK^T. All the members share the Hessian, so they are solved together
+   with block CG. Each member's perturbation C*dq is written out like the analysis increment,
+   and the RMS of HC*dq at the observations estimates the analysis error there, which should
+   be below the observation error */
+void CostFunction3D::ensembleSpread(const int& members)
+{
+#ifdef _OPENACC
+  cout << "Ensemble spread is only available on the host, skipping\n";
+  return;
+#endif
+  if ((members <= 0) or (mObs == 0)) return;
+  GPTLstart("CostFunction3D::ensembleSpread");
+  const int k = members;
+  reserveBlock(k);
+
+  // Fixed seed so the spread is reproducible between runs
+  std::mt19937_64 generator(5489u);
+  std::normal_distribution<real> normal(0.0, 1.0);
+  real* eps = new real[(int64_t)k*mObs];
+  real obsErrorRMS = 0.0;
+  for (int64_t m = 0; m < mObs; m++) {
+    real sigma = (obsData[m] > 0) ? 1.0/sqrt(obsData[m]) : 0.0;
+    obsErrorRMS += sigma*sigma;
+    for (int b = 0; b < k; b++) eps[m*k+b] = sigma * normal(generator);
+  }
+  obsErrorRMS = sqrt(obsErrorRMS/mObs);
+
+  real* B = new real[(int64_t)k*nState];
+  real* dq = new real[(int64_t)k*nState];
+  calcHTransposeBlock(k, eps, blockState);
+  transposeBlock(k, blockState, B);
+  for (int64_t n = 0; n < nState; n++) {
+    for (int b = 0; b < k; b++) B[n*k+b] += normal(generator);
+  }
+  blockConjugateGradient(k, B, dq);
+
+  transformBlock(k, dq, blockState);
+  if (isTrue("output_ensemble_members")) {
+    for (int b = 0; b < k; b++) {
+      #pragma omp parallel for
+      for (int64_t n = 0; n < nState; n++) stateA[n] = blockState[n*k+b];
+      outputAnalysis("ensemble_increment_" + std::to_string(b+1), interleavedState(stateA));
+    }
+  }
+  HtransformBlock(k, blockState, blockObs);
+  real spread = 0.0;
+  for (int64_t m = 0; m < (int64_t)k*mObs; m++) {
+    spread += blockObs[m]*blockObs[m];
+  }
+  spread = sqrt(spread/((int64_t)k*mObs));
+  cout << "Ensemble of " << k << " members: analysis spread at the observations " << spread
+       << ", observation error " << obsErrorRMS << "\n";
+
+  delete[] eps;
+  delete[] B;
+  delete[] dq;
+  GPTLstop("CostFunction3D::ensembleSpread");
+}
+
 void CostFunction3D::updateHCq(real* state,real* HCq)
 {
     #pragma acc data present(state[0:nState],HCq)
     {
   	GPTLstart("CostFunction3D::updateHCq");
-  	SCtransform(state, stateB);
-  	SAtransform(stateB, stateA);
-  	FFtransform(stateA, stateC);
+  	if (fuseTransforms) {
+  	  fusedTransform(state, stateC);
+  	} else {
+  	  SCtransform(state, stateB);
+  	  SAtransform(stateB, stateA);
+  	  FFtransform(stateA, stateC);
+  	}
   	Htransform(stateC, HCq);
   	#pragma acc update self(HCq[mObs+(iDim*jDim*kDim)]) //EXCESSIVE
   	GPTLstop("CostFunction3D::updateHCq");
@@ -729,6 +1167,247 @@ void CostFunction3D::updateHCq(real* state,real* HCq)
 }
 
 
+// Spline solve of one contiguous pencil, x = gamma^T (L L^T)^-1 gamma b, the same operations
+// as each pencil of SAtransform. The result overwrites b
+static inline void splinePencil(real* b, real* x, const int& Dim, const int& rank, const int& LDim,
+                                const real* L, const real* gamma, const int* gammaRow, const int* gammaCol,
+                                const int* gammaIndex)
+{
+  real tmp;
+  for (int m = 0; m < rank; m++) {
+    // Multiply by gamma
+    tmp = 0;
+    for (int e = gammaRow[2*m]; e < gammaRow[2*m+1]; e++) {
+      tmp += gamma[e]*b[gammaIndex[e]];
+    }
+    // Solve for A's using compact storage
+    for (int l = -1; l >= -(LDim-1); l--) {
+      if ((m+l >= 0) and ((m*LDim-l) >= 0)) {
+        tmp -= L[m*LDim-l]*x[m+l];
+      }
+    }
+    x[m] = tmp/L[m*LDim];
+  }
+  for (int m = rank-1; m >= 0; m--) {
+    tmp = x[m];
+    for (int l = 1; l <= (LDim-1); l++) {
+      if ((m+l < rank) and (((m+l)*LDim+l) < rank*LDim)) {
+        tmp -= L[(m+l)*LDim+l]*x[m+l];
+      }
+    }
+    x[m] = tmp/L[m*LDim];
+  }
+  // Multiply by gammaT
+  for (int n = 0; n < Dim; n++) {
+    tmp = 0;
+    for (int e = gammaCol[2*n]; e < gammaCol[2*n+1]; e++) {
+      tmp += gamma[e]*x[gammaIndex[e]];
+    }
+    b[n] = tmp;
+  }
+}
+
+// splinePencil for k pencils interleaved as b[n*k+c], so L and gamma are read once for all
+// of them. tmp holds k values
+static inline void splinePencilBlock(real* b, real* x, real* tmp, const int& k, const int& Dim, const int& rank,
+                                     const int& LDim, const real* L, const real* gamma, const int* gammaRow,
+                                     const int* gammaCol, const int* gammaIndex)
+{
+  for (int m = 0; m < rank; m++) {
+    // Multiply by gamma
+    for (int c = 0; c < k; c++) tmp[c] = 0;
+    for (int e = gammaRow[2*m]; e < gammaRow[2*m+1]; e++) {
+      real g = gamma[e];
+      const real* bn = b + (int64_t)gammaIndex[e]*k;
+      for (int c = 0; c < k; c++) tmp[c] += g*bn[c];
+    }
+    // Solve for A's using compact storage
+    for (int l = -1; l >= -(LDim-1); l--) {
+      if ((m+l >= 0) and ((m*LDim-l) >= 0)) {
+        real Lml = L[m*LDim-l];
+        for (int c = 0; c < k; c++) tmp[c] -= Lml*x[(m+l)*k+c];
+      }
+    }
+    for (int c = 0; c < k; c++) x[m*k+c] = tmp[c]/L[m*LDim];
+  }
+  for (int m = rank-1; m >= 0; m--) {
+    for (int c = 0; c < k; c++) tmp[c] = x[m*k+c];
+    for (int l = 1; l <= (LDim-1); l++) {
+      if ((m+l < rank) and (((m+l)*LDim+l) < rank*LDim)) {
+        real Lml = L[(m+l)*LDim+l];
+        for (int c = 0; c < k; c++) tmp[c] -= Lml*x[(m+l)*k+c];
+      }
+    }
+    for (int c = 0; c < k; c++) x[m*k+c] = tmp[c]/L[m*LDim];
+  }
+  // Multiply by gammaT
+  for (int n = 0; n < Dim; n++) {
+    for (int c = 0; c < k; c++) tmp[c] = 0;
+    for (int e = gammaCol[2*n]; e < gammaCol[2*n+1]; e++) {
+      real g = gamma[e];
+      const real* xm = x + (int64_t)gammaIndex[e]*k;
+      for (int c = 0; c < k; c++) tmp[c] += g*xm[c];
+    }
+    for (int c = 0; c < k; c++) b[n*k+c] = tmp[c];
+  }
+}
+
+void CostFunction3D::fusedTransform(const real* state, real* Cstate)
+{
+  // FF SA SC in three sweeps through the state instead of one per axis of each transform,
+  // each on tiles sized by setupFusedScratch to stay in cache. The operators along different
+  // axes commute, so the k and j filters are applied together on a few i pencils at a time,
+  // then the i filter, the error and the i spline and Fourier transforms on a few j rows of
+  // a k level at a time, and a last pass does the j and k spline and Fourier transforms on
+  // slabs of one i. This is the same operator as SCtransform, SAtransform and FFtransform in
+  // sequence, up to rounding
+  GPTLstart("CostFunction3D::fusedTransform");
+  TransformSchedule transformSchedule(scheduleKind, scheduleChunk);
+  const int nb = fusedPencils, nr = fusedRows;
+  int iHalf = iDim/2+1, jHalf = jDim/2+1, kHalf = kDim/2+1;
+
+  // k and j filters, on tile[j][k][n] for nb i pencils
+  #pragma omp parallel num_threads(FFTthreads)
+  {
+    real* tile = fusedScratch[fftThread()];
+    real* q = tile + (int64_t)jDim*kDim*nb;
+    #pragma omp for collapse(2) schedule(runtime)
+    for (int var = 0; var < varDim; var++) {
+      for (int iBatch = 0; iBatch < iDim; iBatch += nb) {
+	int np = min(nb, iDim - iBatch);
+	for (int jIndex = 0; jIndex < jDim; jIndex++) {
+	  for (int kIndex = 0; kIndex < kDim; kIndex++) {
+	    for (int n = 0; n < np; n++) {
+	      tile[(jIndex*kDim + kIndex)*np + n] = state[SINDEX(iBatch+n, jIndex, kIndex, var)];
+	    }
+	  }
+	}
+	if (kFilterScale > 0) {
+	  for (int jIndex = 0; jIndex < jDim; jIndex++) {
+	    kFilter->filterPencils(&tile[jIndex*kDim*np], q, kDim, np);
+	  }
+	}
+	if (jFilterScale > 0) jFilter->filterPencils(tile, q, jDim, kDim*np);
+	for (int jIndex = 0; jIndex < jDim; jIndex++) {
+	  for (int kIndex = 0; kIndex < kDim; kIndex++) {
+	    for (int n = 0; n < np; n++) {
+	      stateB[SINDEX(iBatch+n, jIndex, kIndex, var)] = tile[(jIndex*kDim + kIndex)*np + n];
+	    }
+	  }
+	}
+      }
+    }
+  }
+
+  // i filter, D, then the i spline and Fourier transforms, on tile[i][n] for nr j rows of a
+  // k level. A short last tile is padded with zeros to the width of the FFT plans
+  #pragma omp parallel num_threads(FFTthreads)
+  {
+    real* tile = fusedScratch[fftThread()];
+    real* q = tile + iDim*nr;
+    real* x = q + iDim*nr;
+    real* tmp = x + iDim*nr;
+    double* in = FFTin ? FFTin[fftThread()] : NULL;
+    fftw_complex* out = FFTout ? FFTout[fftThread()] : NULL;
+    #pragma omp for collapse(3) schedule(runtime)
+    for (int var = 0; var < varDim; var++) {
+      for (int kIndex = 0; kIndex < kDim; kIndex++) {
+	for (int jBatch = 0; jBatch < jDim; jBatch += nr) {
+	  int np = min(nr, jDim - jBatch);
+	  for (int n = 0; n < np; n++) {
+	    for (int iIndex = 0; iIndex < iDim; iIndex++) {
+	      tile[iIndex*nr + n] = stateB[SINDEX(iIndex, jBatch+n, kIndex, var)];
+	    }
+	  }
+	  for (int iIndex = 0; iIndex < iDim; iIndex++) {
+	    for (int n = np; n < nr; n++) tile[iIndex*nr + n] = 0.;
+	  }
+	  if (iFilterScale > 0) iFilter->filterPencils(tile, q, iDim, nr);
+	  for (int n = 0; n < np; n++) {
+	    for (int iIndex = 0; iIndex < iDim; iIndex++) {
+	      tile[iIndex*nr + n] *= bgStdDev[SINDEX(iIndex, jBatch+n, kIndex, var)];
+	    }
+	  }
+	  splinePencilBlock(tile, x, tmp, nr, iDim, iRank[var], iLDim, iL[var], iGamma[var], iGammaRow[var],
+			    iGammaCol[var], iGammaIndex[var]);
+	  if (UseFFT and (iBCL[var] == PERIODIC) and (iMaxWavenumber[var] >= 0)) {
+	    for (int n = 0; n < iDim*nr; n++) in[n] = tile[n];
+	    fftw_execute_dft_r2c(iTileForward, in, out);
+	    for (int iIndex = iMaxWavenumber[var]+1; iIndex < iHalf; iIndex++) {
+	      for (int n = 0; n < nr; n++) {
+		out[iIndex*nr + n][0] = 0.0;
+		out[iIndex*nr + n][1] = 0.0;
+	      }
+	    }
+	    fftw_execute_dft_c2r(iTileBackward, out, in);
+	    for (int n = 0; n < iDim*nr; n++) tile[n] = in[n]/iDim;
+	  }
+	  for (int n = 0; n < np; n++) {
+	    for (int iIndex = 0; iIndex < iDim; iIndex++) {
+	      stateB[SINDEX(iIndex, jBatch+n, kIndex, var)] = tile[iIndex*nr + n];
+	    }
+	  }
+	}
+      }
+    }
+  }
+
+  // j and k spline and Fourier transforms, on slab[j][k] for one i. The j pencils are
+  // interleaved in the slab and the k pencils are contiguous
+  #pragma omp parallel num_threads(FFTthreads)
+  {
+    real* slab = fusedScratch[fftThread()];
+    real* x = slab + jDim*kDim;
+    real* tmp = x + jDim*kDim;
+    double* in = FFTin ? FFTin[fftThread()] : NULL;
+    fftw_complex* out = FFTout ? FFTout[fftThread()] : NULL;
+    #pragma omp for collapse(2) schedule(runtime)
+    for (int var = 0; var < varDim; var++) {
+      for (int iIndex = 0; iIndex < iDim; iIndex++) {
+	for (int jIndex = 0; jIndex < jDim; jIndex++) {
+	  for (int kIndex = 0; kIndex < kDim; kIndex++) {
+	    slab[jIndex*kDim + kIndex] = stateB[SINDEX(iIndex, jIndex, kIndex, var)];
+	  }
+	}
+	splinePencilBlock(slab, x, tmp, kDim, jDim, jRank[var], jLDim, jL[var], jGamma[var], jGammaRow[var],
+			  jGammaCol[var], jGammaIndex[var]);
+	if (UseFFT and (jBCL[var] == PERIODIC) and (jMaxWavenumber[var] >= 0)) {
+	  for (int n = 0; n < jDim*kDim; n++) in[n] = slab[n];
+	  fftw_execute_dft_r2c(jSlabForward, in, out);
+	  for (int jIndex = jMaxWavenumber[var]+1; jIndex < jHalf; jIndex++) {
+	    for (int kIndex = 0; kIndex < kDim; kIndex++) {
+	      out[jIndex*kDim + kIndex][0] = 0.0;
+	      out[jIndex*kDim + kIndex][1] = 0.0;
+	    }
+	  }
+	  fftw_execute_dft_c2r(jSlabBackward, out, in);
+	  for (int n = 0; n < jDim*kDim; n++) slab[n] = in[n]/jDim;
+	}
+	for (int jIndex = 0; jIndex < jDim; jIndex++) {
+	  splinePencil(&slab[jIndex*kDim], x, kDim, kRank[var], kLDim, kL[var], kGamma[var], kGammaRow[var], kGammaCol[var], kGammaIndex[var]);
+	}
+	if (UseFFT and (kBCL[var] == PERIODIC) and (kMaxWavenumber[var] >= 0)) {
+	  for (int n = 0; n < jDim*kDim; n++) in[n] = slab[n];
+	  fftw_execute_dft_r2c(kForward, in, out);
+	  for (int jIndex = 0; jIndex < jDim; jIndex++) {
+	    for (int kIndex = kMaxWavenumber[var]+1; kIndex < kHalf; kIndex++) {
+	      out[jIndex*kHalf + kIndex][0] = 0.0;
+	      out[jIndex*kHalf + kIndex][1] = 0.0;
+	    }
+	  }
+	  fftw_execute_dft_c2r(kBackward, out, in);
+	  for (int n = 0; n < jDim*kDim; n++) slab[n] = in[n]/kDim;
+	}
+	for (int jIndex = 0; jIndex < jDim; jIndex++) {
+	  for (int kIndex = 0; kIndex < kDim; kIndex++) {
+	    Cstate[SINDEX(iIndex, jIndex, kIndex, var)] = slab[jIndex*kDim + kIndex];
+	  }
+	}
+      }
+    }
+  }
+  GPTLstop("CostFunction3D::fusedTransform");
+}
 
 void CostFunction3D::updateBG()
 {
@@ -741,7 +1420,7 @@ void CostFunction3D::updateBG()
   SAtransform(stateB, stateA);
   FFtransform(stateA, stateC);
   }
-  outputAnalysis("increment", stateC);
+  outputAnalysis("increment", interleavedState(stateC));
 
   // In BG update we are directly summing C + A
   std::string cFilename = outputPath + "/samurai_Coefficients.out";
@@ -754,7 +1433,7 @@ void CostFunction3D::updateBG()
 				for (int kIndex = 0; kIndex < kDim; kIndex++) {
 	  			cstream << var << "\t" << iIndex << "\t" << jIndex << "\t" << kIndex << "\t";
   	  		//int bgIndex = varDim*iDim*jDim*kIndex + varDim*iDim*jIndex +varDim*iIndex + var;
-	    		int bgIndex = INDEX(iIndex, jIndex, kIndex, iDim, jDim, varDim, var);
+	    		int bgIndex = SINDEX(iIndex, jIndex, kIndex, var);
 	    		cstream << bgState[bgIndex] << "\t";
 	  	  	bgState[bgIndex] += stateC[bgIndex];
 	  		  cstream << bgState[bgIndex] << "\t";
@@ -764,7 +1443,7 @@ void CostFunction3D::updateBG()
     }
   }
 
-  outputAnalysis("analysis", bgState);
+  outputAnalysis("analysis", interleavedState(bgState));
   GPTLstop("CostFunction3D::updateBG");
 }
 
@@ -798,8 +1477,127 @@ void CostFunction3D::calcInnovation()
   GPTLstop("CostFunction3D::calcInnovation");
 }
 
+// Sparse kernels for the compact H, templated on the value and index types.
+// The products are accumulated in double regardless of the storage precision
+template <typename V, typename I>
+static void compactHtransform(const int64_t& mObs, const I* IH, const I* JH, const V* H,
+                              const real* Cstate, real* Hstate)
+{
+  #pragma omp parallel for
+  #pragma acc parallel loop vector gang vector_length(32) present(IH,JH,H,Cstate,Hstate)
+  for (int64_t m = 0; m < mObs; m++) {
+    real tmp = 0.0;
+    for (I j = IH[m]; j < IH[m+1]; j++) {
+      tmp += (real)H[j] * Cstate[JH[j]];
+    }
+    Hstate[m] = tmp;
+  }
+}
+
+template <typename V, typename I>
+static void compactHTranspose(const int64_t& nState, const I* mPtr, const I* mVal, const I* I2H,
+                              const V* H, const real* yhat, const real* obsData, real* Astate)
+{
+  #pragma omp parallel for
+  #pragma acc parallel loop gang vector vector_length(32) present(mPtr,mVal,I2H,H,yhat,obsData,Astate)
+  for (int64_t n = 0; n < nState; n++) {
+    real tmp = 0.0;
+    for (I k = mPtr[n]; k < mPtr[n+1]; k++) {
+      I m = mVal[k];
+      real val = (obsData != NULL) ? yhat[m] * obsData[m] : yhat[m];
+      tmp += (real)H[I2H[k]] * val;
+    }
+    Astate[n] = tmp;
+  }
+}
+
+// The same products for k vectors interleaved as X[n*k+b], so each nonzero of H is read
+// once for the whole block. The CSR and compact H share these, and a NULL I2H means the
+// values are already in transposed order (HT)
+template <typename V, typename I>
+static void blockHtransform(const int64_t& mObs, const int& k, const I* IH, const I* JH, const V* H,
+                            const real* Cstate, real* Hstate)
+{
+  #pragma omp parallel for
+  for (int64_t m = 0; m < mObs; m++) {
+    real* y = Hstate + m*k;
+    for (int b = 0; b < k; b++) y[b] = 0.0;
+    for (I j = IH[m]; j < IH[m+1]; j++) {
+      real h = (real)H[j];
+      const real* x = Cstate + (int64_t)JH[j]*k;
+      for (int b = 0; b < k; b++) y[b] += h * x[b];
+    }
+  }
+}
+
+template <typename V, typename I>
+static void blockHTranspose(const int64_t& nState, const int& k, const I* mPtr, const I* mVal, const I* I2H,
+                            const V* H, const real* yhat, const real* obsData, real* Astate)
+{
+  #pragma omp parallel for
+  for (int64_t n = 0; n < nState; n++) {
+    real* x = Astate + n*k;
+    for (int b = 0; b < k; b++) x[b] = 0.0;
+    for (I p = mPtr[n]; p < mPtr[n+1]; p++) {
+      I m = mVal[p];
+      real h = (real)H[(I2H != NULL) ? I2H[p] : p] * obsData[m];
+      const real* y = yhat + (int64_t)m*k;
+      for (int b = 0; b < k; b++) x[b] += h * y[b];
+    }
+  }
+}
+
 void CostFunction3D::calcHTranspose(const real* yhat, real* Astate)
 {
+  // Apply R^-1 once per ob rather than once per nonzero. The products are the same
+  const real* obsWeight = obsData;
+  if (HprescaleObs) {
+    GPTLstart("CostFunction3D::calcHTranspose:prescale");
+    #pragma omp parallel for
+    #pragma acc parallel loop gang vector vector_length(32) present(yhat,obsData,obsScaled)
+    for (int64_t m = 0; m < mObs; m++) {
+      obsScaled[m] = yhat[m] * obsData[m];
+    }
+    yhat = obsScaled;
+    obsWeight = NULL;
+    GPTLstop("CostFunction3D::calcHTranspose:prescale");
+  }
+
+  if (hOperator == H_MATRIX_FREE) {
+    calcHTransposeMatrixFree(yhat, obsWeight, Astate);
+    return;
+  }
+  if (Hcompact) {
+    GPTLstart("CostFunction3D::calcHTranspose");
+    if (Hsingle != NULL) {
+      compactHTranspose(nState, mPtr32, mVal32, I2H32, Hsingle, yhat, obsWeight, Astate);
+    } else {
+      compactHTranspose(nState, mPtr32, mVal32, I2H32, H, yhat, obsWeight, Astate);
+    }
+    GPTLstop("CostFunction3D::calcHTranspose");
+    return;
+  }
+  if (HT != NULL) {
+    // With the values stored in transposed order this is a plain CSR product
+	#pragma acc data present(yhat,Astate,mPtr,mVal,HT)
+	{
+    GPTLstart("CostFunction3D::calcHTranspose");
+    #pragma omp parallel for
+    #pragma acc parallel loop gang vector vector_length(32)
+    for (int64_t n = 0; n < nState; n++) {
+      real tmp = 0;
+      for (integer k = mPtr[n]; k < mPtr[n+1]; k++) {
+        integer m = mVal[k];
+        real val = (obsWeight != NULL) ? yhat[m] * obsWeight[m] : yhat[m];
+        tmp += HT[k] * val;
+      }
+      Astate[n] = tmp;
+    }
+    GPTLstop("CostFunction3D::calcHTranspose");
+	}
+    return;
+  }
+
   integer j,n,m,k,ms,me;
   real tmp,val;
 	#pragma acc data present(yhat,Astate,mPtr,mVal,I2H,H)
@@ -816,7 +1614,7 @@ void CostFunction3D::calcHTranspose(const real* yhat, real* Astate)
           m=mVal[k];
           j=I2H[k];
           //val = yhat[m] * obsVector[m*(7+varDim*derivDim)+1];
-          val = yhat[m] * obsData[m];
+          val = (obsWeight != NULL) ? yhat[m] * obsWeight[m] : yhat[m];
           tmp += H[j] * val;
        }
     }
@@ -830,10 +1628,10 @@ void CostFunction3D::calcHTranspose(const real* yhat, real* Astate)
 
 bool CostFunction3D::SAtransform(const real* Bstate, real* Astate)
 {
+  TransformSchedule transformSchedule(scheduleKind, scheduleChunk);
   real kB[kDim], xk[kDim];
   real jB[jDim], xj[jDim];
   real iB[iDim], xi[iDim];
-  int kRankVar;
   int iIndex,jIndex,kIndex;
   int i,j,k,l,m;
   real tmp;
@@ -841,23 +1639,23 @@ bool CostFunction3D::SAtransform(const real* Bstate, real* Astate)
 	#pragma acc data present(Bstate[0:nState],Astate[0:nState])
 	{
   	GPTLstart("CostFunction3D::SAtransform");
-  	for (int var = 0; var < varDim; var++) {
-    	kRankVar = kRank[var];
+  	// Each axis is one parallel loop over the pencils of all the variables
     	//GPTLstart("IJK Loop");
-
-    	#pragma omp parallel for private(tmp,kB,xk,k,l,m,iIndex,jIndex,kIndex) //[5.0.1]
-    	#pragma acc parallel loop gang worker vector collapse(2) private(tmp,kB,xk) //[5.0.1]
+    	#pragma omp parallel for collapse(3) schedule(runtime) private(tmp,kB,xk,k,l,m,iIndex,jIndex,kIndex) //[5.0.1]
+    	#pragma acc parallel loop gang worker vector collapse(3) private(tmp,kB,xk) //[5.0.1]
+  	for (int var = 0; var < varDim; var++) {
     	for (int iIndex = 0; iIndex < iDim; iIndex++) {
       	  for (int jIndex = 0; jIndex < jDim; jIndex++) {
+	    int kRankVar = kRank[var];
 	    for (int k = 0; k < kDim; k++) {
-	       	kB[k] = Bstate[INDEX(iIndex, jIndex, k, iDim, jDim, varDim, var)];
+	       	kB[k] = Bstate[SINDEX(iIndex, jIndex, k, var)];
 	    }
       	    // Multiply by gamma
 	    for (int m = 0; m < kRankVar; m++) {
 	       	//bk[m] = 0;
               tmp = 0;
-	      for (int k = 0; k < kDim; k++) {
-	       	tmp += kGamma[var][kDim * m + k] * kB[k];
+	      for (int e = kGammaRow[var][2*m]; e < kGammaRow[var][2*m+1]; e++) {
+	       	tmp += kGamma[var][e]*kB[kGammaIndex[var][e]];
 	      }
 	      // Solve for A's using compact storage
 	      for (int l=-1;l>=-(kLDim-1);l--) {
@@ -879,30 +1677,32 @@ bool CostFunction3D::SAtransform(const real* Bstate, real* Astate)
 	    for (int k = 0; k < kDim; k++) {
 	      // Multiply by gammaT
 	      tmp = 0;
-	      for (int m = 0; m < kRankVar; m++) {
-	       	tmp += kGamma[var][kDim * m + k] * xk[m];
+	      for (int e = kGammaCol[var][2*k]; e < kGammaCol[var][2*k+1]; e++) {
+	       	tmp += kGamma[var][e]*xk[kGammaIndex[var][e]];
 	      }
-	      Astate[INDEX(iIndex, jIndex, k, iDim, jDim, varDim, var)] = tmp;
+	      Astate[SINDEX(iIndex, jIndex, k, var)] = tmp;
 	    }
       	  }
     	}
+  	}
     	//GPTLstop("IJK Loop");
 
     	//GPTLstart("IKJ Loop");
-    	#pragma omp parallel for private(tmp,jB,xj,j,l,m,iIndex,kIndex) //[5.0.2]
-    	#pragma acc parallel loop gang worker collapse(2) vector_length(32) private(tmp,jB,xj) //[5.0.2]
+    	#pragma omp parallel for collapse(3) schedule(runtime) private(tmp,jB,xj,j,l,m,iIndex,kIndex) //[5.0.2]
+    	#pragma acc parallel loop gang worker collapse(3) vector_length(32) private(tmp,jB,xj) //[5.0.2]
+  	for (int var = 0; var < varDim; var++) {
     	for (int iIndex = 0; iIndex < iDim; iIndex++) {
       	  for (int kIndex = 0; kIndex < kDim; kIndex++) {
             #pragma acc loop vector
 	    for (int j = 0; j < jDim; j++) {
-	       	jB[j] = Astate[INDEX(iIndex, j, kIndex, iDim, jDim, varDim, var)];
+	       	jB[j] = Astate[SINDEX(iIndex, j, kIndex, var)];
 	    }
 	    for (int m = 0; m < jRank[var]; m++) {
 	       // Multiply by gamma
                tmp = 0;
                #pragma acc loop vector reduction(+:tmp)
-	       for (int j = 0; j < jDim; j++) {
-	       	 tmp += jGamma[var][jDim*m + j]*jB[j];
+	       for (int e = jGammaRow[var][2*m]; e < jGammaRow[var][2*m+1]; e++) {
+	       	 tmp += jGamma[var][e]*jB[jGammaIndex[var][e]];
 	       }
 	       // Solve for A's using compact storage
                #pragma acc loop vector reduction(+:tmp)
@@ -928,30 +1728,32 @@ bool CostFunction3D::SAtransform(const real* Bstate, real* Astate)
 	    for (int j = 0; j < jDim; j++) {
 	      // Multiply by gammaT
               tmp = 0;
-	      for (int m = 0; m < jRank[var]; m++) {
-	       	tmp += jGamma[var][jDim*m + j]*xj[m];
+	      for (int e = jGammaCol[var][2*j]; e < jGammaCol[var][2*j+1]; e++) {
+	       	tmp += jGamma[var][e]*xj[jGammaIndex[var][e]];
 	      }
-	      Astate[INDEX(iIndex, j, kIndex, iDim, jDim, varDim, var)] = tmp;
+	      Astate[SINDEX(iIndex, j, kIndex, var)] = tmp;
 	    }
       	  }
     	}
+  	}
     	//GPTLstop("IKJ Loop");
     	//GPTLstart("JKI Loop");
-    	#pragma omp parallel for private(tmp,iB,xi,i,l,m,jIndex,kIndex) //[5.0.3]
-    	#pragma acc parallel loop gang worker collapse(2) vector_length(32) private(tmp,iB,xi) //[5.0.3]
+    	#pragma omp parallel for collapse(3) schedule(runtime) private(tmp,iB,xi,i,l,m,jIndex,kIndex) //[5.0.3]
+    	#pragma acc parallel loop gang worker collapse(3) vector_length(32) private(tmp,iB,xi) //[5.0.3]
+  	for (int var = 0; var < varDim; var++) {
     	for (int jIndex = 0; jIndex < jDim; jIndex++) {
       	  for (int kIndex = 0; kIndex < kDim; kIndex++) {
             #pragma acc loop vector
 	    for (int i = 0; i < iDim; i++) {
-	      iB[i] = Astate[INDEX(i, jIndex, kIndex, iDim, jDim, varDim, var)];
+	      iB[i] = Astate[SINDEX(i, jIndex, kIndex, var)];
 	    }
 	    // Multiply by gamma
 	    for (int m = 0; m < iRank[var]; m++) {
 	      //bi[m] = 0;
 	      tmp = 0;
               #pragma acc loop vector reduction(+:tmp)
-	      for (int i = 0; i < iDim; i++) {
-	       	tmp += iGamma[var][iDim*m + i]*iB[i];
+	      for (int e = iGammaRow[var][2*m]; e < iGammaRow[var][2*m+1]; e++) {
+	       	tmp += iGamma[var][e]*iB[iGammaIndex[var][e]];
 	      }
 	      //  Solve for A's using compact storage
               #pragma acc loop vector reduction(+:tmp)
@@ -977,11 +1779,11 @@ bool CostFunction3D::SAtransform(const real* Bstate, real* Astate)
 	   for (int i = 0; i < iDim; i++) {
 	     //ai[i] = 0;
              tmp=0;
-	     for (int m = 0; m < iRank[var]; m++) {
-	       tmp += iGamma[var][iDim*m + i]*xi[m];
+	     for (int e = iGammaCol[var][2*i]; e < iGammaCol[var][2*i+1]; e++) {
+	       tmp += iGamma[var][e]*xi[iGammaIndex[var][e]];
 	     }
 	     // std::cout << "i: " << i << " ai[" << i << "]: " << tmp << "\n";
-	     Astate[INDEX(i, jIndex, kIndex, iDim, jDim, varDim, var)] = tmp;
+	     Astate[SINDEX(i, jIndex, kIndex, var)] = tmp;
 	   }
       	  }
         }
@@ -995,174 +1797,70 @@ bool CostFunction3D::SAtransform(const real* Bstate, real* Astate)
 
 bool CostFunction3D::SAtranspose(const real* Astate, real* Bstate)
 {
+  TransformSchedule transformSchedule(scheduleKind, scheduleChunk);
+  int maxDim = max(iDim, max(jDim, kDim));
+
   GPTLstart("CostFunction3D::SAtranspose");
+  // The axes of SAtransform in reverse order, each one parallel loop over the pencils of all the variables
+  #pragma omp parallel
+  {
+    real* pencil = new real[maxDim];
+    real* x = new real[maxDim];
 
-  //#pragma omp parallel for
-  for (int var = 0; var < varDim; var++) {
-    int l;
-    real* iB = new real[iDim];
-    real* x = new real[iDim];
-    real* b = new real[iRank[var]];
-    real* a = new real[iDim];
-    for (int jIndex = 0; jIndex < jDim; jIndex++) {
-     for (int kIndex = 0; kIndex < kDim; kIndex++) {
-			for (int iIndex = 0; iIndex < iDim; iIndex++) {
-  			iB[iIndex] = Astate[INDEX(iIndex, jIndex, kIndex, iDim, jDim, varDim, var)];
-			}
-			// Multiply by gamma
-			for (int m = 0; m < iRank[var]; m++) {
-  			b[m] = 0;
-  			for (int i = 0; i < iDim; i++) {
-    			b[m] += iGamma[var][iDim*m + i]*iB[i];
-  			}
-			}
-
-			// Solve for A's using compact storage
-			real sum = 0;
-			for (int i = 0; i < iRank[var]; i++) {
-  			for (sum=b[i], l=-1;l>=-(iLDim-1);l--) {
-    			if ((i+l >= 0) and ((i*iLDim-l) >= 0))
-      			sum -= iL[var][i*iLDim-l]*x[i+l];
-  				}
-  				x[i] = sum/iL[var][i*iLDim];
-				}
-				for (int i=iRank[var]-1;i>=0;i--) {
-  				for (sum=x[i], l=1;l<=(iLDim-1);l++) {
-    				if ((i+l < iRank[var]) and (((i+l)*iLDim+l) < iRank[var]*iLDim))
-      				sum -= iL[var][(i+l)*iLDim+l]*x[i+l];
-  				}
-  				x[i] = sum/iL[var][i*iLDim];
-				}
+    #pragma omp for collapse(3) schedule(runtime)
+    for (int var = 0; var < varDim; var++) {
+      for (int jIndex = 0; jIndex < jDim; jIndex++) {
+	for (int kIndex = 0; kIndex < kDim; kIndex++) {
+	  for (int iIndex = 0; iIndex < iDim; iIndex++) {
+	    pencil[iIndex] = Astate[SINDEX(iIndex, jIndex, kIndex, var)];
+	  }
+	  splinePencil(pencil, x, iDim, iRank[var], iLDim, iL[var], iGamma[var], iGammaRow[var],
+		       iGammaCol[var], iGammaIndex[var]);
+	  for (int iIndex = 0; iIndex < iDim; iIndex++) {
+	    Bstate[SINDEX(iIndex, jIndex, kIndex, var)] = pencil[iIndex];
+	  }
+	}
+      }
+    }
 
-				// Multiply by gammaT
-				for (int i = 0; i < iDim; i++) {
-  				a[i] = 0;
-  				for (int m = 0; m < iRank[var]; m++) {
-    				a[i] += iGamma[var][iDim*m + i]*x[m];
-  				}
-				}
+    #pragma omp for collapse(3) schedule(runtime)
+    for (int var = 0; var < varDim; var++) {
+      for (int kIndex = 0; kIndex < kDim; kIndex++) {
+	for (int iIndex = 0; iIndex < iDim; iIndex++) {
+	  for (int jIndex = 0; jIndex < jDim; jIndex++) {
+	    pencil[jIndex] = Bstate[SINDEX(iIndex, jIndex, kIndex, var)];
+	  }
+	  splinePencil(pencil, x, jDim, jRank[var], jLDim, jL[var], jGamma[var], jGammaRow[var],
+		       jGammaCol[var], jGammaIndex[var]);
+	  for (int jIndex = 0; jIndex < jDim; jIndex++) {
+	    Bstate[SINDEX(iIndex, jIndex, kIndex, var)] = pencil[jIndex];
+	  }
+	}
+      }
+    }
 
-				for (int iIndex = 0; iIndex < iDim; iIndex++) {
-  				Bstate[INDEX(iIndex, jIndex, kIndex, iDim, jDim, varDim, var)] = a[iIndex];
-				}
+    #pragma omp for collapse(3) schedule(runtime)
+    for (int var = 0; var < varDim; var++) {
+      for (int iIndex = 0; iIndex < iDim; iIndex++) {
+	for (int jIndex = 0; jIndex < jDim; jIndex++) {
+	  for (int kIndex = 0; kIndex < kDim; kIndex++) {
+	    pencil[kIndex] = Bstate[SINDEX(iIndex, jIndex, kIndex, var)];
+	  }
+	  splinePencil(pencil, x, kDim, kRank[var], kLDim, kL[var], kGamma[var], kGammaRow[var],
+		       kGammaCol[var], kGammaIndex[var]);
+	  for (int kIndex = 0; kIndex < kDim; kIndex++) {
+	    Bstate[SINDEX(iIndex, jIndex, kIndex, var)] = pencil[kIndex];
+	  }
+	}
+      }
+    }
+    delete[] pencil;
+    delete[] x;
+  }
 
-     	}
-		}
-   	delete[] iB;
-   	delete[] x;
-   	delete[] b;
-   	delete[] a;
-
-   	real* jB = new real[jDim];
-   	x = new real[jDim];
-   	b = new real[jRank[var]];
-   	a = new real[jDim];
-   	for (int kIndex = 0; kIndex < kDim; kIndex++) {
-     	for (int iIndex = 0; iIndex < iDim; iIndex++) {
-				for (int jIndex = 0; jIndex < jDim; jIndex++) {
-  				jB[jIndex] = Bstate[INDEX(iIndex, jIndex, kIndex, iDim, jDim, varDim, var)];
-				}
-				// Multiply by gamma
-				for (int m = 0; m < jRank[var]; m++) {
-  				b[m] = 0;
-  				for (int j = 0; j < jDim; j++) {
-    				b[m] += jGamma[var][jDim*m + j]*jB[j];
-  				}
-				}
-
-				// Solve for A's using compact storage
-				real sum = 0;
-				for (int j = 0; j < jRank[var]; j++) {
-  				for (sum=b[j], l=-1;l>=-(jLDim-1);l--) {
-    				if ((j+l >= 0) and ((j*jLDim-l) >= 0))
-      				sum -= jL[var][j*jLDim-l]*x[j+l];
-  				}
-  				x[j] = sum/jL[var][j*jLDim];
-				}
-				for (int j=jRank[var]-1;j>=0;j--) {
-  				for (sum=x[j], l=1;l<=(jLDim-1);l++) {
-    				if ((j+l < jRank[var]) and (((j+l)*jLDim+l) < jRank[var]*jLDim))
-      				sum -= jL[var][(j+l)*jLDim+l]*x[j+l];
-  				}
-  				x[j] = sum/jL[var][j*jLDim];
-				}
-
-				// Multiply by gammaT
-				for (int j = 0; j < jDim; j++) {
-  				a[j] = 0;
-  				for (int m = 0; m < jRank[var]; m++) {
-    				a[j] += jGamma[var][jDim*m + j]*x[m];
-  				}
-				}
-				for (int jIndex = 0; jIndex < jDim; jIndex++) {
-  				Bstate[INDEX(iIndex, jIndex, kIndex, iDim, jDim, varDim, var)] = a[jIndex];
-				}
-     	}
-   	}
-   	delete[] jB;
-   	delete[] x;
-   	delete[] b;
-   	delete[] a;
-
-   	real* kB = new real[kDim];
-   	x = new real[kDim];
-   	b = new real[kRank[var]];
-   	a = new real[kDim];
-   	for (int iIndex = 0; iIndex < iDim; iIndex++) {
-     	for (int jIndex = 0; jIndex < jDim; jIndex++) {
-				for (int kIndex = 0; kIndex < kDim; kIndex++) {
-  				kB[kIndex] = Bstate[INDEX(iIndex, jIndex, kIndex, iDim, jDim, varDim, var)];
-				}
-				// Multiply by gamma
-				for (int m = 0; m < kRank[var]; m++) {
-  				b[m] = 0;
-  				for (int k = 0; k < kDim; k++) {
-    				b[m] += kGamma[var][kDim*m + k]*kB[k];
-  				}
-  				//std::cout << m << " " << b[m] << "\n";
-				}
-
-				// Solve for A's using compact storage
-				real sum = 0;
-				for (int k = 0; k < kRank[var]; k++) {
-  				for (sum=b[k], l=-1;l>=-(kLDim-1);l--) {
-    				if ((k+l >= 0) and ((k*kLDim-l) >= 0))
-      				sum -= kL[var][k*kLDim-l]*x[k+l];
-  				}
-  				x[k] = sum/kL[var][k*kLDim];
-				}
-				for (int k=kRank[var]-1;k>=0;k--) {
-  				for (sum=x[k], l=1;l<=(kLDim-1);l++) {
-    				if ((k+l < kRank[var]) and (((k+l)*kLDim+l) < kRank[var]*kLDim))
-      				sum -= kL[var][(k+l)*kLDim+l]*x[k+l];
-  				}
-  				x[k] = sum/kL[var][k*kLDim];
-				}
-
-				// Multiply by gammaT
-				for (int k = 0; k < kDim; k++) {
-  				a[k] = 0;
-  				for (int m = 0; m < kRank[var]; m++) {
-    				a[k] += kGamma[var][kDim*m + k]*x[m];
-  				}
-  				//std::cout << k << " " << a[k] << "\n";
-				}
-
-				for (int kIndex = 0; kIndex < kDim; kIndex++) {
-  				Bstate[INDEX(iIndex, jIndex, kIndex, iDim, jDim, varDim, var)] = a[kIndex];
-				}
-     	}
-   	}
-   	delete[] kB;
-   	delete[] b;
-   	delete[] x;
-   	delete[] a;
-
- 	}
-
-  GPTLstop("CostFunction3D::SAtranspose");
-  return true;
-}
+  GPTLstop("CostFunction3D::SAtranspose");
+  return true;
+}
 
 /* NCAR - This is the optimized routine, but it has a bug where it's writing past the bounds of Bstate, replacing with
  * the old one for now.
@@ -1223,7 +1921,7 @@ void CostFunction3D::SBtransform(const real* Ustate, real* Bstate)
                       ui = INDEX(uI, uJ, kIndex*2 + (kmu+1)/2, (iDim-1)*2, (jDim-1)*2, varDim, var);
 		      						if (Ustate[ui] == 0) continue;
 		     							kbasis = Basis(kNode, k, kDim-1, kMin, DK, DKrecip, 0, kBCL[var], kBCR[var]);
-		      						bi = INDEX(iNode, jNode, kNode, iDim, jDim, varDim, var);
+		      						bi = SINDEX(iNode, jNode, kNode, var);
 		      						Bstate[bi] += Ustate[ui] * 0.125 * ibasis * jbasis * kbasis;
 		    						}
 		  						}
@@ -1240,62 +1938,135 @@ void CostFunction3D::SBtransform(const real* Ustate, real* Bstate)
 
 void CostFunction3D::SBtransform(const real* Ustate, real* Bstate)
 {
+  GPTLstart("CostFunction3D::SBtransform");
+
   // Clear the Bstate
+  #pragma omp parallel for
   for (int64_t n = 0; n < nState; n++) {
     Bstate[n] = 0.;
   }
   real gausspoint = 0.5*sqrt(1./3.);
 
-  //#pragma omp parallel for
+  // The mish points and the basis are a tensor product, so the projection is done
+  // as three 1-D contractions (k, then j, then i) instead of a 4x4x4 scatter per mish point
+  int iMish = (iDim-1)*2;
+  int jMish = (jDim-1)*2;
+  int kMish = (kDim-1)*2;
+  int64_t tSize = max((int64_t)iMish*jMish*kDim, (int64_t)iMish*jDim*kDim);
+  real* kTemp = new real[tSize];
+  real* jTemp = new real[tSize];
+  int* iNodes = new int[iMish*4];
+  int* jNodes = new int[jMish*4];
+  int* kNodes = new int[kMish*4];
+  real* iBasis = new real[iMish*4];
+  real* jBasis = new real[jMish*4];
+  real* kBasis = new real[kMish*4];
+
   for (int var = 0; var < varDim; var++) {
-    for (int iIndex = min(rankHash[iBCL[var]],1); iIndex < max(iDim-1-rankHash[iBCR[var]],iDim-2); iIndex++) {
-      for (int imu = -1; imu <= 1; imu += 2) {
-	real i = iMin + DI * (iIndex + (gausspoint * imu + 0.5));
-	int ii = (int)((i - iMin)*DIrecip);
-	for (int iiNode = (ii-1); iiNode <= (ii+2); ++iiNode) {
-	  int iNode = iiNode;
-	  if ((iNode < 0) or (iNode >= iDim)) continue;
-	  real ibasis = Basis(iNode, i, iDim-1, iMin, DI, DIrecip, 0, iBCL[var], iBCR[var]);
-	  int uI = iIndex*2 + (imu+1)/2;
-	  for (int jIndex = min(rankHash[jBCL[var]],1); jIndex < max(jDim-1-rankHash[jBCR[var]],jDim-2); jIndex++) {
-	    for (int jmu = -1; jmu <= 1; jmu += 2) {
-	      real j = jMin + DJ * (jIndex + (gausspoint * jmu + 0.5));
-	      int jj = (int)((j - jMin)*DJrecip);
-	      for (int jjNode = (jj-1); jjNode <= (jj+2); ++jjNode) {
-		int jNode = jjNode;
-		if ((jNode < 0) or (jNode >= jDim)) continue;
-		real jbasis = Basis(jNode, j, jDim-1, jMin, DJ, DJrecip, 0, jBCL[var], jBCR[var]);
-		int uJ = jIndex*2 + (jmu+1)/2;
-		real ijbasis = ibasis * jbasis;
-		for (int kIndex = min(rankHash[kBCL[var]],1); kIndex < max(kDim-1-rankHash[kBCR[var]],kDim-2); kIndex++) {
-		  for (int kmu = -1; kmu <= 1; kmu += 2) {
-		    real k = kMin + DK * (kIndex + (gausspoint * kmu + 0.5));
-		    int kk = (int)((k - kMin)*DKrecip);
-		    for (int kkNode = (kk-1); kkNode <= (kk+2); ++kkNode) {
-		      int kNode = kkNode;
-		      if ((kNode < 0) or (kNode >= kDim)) continue;
-		      real kbasis = Basis(kNode, k, kDim-1, kMin, DK, DKrecip, 0, kBCL[var], kBCR[var]);
-		      real ijkbasis = 0.125 * ijbasis * kbasis;
-		      int uK = kIndex*2 + (kmu+1)/2;
-		      int64_t uIndex = varDim * (iDim - 1) * 2 * (jDim - 1) * 2 * uK
-			+ varDim * (iDim -1 ) * 2 * uJ + varDim * uI;
-		      int64_t bIndex = varDim*iDim*jDim*kNode + varDim*iDim*jNode +varDim*iNode;
-
-		      int64_t ui = uIndex + var;
-		      if (Ustate[ui] == 0) continue;
-		      int64_t bi = bIndex + var;
-		      //#pragma omp atomic
-		      Bstate[bi] += Ustate[ui] * ijkbasis;
-		    }
-		  }
-		}
-	      }
-	    }
+
+    // 1-D basis values from each mish point to its nodes, -1 marks a point or node outside the loop bounds
+    int is = min(rankHash[iBCL[var]],1), ie = max(iDim-1-rankHash[iBCR[var]],iDim-2);
+    int js = min(rankHash[jBCL[var]],1), je = max(jDim-1-rankHash[jBCR[var]],jDim-2);
+    int ks = min(rankHash[kBCL[var]],1), ke = max(kDim-1-rankHash[kBCR[var]],kDim-2);
+    for (int uI = 0; uI < iMish; uI++) {
+      int iIndex = uI/2;
+      real i = iMin + DI * (iIndex + (gausspoint * (2*(uI%2)-1) + 0.5));
+      int ii = (int)((i - iMin)*DIrecip);
+      for (int n = 0; n < 4; n++) {
+	int iNode = ii - 1 + n;
+	bool valid = (iIndex >= is) and (iIndex < ie) and (iNode >= 0) and (iNode < iDim);
+	iNodes[uI*4+n] = valid ? iNode : -1;
+	iBasis[uI*4+n] = valid ? tableBasis(iBasisTable, iIndex, 1 + 2*(uI%2), var, n, 0) : 0;
+      }
+    }
+    for (int uJ = 0; uJ < jMish; uJ++) {
+      int jIndex = uJ/2;
+      real j = jMin + DJ * (jIndex + (gausspoint * (2*(uJ%2)-1) + 0.5));
+      int jj = (int)((j - jMin)*DJrecip);
+      for (int n = 0; n < 4; n++) {
+	int jNode = jj - 1 + n;
+	bool valid = (jIndex >= js) and (jIndex < je) and (jNode >= 0) and (jNode < jDim);
+	jNodes[uJ*4+n] = valid ? jNode : -1;
+	jBasis[uJ*4+n] = valid ? tableBasis(jBasisTable, jIndex, 1 + 2*(uJ%2), var, n, 0) : 0;
+      }
+    }
+    for (int uK = 0; uK < kMish; uK++) {
+      int kIndex = uK/2;
+      real k = kMin + DK * (kIndex + (gausspoint * (2*(uK%2)-1) + 0.5));
+      int kk = (int)((k - kMin)*DKrecip);
+      for (int n = 0; n < 4; n++) {
+	int kNode = kk - 1 + n;
+	bool valid = (kIndex >= ks) and (kIndex < ke) and (kNode >= 0) and (kNode < kDim);
+	kNodes[uK*4+n] = valid ? kNode : -1;
+	kBasis[uK*4+n] = valid ? tableBasis(kBasisTable, kIndex, 1 + 2*(uK%2), var, n, 0) : 0;
+      }
+    }
+
+    // Contract along k: kTemp[kNode][uJ][uI]
+    #pragma omp parallel for
+    for (int uJ = 0; uJ < jMish; uJ++) {
+      for (int kNode = 0; kNode < kDim; kNode++)
+	for (int uI = 0; uI < iMish; uI++)
+	  kTemp[((int64_t)kNode*jMish + uJ)*iMish + uI] = 0.;
+      for (int uK = 0; uK < kMish; uK++) {
+	for (int n = 0; n < 4; n++) {
+	  int kNode = kNodes[uK*4+n];
+	  if (kNode < 0) continue;
+	  real kbasis = kBasis[uK*4+n];
+	  real* kt = kTemp + ((int64_t)kNode*jMish + uJ)*iMish;
+	  for (int uI = 0; uI < iMish; uI++) {
+	    int64_t ui = INDEX(uI, uJ, uK, iMish, jMish, varDim, var);
+	    kt[uI] += Ustate[ui] * kbasis;
+	  }
+	}
+      }
+    }
+
+    // Contract along j: jTemp[kNode][jNode][uI]
+    #pragma omp parallel for
+    for (int kNode = 0; kNode < kDim; kNode++) {
+      real* jt = jTemp + (int64_t)kNode*jDim*iMish;
+      for (int64_t n = 0; n < (int64_t)jDim*iMish; n++) jt[n] = 0.;
+      for (int uJ = 0; uJ < jMish; uJ++) {
+	const real* kt = kTemp + ((int64_t)kNode*jMish + uJ)*iMish;
+	for (int n = 0; n < 4; n++) {
+	  int jNode = jNodes[uJ*4+n];
+	  if (jNode < 0) continue;
+	  real jbasis = jBasis[uJ*4+n];
+	  for (int uI = 0; uI < iMish; uI++) {
+	    jt[jNode*iMish + uI] += kt[uI] * jbasis;
+	  }
+	}
+      }
+    }
+
+    // Contract along i into the nodes, each (jNode,kNode) pencil is owned by one thread
+    #pragma omp parallel for collapse(2)
+    for (int kNode = 0; kNode < kDim; kNode++) {
+      for (int jNode = 0; jNode < jDim; jNode++) {
+	const real* jt = jTemp + ((int64_t)kNode*jDim + jNode)*iMish;
+	for (int uI = 0; uI < iMish; uI++) {
+	  if (jt[uI] == 0) continue;
+	  for (int n = 0; n < 4; n++) {
+	    int iNode = iNodes[uI*4+n];
+	    if (iNode < 0) continue;
+	    int64_t bi = SINDEX(iNode, jNode, kNode, var);
+	    Bstate[bi] += 0.125 * jt[uI] * iBasis[uI*4+n];
 	  }
 	}
       }
     }
   }
+
+  delete[] kTemp;
+  delete[] jTemp;
+  delete[] iNodes;
+  delete[] jNodes;
+  delete[] kNodes;
+  delete[] iBasis;
+  delete[] jBasis;
+  delete[] kBasis;
+  GPTLstop("CostFunction3D::SBtransform");
 }
 
 void CostFunction3D::SBtranspose(const real* Bstate, real* Ustate)
@@ -1317,7 +2088,7 @@ void CostFunction3D::SBtranspose(const real* Bstate, real* Ustate)
 				for (int iiNode = (ii-1); iiNode <= (ii+2); ++iiNode) {
 	  			int iNode = iiNode;
 	  			if ((iNode < 0) or (iNode >= iDim)) continue;
-	  			real ibasis = Basis(iNode, i, iDim-1, iMin, DI, DIrecip, 0, iBCL[var], iBCR[var]);
+	  			real ibasis = tableBasis(iBasisTable, iIndex, imu + 2, var, iNode - ii + 1, 0);
 	  			int uI = iIndex*2 + (imu+1)/2;
 	  			for (int jIndex = min(rankHash[jBCL[var]],1); jIndex < max(jDim-1-rankHash[jBCR[var]],jDim-2); jIndex++) {
 	    			for (int jmu = -1; jmu <= 1; jmu += 2) {
@@ -1326,7 +2097,7 @@ void CostFunction3D::SBtranspose(const real* Bstate, real* Ustate)
 	      			for (int jjNode = (jj-1); jjNode <= (jj+2); ++jjNode) {
 								int jNode = jjNode;
 								if ((jNode < 0) or (jNode >= jDim)) continue;
-								real jbasis = Basis(jNode, j, jDim-1, jMin, DJ, DJrecip, 0, jBCL[var], jBCR[var]);
+								real jbasis = tableBasis(jBasisTable, jIndex, jmu + 2, var, jNode - jj + 1, 0);
 								int uJ = jIndex*2 + (jmu+1)/2;
 								real ijbasis = ibasis * jbasis;
 								for (int kIndex = min(rankHash[kBCL[var]],1); kIndex < max(kDim-1-rankHash[kBCR[var]],kDim-2); kIndex++) {
@@ -1337,8 +2108,8 @@ void CostFunction3D::SBtranspose(const real* Bstate, real* Ustate)
 		      						if ((kNode < 0) or (kNode >= kDim)) continue;
               				int ui = INDEX(uI, uJ, kIndex*2 + (kmu+1)/2, (iDim-1)*2, (jDim-1)*2, varDim, var);
 		      						if (Ustate[ui] == 0) continue;
-		      						real kbasis = Basis(kNode, k, kDim-1, kMin, DK, DKrecip, 0, kBCL[var], kBCR[var]);
-		      						int bi = INDEX(iNode, jNode, kNode, iDim, jDim, varDim, var);
+		      						real kbasis = tableBasis(kBasisTable, kIndex, kmu + 2, var, kNode - kk + 1, 0);
+		      						int bi = SINDEX(iNode, jNode, kNode, var);
 		      						Ustate[ui] += Bstate[bi] * 0.125 * ijbasis * kbasis;
 		    						}
 		  						}
@@ -1355,74 +2126,90 @@ void CostFunction3D::SBtranspose(const real* Bstate, real* Ustate)
 
 void CostFunction3D::SCtransform(const real* Astate, real* Cstate)
 {
-  real iTemp[iDim], iq[iDim],is[iDim];
-  real jTemp[jDim], jq[jDim],js[jDim];
-  real kTemp[kDim], kq[kDim],ks[kDim];
-  int n,iIndex,jIndex,kIndex,index;
+  TransformSchedule transformSchedule(scheduleKind, scheduleChunk);
+  // Adjacent pencils are filtered together, interleaved along the batch
+  const int nb = RecursiveFilter::pencilBatch;
+  real iTemp[iDim*nb], iq[iDim*nb];
+  real jTemp[jDim*nb], jq[jDim*nb];
+  real kTemp[kDim*nb], kq[kDim*nb];
 
    #pragma acc data present(Astate[0:nState],Cstate[0:nState])
    {
   	GPTLstart("CostFunction3D::SCtransform");
   	// Disable recursive filter if less than 1
   	if ((iFilterScale < 0) and (jFilterScale < 0) and (kFilterScale < 0)) {
-    	   #pragma omp parallel for private(n) //[5.1]
+    	   #pragma omp parallel for //[5.1]
 	   #pragma acc parallel loop vector_length(32) //[5.1]
   	   for (int n = 0; n < nState; n++) {
       	     Cstate[n]= Astate[n] * bgStdDev[n];
     	   }
   	} else {
     	 // Isotropic Recursive filter, no anisotropic "triad" working yet
-    	 for (int var = 0; var < varDim; var++) {
+	 // Each axis is one parallel loop over the pencil batches of all the variables
 
-	   #pragma omp parallel for private(iIndex,jIndex,kIndex,index,kTemp,kq,ks) //[5.2]
-	   #pragma acc parallel loop gang worker collapse(2) vector_length(32) private(kTemp,kq,ks) //[5.2]
-      	   for (int iIndex = 0; iIndex < iDim; iIndex++) {
+	   // k pencils, batched along i
+	   #pragma omp parallel for collapse(3) schedule(runtime) private(kTemp,kq) //[5.2]
+	   #pragma acc parallel loop gang worker collapse(3) vector_length(32) private(kTemp,kq) //[5.2]
+    	 for (int var = 0; var < varDim; var++) {
+      	   for (int iBatch = 0; iBatch < iDim; iBatch += nb) {
    	     for (int jIndex = 0; jIndex < jDim; jIndex++) {
-                #pragma acc loop vector
+	        int np = min(nb, iDim - iBatch);
 	  	for (int kIndex = 0; kIndex < kDim; kIndex++) {
-	    	   kTemp[kIndex] = Astate[INDEX(iIndex, jIndex, kIndex, iDim, jDim, varDim, var)];
+	  	   for (int n = 0; n < np; n++) {
+	    	     kTemp[kIndex*np + n] = Astate[SINDEX(iBatch+n, jIndex, kIndex, var)];
+	  	   }
 	  	}
-	  	if (kFilterScale > 0) kFilter->filterArray(kTemp, kq,ks,kDim);
-          	#pragma acc loop vector
+	  	if (kFilterScale > 0) kFilter->filterPencils(kTemp, kq, kDim, np);
 	  	for (int kIndex = 0; kIndex < kDim; kIndex++) {
-	    	   Cstate[INDEX(iIndex, jIndex, kIndex, iDim, jDim, varDim, var)] = kTemp[kIndex];
+	  	   for (int n = 0; n < np; n++) {
+	    	     Cstate[SINDEX(iBatch+n, jIndex, kIndex, var)] = kTemp[kIndex*np + n];
+	  	   }
 	  	}
 	     }
       	   }
+	 }
 
-	   #pragma omp parallel for private(iIndex,jIndex,kIndex,index,jTemp,jq,js) //[5.3]
-	   #pragma acc parallel loop gang worker  collapse(2) vector_length(32) private(index,jTemp,jq,js) //[5.3]
-      	   for (int iIndex = 0; iIndex < iDim; iIndex++) {
+	   // j pencils, batched along i
+	   #pragma omp parallel for collapse(3) schedule(runtime) private(jTemp,jq) //[5.3]
+	   #pragma acc parallel loop gang worker collapse(3) vector_length(32) private(jTemp,jq) //[5.3]
+    	 for (int var = 0; var < varDim; var++) {
+      	   for (int iBatch = 0; iBatch < iDim; iBatch += nb) {
              for (int kIndex = 0; kIndex < kDim; kIndex++) {
-          	#pragma acc loop vector
+	        int np = min(nb, iDim - iBatch);
 	  	for (int jIndex = 0; jIndex < jDim; jIndex++) {
-                  index = INDEX(iIndex, jIndex, kIndex, iDim, jDim, varDim, var);
-                  jTemp[jIndex] = Cstate[index];
+	  	   for (int n = 0; n < np; n++) {
+                     jTemp[jIndex*np + n] = Cstate[SINDEX(iBatch+n, jIndex, kIndex, var)];
+	  	   }
 	  	}
-	  	if (jFilterScale > 0) jFilter->filterArray(jTemp, jq, js, jDim);
-          	#pragma acc loop vector
+	  	if (jFilterScale > 0) jFilter->filterPencils(jTemp, jq, jDim, np);
 	  	for (int jIndex = 0; jIndex < jDim; jIndex++) {
-            	   index = INDEX(iIndex, jIndex, kIndex, iDim, jDim, varDim, var);
-	    	   Cstate[index] = jTemp[jIndex];
+	  	   for (int n = 0; n < np; n++) {
+	    	     Cstate[SINDEX(iBatch+n, jIndex, kIndex, var)] = jTemp[jIndex*np + n];
+	  	   }
 	  	}
 	     }
       	   }
+	 }
 
-	   #pragma omp parallel for private(iIndex,jIndex,kIndex,index,iTemp,iq,is) //[5.4]
-	   #pragma acc parallel loop gang worker collapse(2) vector_length(32) private(index,iTemp,iq,is) //[5.4]
-      	   for (int jIndex = 0; jIndex < jDim; jIndex++) {
+	   // i pencils, batched along j
+	   #pragma omp parallel for collapse(3) schedule(runtime) private(iTemp,iq) //[5.4]
+	   #pragma acc parallel loop gang worker collapse(3) vector_length(32) private(iTemp,iq) //[5.4]
+    	 for (int var = 0; var < varDim; var++) {
+      	   for (int jBatch = 0; jBatch < jDim; jBatch += nb) {
 	     for (int kIndex = 0; kIndex < kDim; kIndex++) {
-          	#pragma acc loop vector
+	        int np = min(nb, jDim - jBatch);
 	  	for (int iIndex = 0; iIndex < iDim; iIndex++) {
-            	   index = INDEX(iIndex, jIndex, kIndex, iDim, jDim, varDim, var);
-	    	   iTemp[iIndex] = Cstate[index];
+	  	   for (int n = 0; n < np; n++) {
+	    	     iTemp[iIndex*np + n] = Cstate[SINDEX(iIndex, jBatch+n, kIndex, var)];
+	  	   }
 	  	}
-	  	if (iFilterScale > 0) iFilter->filterArray(iTemp, iq, is, iDim);
-          	#pragma acc loop vector
+	  	if (iFilterScale > 0) iFilter->filterPencils(iTemp, iq, iDim, np);
 	  	for (int iIndex = 0; iIndex < iDim; iIndex++) {
-	    	    // D
-	           index = INDEX(iIndex, jIndex, kIndex, iDim, jDim, varDim, var);
-	    	   Cstate[index] = iTemp[iIndex] * bgStdDev[index];
+	  	   for (int n = 0; n < np; n++) {
+	    	     // D
+	             int64_t index = SINDEX(iIndex, jBatch+n, kIndex, var);
+	    	     Cstate[index] = iTemp[iIndex*np + n] * bgStdDev[index];
+	  	   }
 	  	}
              }
       	   }
@@ -1435,167 +2222,100 @@ void CostFunction3D::SCtransform(const real* Astate, real* Cstate)
 
 void CostFunction3D::SCtranspose(const real* Cstate, real* Astate)
 {
+  TransformSchedule transformSchedule(scheduleKind, scheduleChunk);
+  int maxDim = max(iDim, max(jDim, kDim));
+
   GPTLstart("CostFunction3D::SCtranspose");
   if ((iFilterScale < 0) and (jFilterScale < 0) and (kFilterScale < 0)) {
-    for (int n = 0; n < nState; n++) {
+    #pragma omp parallel for
+    for (int64_t n = 0; n < nState; n++) {
       Astate[n]= Cstate[n] * bgStdDev[n];
     }
   } else {
     // Isotropic Recursive filter, no anisotropic "triad" working yet
-    for (int n = 0; n < nState; n++) {
-      Astate[n]= Cstate[n];
-    }
-    //_#pragma omp parallel for
-    for (int var = 0; var < varDim; var++) {
-
-      // These are local for parallelization
-      real* iTemp = new real[iDim];
-      real* jTemp = new real[jDim];
-      real* kTemp = new real[kDim];
-      real* iPad = NULL;
-      real* jPad = NULL;
-      real* kPad = NULL;
-      real* iq = NULL;
-      real* is = NULL;
-      real* jq = NULL;
-      real* js = NULL;
-      real* kq = NULL;
-      real* ks = NULL;
-      //if (iBCL[var] == PERIODIC) {
-      iPad = new real[iDim*3];
-      iq   = new real[iDim*3];
-      is   = new real[iDim*3];
-      //}
-      //if (jBCL[var] == PERIODIC) {
-      jPad = new real[jDim*3];
-      jq   = new real[jDim*3];
-      js   = new real[jDim*3];
-      //}
-      //if (kBCL[var] == PERIODIC) {
-      kPad = new real[kDim*3];
-      kq   = new real[kDim*3];
-      ks   = new real[kDim*3];
-      //}
+    // Each axis is one parallel loop over the pencils of all the variables
+    #pragma omp parallel
+    {
+      // Scratch is three times the pencil length for the padded filter
+      real* pad = new real[maxDim*3];
+      real* q = new real[maxDim*3];
+      real* sc = new real[maxDim*3];
 
       //FI & D
-      for (int jIndex = 0; jIndex < jDim; jIndex++) {
-				for (int kIndex = 0; kIndex < kDim; kIndex++) {
-	  			for (int iIndex = 0; iIndex < iDim; iIndex++) {
-	  				int cIndex = INDEX(iIndex, jIndex, kIndex, iDim, jDim, varDim, var);
-	    			iTemp[iIndex] = Astate[cIndex] * bgStdDev[cIndex];
-	  			}
-	  			if (iFilterScale > 0) {
-	    			if (iBCL[var] == PERIODIC) {
-	      			// Pad the array to account for periodicity
-	      			for (int iIndex = 0; iIndex < iDim; iIndex++) {
-								iPad[iIndex] = iTemp[iIndex];
-								iPad[iIndex+iDim] = iTemp[iIndex];
-								iPad[iIndex+iDim*2] = iTemp[iIndex];
-	      			}
-	      			iFilter->filterArray(iPad, iq,is,iDim*3);
-	      			for (int iIndex = 0; iIndex < iDim; iIndex++) {
-								iTemp[iIndex] = iPad[iIndex+iDim];
-	      			}
-	    			} else {
-	      			for (int iIndex = 0; iIndex < iDim; iIndex++) {
-								iPad[iIndex] = 0.0;
-								iPad[iIndex+iDim] = iTemp[iIndex];
-								iPad[iIndex+iDim*2] = 0.0;
-	      			}
-	      			iFilter->filterArray(iPad, iq,is, iDim*3);
-	      			for (int iIndex = 0; iIndex < iDim; iIndex++) {
-									iTemp[iIndex] = iPad[iIndex+iDim];
-	      			}
-	    			}
-	  			}
-	  			for (int iIndex = 0; iIndex < iDim; iIndex++) {
-	    			Astate[INDEX(iIndex, jIndex, kIndex, iDim, jDim, varDim, var)] = iTemp[iIndex];
-	  			}
-				}
+      #pragma omp for collapse(3) schedule(runtime)
+      for (int var = 0; var < varDim; var++) {
+	for (int jIndex = 0; jIndex < jDim; jIndex++) {
+	  for (int kIndex = 0; kIndex < kDim; kIndex++) {
+	    if (iFilterScale > 0) {
+	      // Pad the array, periodically or with zeros
+	      bool periodic = (iBCL[var] == PERIODIC);
+	      for (int iIndex = 0; iIndex < iDim; iIndex++) {
+		int64_t cIndex = SINDEX(iIndex, jIndex, kIndex, var);
+		real a = Cstate[cIndex] * bgStdDev[cIndex];
+		pad[iIndex] = periodic ? a : 0.0;
+		pad[iIndex+iDim] = a;
+		pad[iIndex+iDim*2] = periodic ? a : 0.0;
+	      }
+	      iFilter->filterArray(pad, q, sc, iDim*3);
+	      for (int iIndex = 0; iIndex < iDim; iIndex++) {
+		Astate[SINDEX(iIndex, jIndex, kIndex, var)] = pad[iIndex+iDim];
+	      }
+	    } else {
+	      for (int iIndex = 0; iIndex < iDim; iIndex++) {
+		int64_t cIndex = SINDEX(iIndex, jIndex, kIndex, var);
+		Astate[cIndex] = Cstate[cIndex] * bgStdDev[cIndex];
+	      }
+	    }
+	  }
+	}
       }
+
       //FJ
-      for (int kIndex = 0; kIndex < kDim; kIndex++) {
-				for (int iIndex = 0; iIndex < iDim; iIndex++) {
-	  			for (int jIndex = 0; jIndex < jDim; jIndex++) {
-	    			jTemp[jIndex] = Astate[INDEX(iIndex, jIndex, kIndex, iDim, jDim, varDim, var)];
-	  			}
-	  			if (jFilterScale > 0) {
-	    			if (jBCL[var] == PERIODIC) {
-	      			// Pad the array to account for periodicity
-	      			for (int jIndex = 0; jIndex < jDim; jIndex++) {
-								jPad[jIndex] = jTemp[jIndex];
-								jPad[jIndex+jDim] = jTemp[jIndex];
-								jPad[jIndex+jDim*2] = jTemp[jIndex];
-	      			}
-	      			jFilter->filterArray(jPad, jq,js,jDim*3);
-	      			for (int jIndex = 0; jIndex < jDim; jIndex++) {
-								jTemp[jIndex] = jPad[jIndex+jDim];
-	      			}
-	    			} else {
-	      			for (int jIndex = 0; jIndex < jDim; jIndex++) {
-								jPad[jIndex] = 0.0;
-								jPad[jIndex+jDim] = jTemp[jIndex];
-								jPad[jIndex+jDim*2] = 0.0;
-	      			}
-	      			jFilter->filterArray(jPad, jq,js, jDim*3);
-	      			for (int jIndex = 0; jIndex < jDim; jIndex++) {
-								jTemp[jIndex] = jPad[jIndex+jDim];
-	      			}
-	    			}
-	  			}
-	  			for (int jIndex = 0; jIndex < jDim; jIndex++) {
-	    			Astate[INDEX(iIndex, jIndex, kIndex, iDim, jDim, varDim, var)] = jTemp[jIndex];
-	  			}
-				}
+      if (jFilterScale > 0) {
+	#pragma omp for collapse(3) schedule(runtime)
+	for (int var = 0; var < varDim; var++) {
+	  for (int kIndex = 0; kIndex < kDim; kIndex++) {
+	    for (int iIndex = 0; iIndex < iDim; iIndex++) {
+	      bool periodic = (jBCL[var] == PERIODIC);
+	      for (int jIndex = 0; jIndex < jDim; jIndex++) {
+		real a = Astate[SINDEX(iIndex, jIndex, kIndex, var)];
+		pad[jIndex] = periodic ? a : 0.0;
+		pad[jIndex+jDim] = a;
+		pad[jIndex+jDim*2] = periodic ? a : 0.0;
+	      }
+	      jFilter->filterArray(pad, q, sc, jDim*3);
+	      for (int jIndex = 0; jIndex < jDim; jIndex++) {
+		Astate[SINDEX(iIndex, jIndex, kIndex, var)] = pad[jIndex+jDim];
+	      }
+	    }
+	  }
+	}
       }
+
       //FK
-      for (int iIndex = 0; iIndex < iDim; iIndex++) {
-				for (int jIndex = 0; jIndex < jDim; jIndex++) {
-	  			for (int kIndex = 0; kIndex < kDim; kIndex++) {
-	   				kTemp[kIndex] = Astate[INDEX(iIndex, jIndex, kIndex, iDim, jDim, varDim, var)];
-	  			}
-          if (kFilterScale > 0) {
-	    			if (kBCL[var] == PERIODIC) {
-	      			// Pad the array to account for periodicity
-	      			for (int kIndex = 0; kIndex < kDim; kIndex++) {
-								kPad[kIndex] = kTemp[kIndex];
-								kPad[kIndex+kDim] = kTemp[kIndex];
-								kPad[kIndex+kDim*2] = kTemp[kIndex];
-	      			}
-	      			kFilter->filterArray(kPad, kq,ks,kDim*3);
-	      			for (int kIndex = 0; kIndex < kDim; kIndex++) {
-								kTemp[kIndex] = kPad[kIndex+kDim];
-	      			}
-	    			} else {
-	      			for (int kIndex = 0; kIndex < kDim; kIndex++) {
-								kPad[kIndex] = 0.0;
-								kPad[kIndex+kDim] = kTemp[kIndex];
-								kPad[kIndex+kDim*2] = 0.0;
-	      			}
-	      			kFilter->filterArray(kPad, kq,ks, kDim*3);
-	      			for (int kIndex = 0; kIndex < kDim; kIndex++) {
-								kTemp[kIndex] = kPad[kIndex+kDim];
-	      			}
-	    			}
-          }
-          for (int kIndex = 0; kIndex < kDim; kIndex++) {
-	    			Astate[INDEX(iIndex, jIndex, kIndex, iDim, jDim, varDim, var)] = kTemp[kIndex];
-	  			}
-				}
+      if (kFilterScale > 0) {
+	#pragma omp for collapse(3) schedule(runtime)
+	for (int var = 0; var < varDim; var++) {
+	  for (int iIndex = 0; iIndex < iDim; iIndex++) {
+	    for (int jIndex = 0; jIndex < jDim; jIndex++) {
+	      bool periodic = (kBCL[var] == PERIODIC);
+	      for (int kIndex = 0; kIndex < kDim; kIndex++) {
+		real a = Astate[SINDEX(iIndex, jIndex, kIndex, var)];
+		pad[kIndex] = periodic ? a : 0.0;
+		pad[kIndex+kDim] = a;
+		pad[kIndex+kDim*2] = periodic ? a : 0.0;
+	      }
+	      kFilter->filterArray(pad, q, sc, kDim*3);
+	      for (int kIndex = 0; kIndex < kDim; kIndex++) {
+		Astate[SINDEX(iIndex, jIndex, kIndex, var)] = pad[kIndex+kDim];
+	      }
+	    }
+	  }
+	}
       }
-      delete[] iTemp;
-      delete[] jTemp;
-      delete[] kTemp;
-      //if (iBCL[var] == PERIODIC) {
-      delete[] iPad;
-      //}
-      //if (jBCL[var] == PERIODIC) {
-      delete[] jPad;
-      //}
-      //if (kBCL[var] == PERIODIC) {
-      delete[] kPad;
-      //}
-
+      delete[] pad;
+      delete[] q;
+      delete[] sc;
     }
   }
   GPTLstop("CostFunction3D::SCtranspose");
@@ -1614,17 +2334,17 @@ bool CostFunction3D::setupSplines()
   real cutoff_wl = std::stof((*configHash)["i_spline_cutoff"]);
   cout << "i Spline cutoff set to " << cutoff_wl << endl;
   real eq = pow( (cutoff_wl/(2*Pi)) , 6);
-  calcSplineCoefficients(iDim, eq, iBCL, iBCR, iMin, DI, DIrecip, iLDim, iL, iGamma);
+  calcSplineCoefficients(iDim, eq, iBCL, iBCR, iMin, DI, DIrecip, iLDim, iL, iGamma, iGammaRow, iGammaCol, iGammaIndex);
 
   cutoff_wl = std::stof((*configHash)["j_spline_cutoff"]);
   cout << "j Spline cutoff set to " << cutoff_wl << endl;
   eq = pow( (cutoff_wl/(2*Pi)) , 6);
-  calcSplineCoefficients(jDim, eq, jBCL, jBCR, jMin, DJ, DJrecip, jLDim, jL, jGamma);
+  calcSplineCoefficients(jDim, eq, jBCL, jBCR, jMin, DJ, DJrecip, jLDim, jL, jGamma, jGammaRow, jGammaCol, jGammaIndex);
 
   cutoff_wl = std::stof((*configHash)["k_spline_cutoff"]);
   cout << "k Spline cutoff set to " << cutoff_wl << endl;
   eq = pow( (cutoff_wl/(2*Pi)) , 6);
-  calcSplineCoefficients(kDim, eq, kBCL, kBCR, kMin, DK, DKrecip, kLDim, kL, kGamma);
+  calcSplineCoefficients(kDim, eq, kBCL, kBCR, kMin, DK, DKrecip, kLDim, kL, kGamma, kGammaRow, kGammaCol, kGammaIndex);
 
   GPTLstop("CostFunction3D::setupSplines");
   return true;
@@ -1635,12 +2355,22 @@ bool CostFunction3D::setupSplines()
 void CostFunction3D::obAdjustments() {
   GPTLstart("CostFunction3D::obAdjustments");
 
-  // Load the obs locally and weight the nonlinear observation operators by interpolated bg fields
-  for (int m = 0; m < mObs; m++) {
-    int mi = m*(7+varDim*derivDim);
+  // Load the obs locally
+  for (int64_t m = 0; m < mObs; m++) {
+    int64_t mi = m*(7+varDim*derivDim);
+    int64_t ri = (obsOrder != NULL) ? obsOrder[m]*(7+varDim*derivDim) : mi;
     for (int ob = 0; ob < (7+varDim*derivDim); ob++) {
-      obsVector[mi+ob] = rawObs[mi+ob];
+      obsVector[mi+ob] = rawObs[ri+ob];
     }
+  }
+
+  // Weight the nonlinear observation operators by interpolated bg fields
+  int base[3*OBS_BLOCK];
+  real weights[24*OBS_BLOCK];
+  for (int64_t m = 0; m < mObs; m++) {
+    int o = m % OBS_BLOCK;
+    if (o == 0) obsBasisWeights(m, (int)min((int64_t)OBS_BLOCK, mObs - m), base, weights);
+    int64_t mi = m*(7+varDim*derivDim);
     real type = obsVector[mi+5];
     if (type <= 1) continue;
 
@@ -1658,39 +2388,21 @@ void CostFunction3D::obAdjustments() {
     real rhoprime = 0.;
     real qvprime = 0.;
 
-    int ii = (int)((i - iMin)*DIrecip);
-    int jj = (int)((j - jMin)*DJrecip);
-    int kk = (int)((k - kMin)*DKrecip);
-    real ibasis = 0.;
-    real jbasis = 0.;
-    real kbasis = 0.;
-    for (int iiNode = (ii-1); iiNode <= (ii+2); ++iiNode) {
-      int iNode = iiNode;
-      if ((iNode < 0) or (iNode >= iDim)) continue;
-      for (int jjNode = (jj-1); jjNode <= (jj+2); ++jjNode) {
-	int jNode = jjNode;
-	if ((jNode < 0) or (jNode >= jDim)) continue;
-	for (int kkNode = (kk-1); kkNode <= (kk+2); ++kkNode) {
-	  int kNode = kkNode;
-	  if ((kNode < 0) or (kNode >= kDim)) continue;
-//       int64_t *bIndex = (int64_t *)malloc(sizeof(int64_t));
-//       int bIndex = INDEX(iNode, jNode, kNode, iDim, jDim, varDim, 4);
-//      int64_t *bIndex = (int64_t *)malloc(sizeof(int64_t));
-//      int64_t *bIndex2 = (int64_t *)malloc(sizeof(int64_t));
-//      *bIndex = varDim * iDim * jDim * kNode + varDim * iDim * jNode + varDim * iNode + 4;
-//      *bIndex2 = varDim * iDim * jDim * kNode + varDim * iDim * jNode + varDim * iNode + 5;
-      // turn off print out January 24, 2023
-      // cout << "bIndex = " << *bIndex << endl;
-	  ibasis = Basis(iNode, i, iDim-1, iMin, DI, DIrecip, 0, iBCL[4], iBCR[4]);
-	  jbasis = Basis(jNode, j, jDim-1, jMin, DJ, DJrecip, 0, jBCL[4], jBCR[4]);
-	  kbasis = Basis(kNode, k, kDim-1, kMin, DK, DKrecip, 0, kBCL[4], kBCR[4]);
-	  // qvprime += bgState[*bIndex] * ibasis * jbasis * kbasis;
-	  qvprime += bgState[INDEX(iNode, jNode, kNode, iDim, jDim, varDim, 4)] * ibasis * jbasis * kbasis;
-	  ibasis = Basis(iNode, i, iDim-1, iMin, DI, DIrecip, 0, iBCL[5], iBCR[5]);
-	  jbasis = Basis(jNode, j, jDim-1, jMin, DJ, DJrecip, 0, jBCL[5], jBCR[5]);
-	  kbasis = Basis(kNode, k, kDim-1, kMin, DK, DKrecip, 0, kBCL[5], kBCR[5]);
-//	  rhoprime += bgState[*bIndex2] * ibasis * jbasis * kbasis;
-       rhoprime += bgState[INDEX(iNode, jNode, kNode, iDim, jDim, varDim, 5)] * ibasis * jbasis * kbasis;
+    // qv and rhoa share the same basis weights, the boundary conditions are in the coefficients
+    for (int in = 0; in < 4; in++) {
+      real ibasis = BWEIGHT(weights, 0, 0, in, o);
+      if (!ibasis) continue;
+      int iNode = base[o] + in;
+      for (int jn = 0; jn < 4; jn++) {
+	real jbasis = BWEIGHT(weights, 1, 0, jn, o);
+	if (!jbasis) continue;
+	int jNode = base[OBS_BLOCK + o] + jn;
+	for (int kn = 0; kn < 4; kn++) {
+	  real kbasis = BWEIGHT(weights, 2, 0, kn, o);
+	  if (!kbasis) continue;
+	  int kNode = base[2*OBS_BLOCK + o] + kn;
+	  qvprime += bgState[SINDEX(iNode, jNode, kNode, 4)] * ibasis * jbasis * kbasis;
+	  rhoprime += bgState[SINDEX(iNode, jNode, kNode, 5)] * ibasis * jbasis * kbasis;
 	}
       }
     }
@@ -1719,9 +2431,52 @@ void CostFunction3D::obAdjustments() {
      obsData[m]=obsVector[m*(7+varDim*derivDim)+1];
   }
   #pragma acc enter data copyin(obsData)
+  #pragma acc enter data create(obsScaled[:mObs]) if(HprescaleObs)
   GPTLstop("CostFunction3D::obAdjustments");
 }
 
+// Spread the lower 21 bits of x so there are two zero bits between each bit
+static inline uint64_t spreadBits(uint64_t x)
+{
+  x &= 0x1fffff;
+  x = (x | (x << 32)) & 0x1f00000000ffffULL;
+  x = (x | (x << 16)) & 0x1f0000ff0000ffULL;
+  x = (x | (x << 8)) & 0x100f00f00f00f00fULL;
+  x = (x | (x << 4)) & 0x10c30c30c30c30c3ULL;
+  x = (x | (x << 2)) & 0x1249249249249249ULL;
+  return x;
+}
+
+void CostFunction3D::sortObservations()
+{
+  GPTLstart("CostFunction3D::sortObservations");
+
+  // Morton key of the grid cell containing each ob
+  std::vector<std::pair<uint64_t, integer> > keys(mObs);
+  #pragma omp parallel for
+  for (int64_t m = 0; m < mObs; m++) {
+    int64_t mi = m*(7+varDim*derivDim);
+    uint64_t ii = (uint64_t)max(0, (int)((rawObs[mi+2] - iMin)*DIrecip));
+    uint64_t jj = (uint64_t)max(0, (int)((rawObs[mi+3] - jMin)*DJrecip));
+    uint64_t kk = (uint64_t)max(0, (int)((rawObs[mi+4] - kMin)*DKrecip));
+    keys[m] = std::make_pair(spreadBits(ii) | (spreadBits(jj) << 1) | (spreadBits(kk) << 2), (integer)m);
+  }
+  // Ties are broken by the input index so the order is reproducible
+  std::sort(keys.begin(), keys.end());
+
+  // initialize may run again on the same object, so reuse the arrays of an earlier sort
+  if (obsOrder == NULL) obsOrder = new integer[mObs];
+  if (obsRank == NULL) obsRank = new integer[mObs];
+  #pragma omp parallel for
+  for (int64_t m = 0; m < mObs; m++) {
+    obsOrder[m] = keys[m].second;
+    obsRank[keys[m].second] = m;
+  }
+  cout << "Sorted " << mObs << " observations along a Morton curve\n";
+
+  GPTLstop("CostFunction3D::sortObservations");
+}
+
 void CostFunction3D::fillBasisLookup()
 {
 
@@ -1744,6 +2499,86 @@ void CostFunction3D::fillBasisLookup()
 
 }
 
+real* CostFunction3D::fillBasisTable(const int& Dim, const real& xMin, const real& DX, const real& DXrecip,
+				     const int* BCL, const int* BCR)
+{
+  real gausspoint = 0.5*sqrt(1./3.);
+  real* table = new real[(int64_t)Dim*4*varDim*4*2];
+
+  for (int index = 0; index < Dim; index++) {
+    for (int point = 0; point < 4; point++) {
+      // The coordinate is calculated as in the transforms, so the base node and the values are identical
+      int half = (point > 0);
+      int mu = point - 2*half;
+      real x = xMin + DX * (index + (gausspoint * mu + 0.5 * half));
+      int xx = (int)((x - xMin)*DXrecip);
+      for (int var = 0; var < varDim; var++) {
+	for (int n = 0; n < 4; n++) {
+	  int node = xx - 1 + n;
+	  bool valid = (node >= 0) and (node < Dim) and ((half == 0) or (index < Dim-1));
+	  for (int d = 0; d < 2; d++) {
+	    table[(((int64_t)(index*4 + point)*varDim + var)*4 + n)*2 + d] =
+	      valid ? Basis(node, x, Dim-1, xMin, DX, DXrecip, d, BCL[var], BCR[var]) : 0;
+	  }
+	}
+      }
+    }
+  }
+  return table;
+}
+
+void CostFunction3D::basisWeights(const real* x, const int& count, const int& Dim, const real& xMin,
+				  const real& DX, const real& DXrecip, const int& stride,
+				  int* base, real* value, real* slope)
+{
+  // Straight-line version of Basis for the 4 nodes around each point, with the same
+  // arithmetic so the weights are identical. As in Basis, the boundary conditions are
+  // applied through the spline coefficients rather than the weights
+  real ONESIXTH = 1./6.; real FOURSIXTH = 4./6.;
+  for (int o = 0; o < count; o++) {
+    base[o] = (int)((x[o] - xMin)*DXrecip) - 1;
+  }
+  for (int n = 0; n < 4; n++) {
+    #pragma omp simd
+    for (int o = 0; o < count; o++) {
+      int node = base[o] + n;
+      real xm = xMin + (node * DX);
+      real delta = (x[o] - xm) * DXrecip;
+      real z = fabs(delta);
+      real z2 = 2.0 - z;
+      real z1 = z2 - 1.0;
+      real b = (z2*z2*z2) * ONESIXTH;
+      real db = (z2*z2) * ONESIXTH;
+      if (z1 > 0) {
+	b -= (z1*z1*z1) * FOURSIXTH;
+	db -= (z1*z1) * FOURSIXTH;
+      }
+      db *= ((delta > 0) ? -1.0 : 1.0) * 3.0 * DXrecip;
+      // Nodes outside of the domain get a zero weight so they are skipped
+      bool valid = (z < 2.0) and (node >= 0) and (node < Dim);
+      value[n*stride + o] = valid ? b : 0;
+      slope[n*stride + o] = valid ? db : 0;
+    }
+  }
+}
+
+void CostFunction3D::obsBasisWeights(const int64_t& m0, const int& count, int* base, real* weights)
+{
+  real x[3][OBS_BLOCK];
+  for (int o = 0; o < count; o++) {
+    int64_t mi = (m0 + o)*(7+varDim*derivDim);
+    x[0][o] = obsVector[mi+2];
+    x[1][o] = obsVector[mi+3];
+    x[2][o] = obsVector[mi+4];
+  }
+  basisWeights(x[0], count, iDim, iMin, DI, DIrecip, OBS_BLOCK, base,
+	       &BWEIGHT(weights, 0, 0, 0, 0), &BWEIGHT(weights, 0, 1, 0, 0));
+  basisWeights(x[1], count, jDim, jMin, DJ, DJrecip, OBS_BLOCK, base + OBS_BLOCK,
+	       &BWEIGHT(weights, 1, 0, 0, 0), &BWEIGHT(weights, 1, 1, 0, 0));
+  basisWeights(x[2], count, kDim, kMin, DK, DKrecip, OBS_BLOCK, base + 2*OBS_BLOCK,
+	       &BWEIGHT(weights, 2, 0, 0, 0), &BWEIGHT(weights, 2, 1, 0, 0));
+}
+
 real CostFunction3D::Basis(const int& m, const real& x, const int& M,const real& xmin,
 			   const real& DX, const real& DXrecip, const int& derivative,
 			   const int& BL, const int& BR, const real& lambda)
@@ -2153,9 +2988,88 @@ void CostFunction3D::adjustInternalDomain(int increment)
 
 }
 
+void CostFunction3D::setStateLayout()
+{
+  // The interleaved layout keeps the variables of a node together. The variable-major layout
+  // stores each variable as its own grid, so that the i pencils used by the transforms are contiguous
+  stateVarMajor = isEqual("state_layout", "variable");
+  if (stateVarMajor) {
+    iStride = 1;
+    jStride = iDim;
+    kStride = (int64_t)iDim*jDim;
+    varStride = (int64_t)iDim*jDim*kDim;
+    cout << "Using variable-major state layout\n";
+  } else {
+    varStride = 1;
+    iStride = varDim;
+    jStride = varDim*iDim;
+    kStride = varDim*iDim*jDim;
+  }
+  #pragma acc update device(iStride,jStride,kStride,varStride)
+}
+
+void CostFunction3D::interleaveState(const real* state, real* interleaved)
+{
+  #pragma omp parallel for collapse(2)
+  for (int kIndex = 0; kIndex < kDim; kIndex++) {
+    for (int jIndex = 0; jIndex < jDim; jIndex++) {
+      for (int iIndex = 0; iIndex < iDim; iIndex++) {
+	for (int var = 0; var < varDim; var++) {
+	  interleaved[INDEX(iIndex, jIndex, kIndex, iDim, jDim, varDim, var)] = state[SINDEX(iIndex, jIndex, kIndex, var)];
+	}
+      }
+    }
+  }
+}
+
+void CostFunction3D::deinterleaveState(const real* interleaved, real* state)
+{
+  #pragma omp parallel for collapse(2)
+  for (int kIndex = 0; kIndex < kDim; kIndex++) {
+    for (int jIndex = 0; jIndex < jDim; jIndex++) {
+      for (int iIndex = 0; iIndex < iDim; iIndex++) {
+	for (int var = 0; var < varDim; var++) {
+	  state[SINDEX(iIndex, jIndex, kIndex, var)] = interleaved[INDEX(iIndex, jIndex, kIndex, iDim, jDim, varDim, var)];
+	}
+      }
+    }
+  }
+}
+
+real* CostFunction3D::interleavedState(real* state)
+{
+  // Output always uses the interleaved layout, so only the variable-major state needs a copy
+  if (!stateVarMajor) return state;
+  if (ioState == NULL) ioState = new real[nState];
+  interleaveState(state, ioState);
+  return ioState;
+}
+
+// The spline coefficients of an axis only depend on the grid, the cutoff and the boundary
+// conditions, which rarely change between outer iterations or between the cost functions of
+// a run. They are kept for the life of the process, keyed by
+// (Dim, eq, BCL, BCR, xMin, DX, LDim). When the cache would grow past splineCacheLimit bytes,
+// the least recently used coefficients are dropped first
+struct SplineCoefficients {
+  std::vector<real> L, gamma;
+  std::vector<int> gammaRow, gammaCol, gammaIndex;
+  uint64_t lastUse;
+  size_t bytes() const {
+    return sizeof(real)*(L.size() + gamma.size())
+      + sizeof(int)*(gammaRow.size() + gammaCol.size() + gammaIndex.size());
+  }
+};
+typedef std::tuple<int, real, int, int, real, real, int> SplineKey;
+static std::map<SplineKey, SplineCoefficients> splineCache;
+static std::mutex splineCacheMutex;
+static uint64_t splineCacheClock = 0;
+static size_t splineCacheBytes = 0;
+static const size_t splineCacheLimit = (size_t)256 << 20;
+
 void CostFunction3D::calcSplineCoefficients(const int& Dim, const real& eq, const int* BCL, const int* BCR,
                                             const real& xMin, const real& DX, const real& DXrecip, const int& LDim,
-                                            real* L[7], real* gamma[7])
+                                            real* L[7], real* gamma[7], int* gammaRow[7], int* gammaCol[7],
+                                            int* gammaIndex[7])
 {
 
   for (int var = 0; var < varDim; var++) {
@@ -2165,68 +3079,76 @@ void CostFunction3D::calcSplineCoefficients(const int& Dim, const real& eq, cons
 
     // Subtract one for the periodic case rank mismatch
     if (BCL[var] == PERIODIC) mDim--;
-    for (int i = 0; i < mDim*LDim; i++) {
-      L[var][i] = 0;
-    }
 
-    // Allocate memory and initialize matrices
-    real** P = new real*[mDim];
-    real* p = new real[mDim];
-    for (int i = 0; i < mDim; i++) {
-      P[i] = new real[mDim];
-      p[i] = 0.;
+    SplineKey key(Dim, eq, BCL[var], BCR[var], xMin, DX, LDim);
+    {
+      std::lock_guard<std::mutex> lock(splineCacheMutex);
+      std::map<SplineKey, SplineCoefficients>::iterator cached = splineCache.find(key);
+      if (cached != splineCache.end()) {
+	SplineCoefficients& c = cached->second;
+	c.lastUse = ++splineCacheClock;
+	std::copy(c.L.begin(), c.L.end(), L[var]);
+	std::copy(c.gamma.begin(), c.gamma.end(), gamma[var]);
+	std::copy(c.gammaRow.begin(), c.gammaRow.end(), gammaRow[var]);
+	std::copy(c.gammaCol.begin(), c.gammaCol.end(), gammaCol[var]);
+	std::copy(c.gammaIndex.begin(), c.gammaIndex.end(), gammaIndex[var]);
+	continue;
+      }
     }
 
-    real** PP = new real*[pDim];
-    real** tmp = new real*[pDim];
-    real** G = new real*[mDim];
-    real** GT = new real*[pDim];
-    for (int i = 0; i < pDim; i++) {
-      PP[i] = new real[pDim];
-      tmp[i] = new real[mDim];
-      GT[i] = new real[mDim];
-      for (int j = 0; j < mDim; j++) {
-	tmp[i][j] = 0;
-	GT[i][j] = 0;
-      }
-      for (int j = 0; j < pDim; j++) {
-	PP[i][j] = 0;
-      }
+    for (int i = 0; i < mDim*LDim; i++) {
+      L[var][i] = 0;
     }
 
-    for (int i = 0; i < mDim; i++) {
-      G[i] = new real[pDim];
-      for (int j = 0; j < mDim; j++) {
-	P[i][j] = 0;
-      }
-      for (int j = 0; j < pDim; j++) {
-	G[i][j] = 0;
+    // gamma maps the pDim nodes to the mDim free coefficients. It is the identity shifted by the
+    // left rank plus a few boundary condition entries, so it is kept as (column, value) pairs per
+    // row, in increasing column order. A row has the identity entry and up to two entries from
+    // each boundary, which all land on the same row when the axis is short
+    const int maxEntries = gammaEntries;
+    int* Gcount = new int[mDim];
+    int* Gcol = new int[mDim*maxEntries];
+    real* Gval = new real[mDim*maxEntries];
+    for (int i = 0; i < mDim; i++) Gcount[i] = 0;
+    // Set or overwrite one entry of gamma
+    auto setG = [&](int i, int j, real value) {
+      assert((i >= 0) and (i < mDim));
+      int n = 0;
+      while ((n < Gcount[i]) and (Gcol[i*maxEntries+n] < j)) n++;
+      if ((n == Gcount[i]) or (Gcol[i*maxEntries+n] != j)) {
+	assert(Gcount[i] < maxEntries);
+	for (int e = Gcount[i]; e > n; e--) {
+	  Gcol[i*maxEntries+e] = Gcol[i*maxEntries+e-1];
+	  Gval[i*maxEntries+e] = Gval[i*maxEntries+e-1];
+	}
+	Gcount[i]++;
       }
-    }
+      Gcol[i*maxEntries+n] = j;
+      Gval[i*maxEntries+n] = value;
+    };
 
     // Set boundary conditions
     switch (BCL[var]) {
       /* case R0: no BC enforced */
     case R1T0:
-      G[0][0] = -4.0;
-      G[1][0] = -1.0;
+      setG(0, 0, -4.0);
+      setG(1, 0, -1.0);
       break;
     case R1T1:
-      G[1][0] =  1.0;
+      setG(1, 0, 1.0);
       break;
     case R1T2:
-      G[0][0] =  2.0;
-      G[1][0] = -1.0;
+      setG(0, 0, 2.0);
+      setG(1, 0, -1.0);
       break;
     case R2T10:
-      G[0][0] =  1.0;
-      G[0][1] = -0.5;
+      setG(0, 0, 1.0);
+      setG(0, 1, -0.5);
       break;
     case R2T20:
-      G[0][0] = -1.0;
+      setG(0, 0, -1.0);
       break;
     case PERIODIC:
-      G[mDim-1][0] = 1;
+      setG(mDim-1, 0, 1);
       break;
     default:
       break;
@@ -2234,129 +3156,124 @@ void CostFunction3D::calcSplineCoefficients(const int& Dim, const real& eq, cons
     switch (BCR[var]) {
       /* case R0: no BC enforced */
     case R1T0:
-      G[mDim-1][pDim-1] = -4.0;
-      G[mDim-2][pDim-1] = -1.0;
+      setG(mDim-1, pDim-1, -4.0);
+      setG(mDim-2, pDim-1, -1.0);
       break;
     case R1T1:
-      G[mDim-2][pDim-1] =  1.0;
+      setG(mDim-2, pDim-1, 1.0);
       break;
     case R1T2:
-      G[mDim-1][pDim-1] =  2.0;
-      G[mDim-2][pDim-1] = -1.0;
+      setG(mDim-1, pDim-1, 2.0);
+      setG(mDim-2, pDim-1, -1.0);
       break;
     case R2T10:
-      G[mDim-1][pDim-1] =  1.0;
-      G[mDim-1][pDim-2] = -0.5;
+      setG(mDim-1, pDim-1, 1.0);
+      setG(mDim-1, pDim-2, -0.5);
       break;
     case R2T20:
-      G[mDim-1][pDim-1] = -1.0;
+      setG(mDim-1, pDim-1, -1.0);
       break;
     case PERIODIC:
-      G[0][pDim-2] = 1;
-      G[1][pDim-1] = 1;
+      setG(0, pDim-2, 1);
+      setG(1, pDim-1, 1);
       break;
     default:
       break;
     }
 
     for (int i = 0; i < mDim; i++) {
-      G[i][i+rankHash[BCL[var]]] = 1;
+      setG(i, i+rankHash[BCL[var]], 1);
+    }
+
+    // The nonzeros of gamma for SA by row, then the same entries by column in increasing row
+    // order, so both products sum in the order of the dense rows and columns
+    int entries = 0;
+    for (int i = 0; i < mDim; i++) {
+      gammaRow[var][2*i] = entries;
+      for (int n = 0; n < Gcount[i]; n++) {
+	if (Gval[i*maxEntries+n] == 0) continue;
+	gamma[var][entries] = Gval[i*maxEntries+n];
+	gammaIndex[var][entries] = Gcol[i*maxEntries+n];
+	entries++;
+      }
+      gammaRow[var][2*i+1] = entries;
+    }
+    const int rowEntries = entries;
+    for (int j = 0; j < pDim; j++) {
+      gammaCol[var][2*j+1] = 0;
+    }
+    for (int e = 0; e < rowEntries; e++) {
+      gammaCol[var][2*gammaIndex[var][e]+1]++;
+    }
+    for (int j = 0; j < pDim; j++) {
+      gammaCol[var][2*j] = entries;
+      entries += gammaCol[var][2*j+1];
+      gammaCol[var][2*j+1] = gammaCol[var][2*j];
     }
     for (int i = 0; i < mDim; i++) {
-      for (int j = 0; j < pDim; j++) {
-	GT[j][i] = G[i][j];
-	gamma[var][Dim*i + j] = G[i][j];
-	//std::cout << G[i][j] << " ";
-      } //std::cout << "\n";
-    } //std::cout << "\n";
-
-    /* for (int i = 0; i < mDim; i++) {
-       for (int j = 0; j < Dim; j++) {
-       std::cout << gamma[var][Dim*i + j] << " ";
-       } std::cout << "\n";
-       } std::cout << "\n"; */
-
-    /* for (int i = 0; i < pDim; i++) {
-       for (int j = 0; j < mDim; j++) {
-       //std::cout << GT[i][j] << " ";
-       //std::cout << gamma[var][pDim*j + i] << " ";
-       } //std::cout << "\n";
-       } //std::cout << "\n"; */
+      for (int e = gammaRow[var][2*i]; e < gammaRow[var][2*i+1]; e++) {
+	int t = gammaCol[var][2*gammaIndex[var][e]+1]++;
+	gamma[var][t] = gamma[var][e];
+	gammaIndex[var][t] = i;
+      }
+    }
 
+    // Penalized normal equations of the cubic B-splines, which couple nodes up to 3 apart.
+    // Stored by row as PP[Node][Node+d] at PP[Node*7 + d+3]
+    real* PP = new real[pDim*7];
+    for (int i = 0; i < pDim*7; i++) {
+      PP[i] = 0;
+    }
     for (int Index = min(rankHash[BCL[var]],1); Index < max(pDim-1-rankHash[BCR[var]],pDim-2); Index++) {
-      //for (int Index = 1; Index < pDim-2; Index++) {
       for (int mu = -1; mu <= 1; mu += 2) {
 	real i = pMin + DX * (Index + (0.5*sqrt(1./3.) * mu + 0.5));
 	int ii = (int)((i - pMin)*DXrecip);
 	for (int Node = max(ii-1,0); Node <= min(ii+2,pDim-1); ++Node) {
 	  real pm = Basis(Node, i, mDim-1, pMin, DX, DXrecip, 0, RX, RX);
 	  real qm = Basis(Node, i, mDim-1, pMin, DX, DXrecip, 3, RX, RX);
-	  real pn, qn;
-	  PP[Node][Node] += 0.5 * ((pm * pm) + eq * (qm * qm));
-	  if ((Node+1) < pDim) {
-	    pn = Basis(Node+1, i, mDim-1, pMin, DX, DXrecip, 0, RX, RX);
-	    qn = Basis(Node+1, i, mDim-1, pMin, DX, DXrecip, 3, RX, RX);
-	    PP[Node][Node+1] += 0.5 * ((pm * pn) + eq * (qm * qn));
-	    PP[Node+1][Node] += 0.5 * ((pm * pn) + eq * (qm * qn));
-	  }
-	  if ((Node+2) < pDim) {
-	    pn = Basis(Node+2, i, mDim-1, pMin, DX, DXrecip, 0, RX, RX);
-	    qn = Basis(Node+2, i, mDim-1, pMin, DX, DXrecip, 3, RX, RX);
-	    PP[Node][Node+2] += 0.5 * ((pm * pn) + eq * (qm * qn));
-	    PP[Node+2][Node] += 0.5 * ((pm * pn) + eq * (qm * qn));
-	  }
-	  if ((Node+3) < pDim) {
-	    pn = Basis(Node+3, i, mDim-1, pMin, DX, DXrecip, 0, RX, RX);
-	    qn = Basis(Node+3, i, mDim-1, pMin, DX, DXrecip, 3, RX, RX);
-	    PP[Node][Node+3] += 0.5 * ((pm * pn) + eq * (qm * qn));
-	    PP[Node+3][Node] += 0.5 * ((pm * pn) + eq * (qm * qn));
+	  PP[Node*7 + 3] += 0.5 * ((pm * pm) + eq * (qm * qm));
+	  for (int d = 1; d <= 3; d++) {
+	    if ((Node+d) >= pDim) break;
+	    real pn = Basis(Node+d, i, mDim-1, pMin, DX, DXrecip, 0, RX, RX);
+	    real qn = Basis(Node+d, i, mDim-1, pMin, DX, DXrecip, 3, RX, RX);
+	    PP[Node*7 + 3+d] += 0.5 * ((pm * pn) + eq * (qm * qn));
+	    PP[(Node+d)*7 + 3-d] += 0.5 * ((pm * pn) + eq * (qm * qn));
 	  }
 	}
       }
     }
 
-    /* for (int i = 0; i < pDim; i++) {
-       for (int j = 0; j < pDim; j++) {
-       std::cout << PP[i][j] << " ";
-       } std::cout << std::endl;
-       }
-       std::cout << std::endl; */
-
-    for (int i = 0; i < pDim; i++) {
-      for (int j = 0; j < mDim; j++) {
-	//std::cout << PP[i][j] << " ";
-	for (int k = 0; k < pDim; k++) {
-	  tmp[i][j] += PP[i][k]*GT[k][j]; //PP[i][k]*gamma[var][pDim*j + k]
-	}
-      } //std::cout << std::endl;
-    }
-    //std::cout << std::endl;
+    // P = gamma PP gammaT keeps the bandwidth of PP, except for the periodic wrap around
+    // which fills the factor. Only the lower band of P is stored, as P[i*pBand + (i-j)]
+    int w = ((BCL[var] == PERIODIC) or (BCR[var] == PERIODIC)) ? mDim-1 : min(3, mDim-1);
+    int pBand = w+1;
+    real* P = new real[mDim*pBand];
+    real* p = new real[mDim];
     for (int i = 0; i < mDim; i++) {
-      for (int j = 0; j < mDim; j++) {
-	//std::cout << G[i][j] << " ";
-	//P[i][j] = 0;
-	for (int k = 0; k < pDim; k++) {
-	  P[i][j] += G[i][k]*tmp[k][j]; //gamma[var][pDim*i + k]*tmp[k][j]
+      p[i] = 0.;
+      for (int j = max(i-w,0); j <= i; j++) {
+	// Same products and summation order as the upper entry P[j][i] of the dense G PP GT
+	real sum = 0;
+	for (int a = 0; a < Gcount[j]; a++) {
+	  int k = Gcol[j*maxEntries+a];
+	  real t = 0;
+	  for (int b = 0; b < Gcount[i]; b++) {
+	    int l = Gcol[i*maxEntries+b];
+	    if (abs(k-l) > 3) continue;
+	    t += PP[k*7 + l-k+3]*Gval[i*maxEntries+b];
+	  }
+	  sum += Gval[j*maxEntries+a]*t;
 	}
-	//std::cout << P[i][j] << " ";
-      } //std::cout << std::endl;
+	P[i*pBand + (i-j)] = sum;
+      }
     }
-    //std::cout << std::endl;
-
-
-    /* for (int i = 0; i < mDim; i++) {
-       for (int j = 0; j < mDim; j++) {
-       std::cout << P[i][j] << " ";
-       } std::cout << std::endl;
-       }
-       std::cout << std::endl; */
 
-    // Cholesky decomp of P+Q
+    // Banded Cholesky decomp of P+Q, overwriting the lower band with the factor
     for (int i=0;i<mDim;i++) {
-      for (int j=i;j<mDim;j++) {
-	real sum=P[i][j];
-	for (int k=i-1;k>=0;k--) {
-	  sum -= P[i][k]*P[j][k];
+      for (int j=i;j<=min(i+w,mDim-1);j++) {
+	real sum=P[j*pBand + (j-i)];
+	for (int k=i-1;k>=max(j-w,0);k--) {
+	  sum -= P[i*pBand + (i-k)]*P[j*pBand + (j-k)];
 	}
 	if (i == j) {
 	  if (sum <= 0.0) {
@@ -2367,7 +3284,7 @@ void CostFunction3D::calcSplineCoefficients(const int& Dim, const real& eq, cons
 	    p[i] = sqrt(sum);
 	  }
 	} else {
-	  P[j][i]=sum/p[i];
+	  P[j*pBand + (j-i)]=sum/p[i];
 	  if (p[i] == 0.) {
 	    std::cout << "Problem! " << i << "\t" << j << "\n";
 	    exit(1);
@@ -2379,41 +3296,156 @@ void CostFunction3D::calcSplineCoefficients(const int& Dim, const real& eq, cons
     // Reduced representation of decomposed P+Q
     for (int i = 0; i < mDim; i++) {
       L[var][i*LDim] = p[i];
-      //std::cout << L[var][i*LDim] << " ";
-      for (int n=1;n<LDim;n++) {
+      for (int n=1;n<min(LDim,pBand);n++) {
 	if ((i-n) >= 0) {
-	  L[var][i*LDim+n] = P[i][i-n];
+	  L[var][i*LDim+n] = P[i*pBand + n];
 	}
-	//std::cout << L[var][i*LDim + n] << " ";
-      } //std::cout << endl;
-    } //std::cout << endl;
-
-    // Free memory
-    for (int i = 0; i < pDim; i++) {
-      delete[] PP[i];
-      delete[] tmp[i];
-      delete[] GT[i];
-    }
-    for (int i = 0; i < mDim; i++) {
-      delete[] G[i];
+      }
     }
-    delete[] PP;
-    delete[] tmp;
-    delete[] G;
-    delete[] GT;
 
-    for (int i = 0; i < mDim; i++) {
-      delete[] P[i];
+    {
+      SplineCoefficients c;
+      c.L.assign(L[var], L[var] + mDim*LDim);
+      c.gamma.assign(gamma[var], gamma[var] + entries);
+      c.gammaRow.assign(gammaRow[var], gammaRow[var] + 2*mDim);
+      c.gammaCol.assign(gammaCol[var], gammaCol[var] + 2*Dim);
+      c.gammaIndex.assign(gammaIndex[var], gammaIndex[var] + entries);
+      size_t bytes = c.bytes();
+      std::lock_guard<std::mutex> lock(splineCacheMutex);
+      // Another cost function may have added the same coefficients in the meantime
+      std::map<SplineKey, SplineCoefficients>::iterator old = splineCache.find(key);
+      if (old != splineCache.end()) {
+	splineCacheBytes -= old->second.bytes();
+	splineCache.erase(old);
+      }
+      if (bytes <= splineCacheLimit) {
+	while (splineCacheBytes + bytes > splineCacheLimit) {
+	  std::map<SplineKey, SplineCoefficients>::iterator lru = splineCache.begin();
+	  for (std::map<SplineKey, SplineCoefficients>::iterator it = splineCache.begin(); it != splineCache.end(); ++it) {
+	    if (it->second.lastUse < lru->second.lastUse) lru = it;
+	  }
+	  splineCacheBytes -= lru->second.bytes();
+	  splineCache.erase(lru);
+	}
+	c.lastUse = ++splineCacheClock;
+	splineCacheBytes += bytes;
+	splineCache[key] = std::move(c);
+      }
     }
+
+    // Free memory
+    delete[] Gcount;
+    delete[] Gcol;
+    delete[] Gval;
+    delete[] PP;
     delete[] P;
     delete[] p;
   }
 }
 
+void CostFunction3D::setupFFT()
+{
+  GPTLstart("CostFunction3D::setupFFT");
+
+  bool iFFT = false, jFFT = false, kFFT = false;
+  for (int var = 0; var < varDim; var++) {
+    if ((iBCL[var] == PERIODIC) and (iMaxWavenumber[var] >= 0)) iFFT = true;
+    if ((jBCL[var] == PERIODIC) and (jMaxWavenumber[var] >= 0)) jFFT = true;
+    if ((kBCL[var] == PERIODIC) and (kMaxWavenumber[var] >= 0)) kFFT = true;
+  }
+
+  // FFtransform works on slabs: k pencils for each i, j and i pencils for each k
+  int iHalf = iDim/2+1, jHalf = jDim/2+1, kHalf = kDim/2+1;
+  size_t realSize = max(jDim*kDim, iDim*jDim);
+  size_t complexSize = max(max(jDim*kHalf, jHalf*kDim), max(iDim*jHalf, jDim*iHalf));
+  if (FFTthreads == 0) FFTthreads = maxThreads();
+  FFTin = new double*[FFTthreads];
+  FFTout = new fftw_complex*[FFTthreads];
+  for (int t = 0; t < FFTthreads; t++) {
+    FFTin[t] = (double*) fftw_malloc(sizeof(double) * realSize);
+    FFTout[t] = (fftw_complex*) fftw_malloc(sizeof(fftw_complex) * complexSize);
+  }
+
+  // Saved wisdom lets FFTW skip the measurements on later runs with the same grid
+  std::string wisdomFile = (*configHash)["fftw_wisdom_file"];
+  bool useWisdom = (wisdomFile != "none") and (wisdomFile != "") and (wisdomFile != "0");
+#ifndef USE_CUFFTW
+  if (useWisdom and fftw_import_wisdom_from_filename(wisdomFile.c_str()))
+    cout << "Imported FFTW wisdom from " << wisdomFile << endl;
+#endif
+
+  // One plan per direction for a whole slab of contiguous pencils, executed on each thread's buffers
+  if (iFFT) {
+    iForward = fftw_plan_many_dft_r2c(1, &iDim, jDim, FFTin[0], NULL, 1, iDim,
+				      FFTout[0], NULL, 1, iHalf, FFTW_MEASURE);
+    iBackward = fftw_plan_many_dft_c2r(1, &iDim, jDim, FFTout[0], NULL, 1, iHalf,
+				       FFTin[0], NULL, 1, iDim, FFTW_MEASURE);
+  }
+  if (jFFT) {
+    jForward = fftw_plan_many_dft_r2c(1, &jDim, iDim, FFTin[0], NULL, 1, jDim,
+				      FFTout[0], NULL, 1, jHalf, FFTW_MEASURE);
+    jBackward = fftw_plan_many_dft_c2r(1, &jDim, iDim, FFTout[0], NULL, 1, jHalf,
+				       FFTin[0], NULL, 1, jDim, FFTW_MEASURE);
+  }
+  if (kFFT) {
+    kForward = fftw_plan_many_dft_r2c(1, &kDim, jDim, FFTin[0], NULL, 1, kDim,
+				      FFTout[0], NULL, 1, kHalf, FFTW_MEASURE);
+    kBackward = fftw_plan_many_dft_c2r(1, &kDim, jDim, FFTout[0], NULL, 1, kHalf,
+				       FFTin[0], NULL, 1, kDim, FFTW_MEASURE);
+  }
+  // fusedTransform's tiles and slabs interleave their pencils
+  if (fuseTransforms and iFFT) {
+    iTileForward = fftw_plan_many_dft_r2c(1, &iDim, fusedRows, FFTin[0], NULL, fusedRows, 1,
+					  FFTout[0], NULL, fusedRows, 1, FFTW_MEASURE);
+    iTileBackward = fftw_plan_many_dft_c2r(1, &iDim, fusedRows, FFTout[0], NULL, fusedRows, 1,
+					   FFTin[0], NULL, fusedRows, 1, FFTW_MEASURE);
+  }
+  if (fuseTransforms and jFFT) {
+    jSlabForward = fftw_plan_many_dft_r2c(1, &jDim, kDim, FFTin[0], NULL, kDim, 1,
+					  FFTout[0], NULL, kDim, 1, FFTW_MEASURE);
+    jSlabBackward = fftw_plan_many_dft_c2r(1, &jDim, kDim, FFTout[0], NULL, kDim, 1,
+					   FFTin[0], NULL, kDim, 1, FFTW_MEASURE);
+  }
+
+#ifndef USE_CUFFTW
+  if (useWisdom and !fftw_export_wisdom_to_filename(wisdomFile.c_str()))
+    cout << "Unable to write FFTW wisdom to " << wisdomFile << endl;
+#endif
+  FFTplanned = true;
+
+  GPTLstop("CostFunction3D::setupFFT");
+}
+
+// Per-thread scratch of fusedTransform, allocated once with as many buffers as the FFT.
+// The tiles of the filter and i passes are sized to stay in the L2 cache
+void CostFunction3D::setupFusedScratch()
+{
+  if (FFTthreads == 0) FFTthreads = maxThreads();
+  long cacheBytes = 0;
+#ifdef _SC_LEVEL2_CACHE_SIZE
+  cacheBytes = sysconf(_SC_LEVEL2_CACHE_SIZE);
+#endif
+  if (cacheBytes <= 0) cacheBytes = 1 << 20;
+  const int64_t cacheReals = cacheBytes / sizeof(real);
+  // A filter tile and its scratch hold 2*jDim*kDim values per i pencil, and an i tile, its
+  // filter and spline scratch and the FFT buffers about 4*iDim per j row
+  fusedPencils = (int)max((int64_t)1, min((int64_t)RecursiveFilter::pencilBatch, cacheReals/(2*(int64_t)jDim*kDim)));
+  fusedRows = (int)max((int64_t)1, min((int64_t)jDim, cacheReals/(4*(int64_t)iDim)));
+  cout << "Fused transform tiles: " << fusedPencils << " i pencils for the filters, "
+       << fusedRows << " j rows for the i transforms\n";
+  // The filter tile and its scratch, the i tile with its filter and spline scratch, or a
+  // slab of k pencils with its spline scratch
+  size_t scratchSize = max(2*(size_t)jDim*kDim*fusedPencils, 3*(size_t)iDim*fusedRows + fusedRows);
+  scratchSize = max(scratchSize, 2*(size_t)jDim*kDim + kDim);
+  fusedScratch = new real*[FFTthreads];
+  for (int t = 0; t < FFTthreads; t++) {
+    fusedScratch[t] = new real[scratchSize];
+  }
+}
+
 void CostFunction3D::FFtransform(const real* Astate, real* Cstate)
 {
-  int iIndex,jIndex,kIndex;
-  int n,ierr;
+  int n;
   GPTLstart("CostFunction3D::FFtransform");
 #pragma acc data present(Astate[0:nState],Cstate[0:nState])
 {
@@ -2428,65 +3460,86 @@ void CostFunction3D::FFtransform(const real* Astate, real* Cstate)
   if(UseFFT) {
     // This should only be done if FFTW needs to be performed
     #pragma acc update self(Cstate[0:nState])
+    int iHalf = iDim/2+1, jHalf = jDim/2+1, kHalf = kDim/2+1;
     for (int var = 0; var < varDim; var++) {
-      // Enforce max wavenumber
+      // Enforce max wavenumber on the k pencils of each i slab
       if ((kBCL[var] == PERIODIC) and (kMaxWavenumber[var] >= 0)) {
-        for (iIndex = 0; iIndex < iDim; iIndex++) {
-          for (jIndex = 0; jIndex < jDim; jIndex++) {
-            for (kIndex = 0; kIndex < kDim; kIndex++) {
-              kFFTin[kIndex] = Cstate[INDEX(iIndex, jIndex, kIndex, iDim, jDim, varDim, var)];
+        #pragma omp parallel for num_threads(FFTthreads)
+        for (int iIndex = 0; iIndex < iDim; iIndex++) {
+          double* in = FFTin[fftThread()];
+          fftw_complex* out = FFTout[fftThread()];
+          for (int jIndex = 0; jIndex < jDim; jIndex++) {
+            for (int kIndex = 0; kIndex < kDim; kIndex++) {
+              in[jIndex*kDim + kIndex] = Cstate[SINDEX(iIndex, jIndex, kIndex, var)];
             }
-            fftw_execute(kForward);
-            for (kIndex = kMaxWavenumber[var]+1; kIndex < (kDim/2)+1; kIndex++) {
-              kFFTout[kIndex][0] = 0.0;
-              kFFTout[kIndex][1] = 0.0;
+          }
+          fftw_execute_dft_r2c(kForward, in, out);
+          for (int jIndex = 0; jIndex < jDim; jIndex++) {
+            for (int kIndex = kMaxWavenumber[var]+1; kIndex < kHalf; kIndex++) {
+              out[jIndex*kHalf + kIndex][0] = 0.0;
+              out[jIndex*kHalf + kIndex][1] = 0.0;
             }
-            fftw_execute(kBackward);
-            for (kIndex = 0; kIndex < kDim; kIndex++) {
-              Cstate[INDEX(iIndex, jIndex, kIndex, iDim, jDim, varDim, var)] = kFFTin[kIndex]/kDim;
+          }
+          fftw_execute_dft_c2r(kBackward, out, in);
+          for (int jIndex = 0; jIndex < jDim; jIndex++) {
+            for (int kIndex = 0; kIndex < kDim; kIndex++) {
+              Cstate[SINDEX(iIndex, jIndex, kIndex, var)] = in[jIndex*kDim + kIndex]/kDim;
             }
           }
         }
       }
 
-      // Enforce max wavenumber
+      // Enforce max wavenumber on the j pencils of each k slab
       if ((jBCL[var] == PERIODIC) and (jMaxWavenumber[var] >= 0)) {
-        //cout << "FFT perform on J-pencil\n";
-        for (kIndex = 0; kIndex < kDim; kIndex++) {
-	  for (iIndex = 0; iIndex < iDim; iIndex++) {
-            for (jIndex = 0; jIndex < jDim; jIndex++) {
-              jFFTin[jIndex] = Cstate[INDEX(iIndex, jIndex, kIndex, iDim, jDim, varDim, var)];
+        #pragma omp parallel for num_threads(FFTthreads)
+        for (int kIndex = 0; kIndex < kDim; kIndex++) {
+          double* in = FFTin[fftThread()];
+          fftw_complex* out = FFTout[fftThread()];
+          for (int jIndex = 0; jIndex < jDim; jIndex++) {
+            for (int iIndex = 0; iIndex < iDim; iIndex++) {
+              in[iIndex*jDim + jIndex] = Cstate[SINDEX(iIndex, jIndex, kIndex, var)];
             }
-            fftw_execute(jForward);
-            for (jIndex = jMaxWavenumber[var]+1; jIndex < (jDim/2)+1; jIndex++) {
-              jFFTout[jIndex][0] = 0.0;
-              jFFTout[jIndex][1] = 0.0;
+          }
+          fftw_execute_dft_r2c(jForward, in, out);
+          for (int iIndex = 0; iIndex < iDim; iIndex++) {
+            for (int jIndex = jMaxWavenumber[var]+1; jIndex < jHalf; jIndex++) {
+              out[iIndex*jHalf + jIndex][0] = 0.0;
+              out[iIndex*jHalf + jIndex][1] = 0.0;
             }
-            fftw_execute(jBackward);
-            for (jIndex = 0; jIndex < jDim; jIndex++) {
-              Cstate[INDEX(iIndex, jIndex, kIndex, iDim, jDim, varDim, var)] = jFFTin[jIndex]/jDim;
+          }
+          fftw_execute_dft_c2r(jBackward, out, in);
+          for (int jIndex = 0; jIndex < jDim; jIndex++) {
+            for (int iIndex = 0; iIndex < iDim; iIndex++) {
+              Cstate[SINDEX(iIndex, jIndex, kIndex, var)] = in[iIndex*jDim + jIndex]/jDim;
             }
-	  }
+          }
         }
       }
 
-      // Enforce max wavenumber
+      // Enforce max wavenumber on the i pencils of each k slab
       if ((iBCL[var] == PERIODIC) and (iMaxWavenumber[var] >= 0)) {
+        #pragma omp parallel for num_threads(FFTthreads)
         for (int kIndex = 0; kIndex < kDim; kIndex++) {
-	  for (int jIndex = 0; jIndex < jDim; jIndex++) {
-	    for (int iIndex = 0; iIndex < iDim; iIndex++) {
-	      iFFTin[iIndex] = Cstate[INDEX(iIndex, jIndex, kIndex, iDim, jDim, varDim, var)];
-	    }
-	    fftw_execute(iForward);
-	    for (int iIndex = iMaxWavenumber[var]+1; iIndex < (iDim/2)+1; iIndex++) {
-	      iFFTout[iIndex][0] = 0.0;
-	      iFFTout[iIndex][1] = 0.0;
-	    }
-	    fftw_execute(iBackward);
-	    for (int iIndex = 0; iIndex < iDim; iIndex++) {
-	      Cstate[INDEX(iIndex, jIndex, kIndex, iDim, jDim, varDim, var)] = iFFTin[iIndex]/iDim;
-	    }
-	  }
+          double* in = FFTin[fftThread()];
+          fftw_complex* out = FFTout[fftThread()];
+          for (int jIndex = 0; jIndex < jDim; jIndex++) {
+            for (int iIndex = 0; iIndex < iDim; iIndex++) {
+              in[jIndex*iDim + iIndex] = Cstate[SINDEX(iIndex, jIndex, kIndex, var)];
+            }
+          }
+          fftw_execute_dft_r2c(iForward, in, out);
+          for (int jIndex = 0; jIndex < jDim; jIndex++) {
+            for (int iIndex = iMaxWavenumber[var]+1; iIndex < iHalf; iIndex++) {
+              out[jIndex*iHalf + iIndex][0] = 0.0;
+              out[jIndex*iHalf + iIndex][1] = 0.0;
+            }
+          }
+          fftw_execute_dft_c2r(iBackward, out, in);
+          for (int jIndex = 0; jIndex < jDim; jIndex++) {
+            for (int iIndex = 0; iIndex < iDim; iIndex++) {
+              Cstate[SINDEX(iIndex, jIndex, kIndex, var)] = in[jIndex*iDim + iIndex]/iDim;
+            }
+          }
         }
       }
     }
@@ -2498,23 +3551,150 @@ void CostFunction3D::FFtransform(const real* Astate, real* Cstate)
 
 void CostFunction3D::calcHmatrix()
 {
-  int n;
-  integer hi,m,mi;
-  real i,j,k;
-  int ii,jj,kk,d,var;
-  integer cIndex,wgt_index;
-  int iNode,jNode,kNode;
-  int iiNode,jjNode,kkNode;
-  int iis,iie,jjs,jje,kks,kke;
+  GPTLstart("CostFunction3D::calcHmatrix");
+
+  // H only depends on the grid, boundary conditions, H options and the observations.
+  // obAdjustments reloads the observations from rawObs on every outer iteration and only
+  // rescales their values, so the locations and weights are unchanged until initialize
+  // loads new ones, which invalidates H
+  std::vector<real> inputs = HmatrixInputs();
+  if (Hvalid and (inputs == Hinputs)) {
+    std::cout << "Reusing H transform matrix from previous iteration\n";
+    GPTLstop("CostFunction3D::calcHmatrix");
+    return;
+  }
+
+  freeHmatrix();
+  if (hOperator == H_MATRIX_FREE) {
+    buildHmatrixFree();
+  } else {
+    buildHmatrix();
+    if (hOperator == H_COMPACT) compactHmatrix();
+    if (hOperator == H_CSC) transposeHvalues();
+  }
+  Hvalid = true;
+  Hinputs = inputs;
+
+  GPTLstop("CostFunction3D::calcHmatrix");
+}
+
+// The settings H was built with, compared exactly between outer iterations
+std::vector<real> CostFunction3D::HmatrixInputs()
+{
+  std::vector<real> inputs = { (real)mObs, (real)iDim, (real)jDim, (real)kDim,
+			       iMin, DI, jMin, DJ, kMin, DK,
+			       (real)basisappx, (real)hOperator, (real)HsinglePrecision };
+  for (int var = 0; var < varDim; var++) {
+    inputs.push_back(iBCL[var]);
+    inputs.push_back(iBCR[var]);
+    inputs.push_back(jBCL[var]);
+    inputs.push_back(jBCR[var]);
+    inputs.push_back(kBCL[var]);
+    inputs.push_back(kBCR[var]);
+  }
+  return inputs;
+}
+
+void CostFunction3D::freeHmatrix()
+{
+  if (!Hvalid) return;
+
+  if (hOperator == H_MATRIX_FREE) {
+    #pragma acc exit data delete(Hnode,Hbasis,Hterm,HtermBasis,HtermVar,HtermWeight,HbinPtr,HbinObs)
+    delete[] Hnode;
+    delete[] Hbasis;
+    delete[] Hterm;
+    delete[] HtermBasis;
+    delete[] HtermVar;
+    delete[] HtermWeight;
+    delete[] HbinPtr;
+    delete[] HbinObs;
+    Hnode = NULL;
+    Hbasis = NULL;
+    Hterm = NULL;
+    HtermBasis = NULL;
+    HtermVar = NULL;
+    HtermWeight = NULL;
+    HbinPtr = NULL;
+    HbinObs = NULL;
+  } else if (Hcompact) {
+    #pragma acc exit data delete(mPtr32,mVal32,I2H32)
+    delete[] mPtr32;
+    delete[] mVal32;
+    delete[] I2H32;
+    #pragma acc exit data delete(H,Hsingle,JH32,IH32)
+    delete[] H;
+    delete[] Hsingle;
+    delete[] JH32;
+    delete[] IH32;
+    H = NULL;
+    Hsingle = NULL;
+    IH32 = NULL;
+    JH32 = NULL;
+    I2H32 = NULL;
+    mPtr32 = NULL;
+    mVal32 = NULL;
+  } else {
+    #pragma acc exit data delete(mPtr,mVal,I2H,HT)
+    delete[] mPtr;
+    delete[] mVal;
+    delete[] I2H;
+    delete[] HT;
+    #pragma acc exit data delete(H,JH,IH)
+    delete[] H;
+    delete[] JH;
+    delete[] IH;
+    HT = NULL;
+    H = NULL;
+    IH = NULL;
+    JH = NULL;
+    I2H = NULL;
+    mPtr = NULL;
+    mVal = NULL;
+  }
+  Hvalid = false;
+  Hcompact = false;
+}
+
+// Exclusive prefix sum of counts[0..n) into offsets[0..n], done in fixed blocks so the
+// work is parallel but the result does not depend on the number of threads
+template <typename T>
+static void exclusiveScan(const T* counts, integer* offsets, const int64_t& n)
+{
+  const int64_t nblocks = 1024;
+  const int64_t blockSize = (n + nblocks - 1) / nblocks;
+  integer blockSum[nblocks+1];
+
+  #pragma omp parallel for
+  for (int64_t b = 0; b < nblocks; b++) {
+    integer sum = 0;
+    int64_t end = min(n, (b+1)*blockSize);
+    for (int64_t i = b*blockSize; i < end; i++) sum += counts[i];
+    blockSum[b+1] = sum;
+  }
+  blockSum[0] = 0;
+  for (int64_t b = 1; b <= nblocks; b++) blockSum[b] += blockSum[b-1];
+
+  #pragma omp parallel for
+  for (int64_t b = 0; b < nblocks; b++) {
+    integer sum = blockSum[b];
+    int64_t end = min(n, (b+1)*blockSize);
+    for (int64_t i = b*blockSize; i < end; i++) {
+      offsets[i] = sum;
+      sum += counts[i];
+    }
+  }
+  offsets[n] = blockSum[nblocks];
+}
+
+void CostFunction3D::buildHmatrix()
+{
+  int64_t n;
+  integer hi,cIndex;
   int *Hlength;
   integer *mTmp, *mIncr;
   integer dst;
 
-  real ibasis,jbasis,kbasis;
-  real weight;
-
-  GPTLstart("CostFunction3D::calcHmatrix");
-
   std::cout << "Build H transform matrix...\n";
   std::cout << "calcHmatrix: Grid dimensions: (" << iDim << ", " << jDim << ", " << kDim << ")" << std::endl;
 
@@ -2525,54 +3705,77 @@ void CostFunction3D::calcHmatrix()
   IH   = new integer [mObs+1];
 
   //GPTLstart("CostFunction3D::calcHmatrix:nonzeros");
-  // Determine the number of non-zeros in H
-	//#pragma omp parallel for private(m,mi,hi,i,j,k,ii,iis,iie,jj,jjs,jje,kk,kks,kke,ibasis,jbasis,kbasis,iiNode,jjNode,kkNode,iNode,jNode,kNode,var,d,wgt_index,weight,cIndex) //[8.1]
-  #pragma acc parallel loop vector gang vector_length(32) copyout(Hlength[0:mObs]) private(m,mi,hi,i,j,k,ii,iis,iie,jj,jjs,jje,kk,kks,kke,ibasis,jbasis,kbasis,iiNode,jjNode,kkNode,iNode,jNode,kNode,var,d,wgt_index,weight,cIndex)
-  for (m = 0; m < mObs; m++) {
-    mi = m*(7+varDim*derivDim);
-    i = obsVector[mi+2];
-    j = obsVector[mi+3];
-    k = obsVector[mi+4];
-    ii = (int)((i - iMin)*DIrecip);iis=max(0,ii-1);iie=min(ii+2,iDim-1);
-    jj = (int)((j - jMin)*DJrecip);jjs=max(0,jj-1);jje=min(jj+2,jDim-1);
-    kk = (int)((k - kMin)*DKrecip);kks=max(0,kk-1);kke=min(kk+2,kDim-1);
-    ibasis = 0;
-    jbasis = 0;
-    kbasis = 0;
-    hi = 0;
-    for (var = 0; var < varDim; var++) {
-      for (d = 0; d < derivDim; d++) {
-        wgt_index = mi + (7*(d+1)) + var;
-        if (!obsVector[wgt_index]) continue;
-        for (iiNode=iis;iiNode<=iie;++iiNode) {
-          iNode = iiNode;
-          ibasis = Basis(iNode, i, iDim-1, iMin, DI, DIrecip, derivative[d][0], iBCL[var], iBCR[var]);
-          if (!ibasis) continue;
-          for (jjNode=jjs;jjNode<=jje;++jjNode) {
-	    			jNode = jjNode;
-            jbasis = Basis(jNode, j, jDim-1, jMin, DJ, DJrecip, derivative[d][1], jBCL[var], jBCR[var]);
-            if (!jbasis) continue;
-            for (kkNode=kks;kkNode<=kke;++kkNode) {
-              kNode = kkNode;
-              kbasis = Basis(kNode, k, kDim-1, kMin, DK, DKrecip, derivative[d][2], kBCL[var], kBCR[var]);
-              if (!kbasis) continue;
+#ifdef _OPENACC
+  // Pass 1 on the device: the block buffers of obsBasisWeights are host stack arrays, so
+  // each observation evaluates its own basis values. The nonzeros are the same
+  #pragma acc parallel loop vector gang vector_length(32) copyin(obsVector[0:mObs*(7+varDim*derivDim)]) copyout(Hlength[0:mObs])
+  for (int64_t m = 0; m < mObs; m++) {
+    integer mi = m*(7+varDim*derivDim);
+    real i = obsVector[mi+2];
+    real j = obsVector[mi+3];
+    real k = obsVector[mi+4];
+    int ii = (int)((i - iMin)*DIrecip);
+    int jj = (int)((j - jMin)*DJrecip);
+    int kk = (int)((k - kMin)*DKrecip);
+    int iis = max(0,ii-1), iie = min(ii+2,iDim-1);
+    int jjs = max(0,jj-1), jje = min(jj+2,jDim-1);
+    int kks = max(0,kk-1), kke = min(kk+2,kDim-1);
+    int length = 0;
+    for (int var = 0; var < varDim; var++) {
+      for (int d = 0; d < derivDim; d++) {
+        if (!obsVector[mi + (7*(d+1)) + var]) continue;
+        for (int iNode = iis; iNode <= iie; ++iNode) {
+          if (!Basis(iNode, i, iDim-1, iMin, DI, DIrecip, derivative[d][0], iBCL[var], iBCR[var])) continue;
+          for (int jNode = jjs; jNode <= jje; ++jNode) {
+            if (!Basis(jNode, j, jDim-1, jMin, DJ, DJrecip, derivative[d][1], jBCL[var], jBCR[var])) continue;
+            for (int kNode = kks; kNode <= kke; ++kNode) {
               // Count the number of non-zero entries in the observation matrix...
-              hi++;
+              if (Basis(kNode, k, kDim-1, kMin, DK, DKrecip, derivative[d][2], kBCL[var], kBCR[var])) length++;
             }
           }
         }
       }
     }
-    Hlength[m]=hi;
+    Hlength[m] = length;
   }
-
-  integer nonzeros = 0;
-  for (int m = 0; m < mObs; m++) {
-    nonzeros += Hlength[m];
+#else
+  // Pass 1: determine the number of non-zeros in each row of H. The basis weights of the
+  // observations are evaluated a block at a time by obsBasisWeights
+  #pragma omp parallel for //[8.1]
+  for (int64_t m0 = 0; m0 < mObs; m0 += OBS_BLOCK) {
+    int count = (int)min((int64_t)OBS_BLOCK, mObs - m0);
+    int base[3*OBS_BLOCK];
+    real weights[24*OBS_BLOCK];
+    obsBasisWeights(m0, count, base, weights);
+    for (int o = 0; o < count; o++) {
+      int64_t m = m0 + o;
+      integer mi = m*(7+varDim*derivDim);
+      int length = 0;
+      for (int var = 0; var < varDim; var++) {
+        for (int d = 0; d < derivDim; d++) {
+          if (!obsVector[mi + (7*(d+1)) + var]) continue;
+          for (int in = 0; in < 4; in++) {
+            if (!BWEIGHT(weights, 0, derivative[d][0], in, o)) continue;
+            for (int jn = 0; jn < 4; jn++) {
+              if (!BWEIGHT(weights, 1, derivative[d][1], jn, o)) continue;
+              for (int kn = 0; kn < 4; kn++) {
+                // Count the number of non-zero entries in the observation matrix...
+                if (BWEIGHT(weights, 2, derivative[d][2], kn, o)) length++;
+              }
+            }
+          }
+        }
+      }
+      Hlength[m] = length;
+    }
   }
+#endif
+
+  // Row pointers are the exclusive prefix sum of the row lengths
+  exclusiveScan(Hlength, IH, mObs);
+  integer nonzeros = IH[mObs];
   //GPTLstop("CostFunction3D::calcHmatrix:nonzeros");
 
-  IH[mObs] = nonzeros;
   std::cout << "sizeof(integer): " << sizeof(integer) << "\n";
   std::cout << "Non-zero entries in sparse H matrix: " << nonzeros << " = " << 100.0*float(nonzeros)/(float(mObs)*float(nState)) << " %\n";
   std::cout << "Memory usage for [H]             (Mbytes): " << sizeof(real)*(nonzeros)/(1024.0*1024.0) << "\n";
@@ -2582,43 +3785,38 @@ void CostFunction3D::calcHmatrix()
   mTmp = new integer [nonzeros];
   mIncr = new integer [nState];
 
-  hi=0;
-  for (n=0;n<nState;n++){mIncr[n]=0;}
-
-	//#pragma omp parallel for private(m,mi,i,j,k,ii,iis,iie,jj,jjs,jje,kk,kks,kke,ibasis,jbasis,kbasis,iiNode,jjNode,kkNode,iNode,jNode,kNode,var,d,wgt_index,weight,cIndex) //[8.1]
-	//#pragma acc parallel loop vector gang vector_length(32) private(m,mi,i,j,k,ii,iis,iie,jj,jjs,jje,kk,kks,kke,ibasis,jbasis,kbasis,iiNode,jjNode,kkNode,iNode,jNode,kNode,var,d,wgt_index,weight,cIndex)
-  for (m = 0; m < mObs; m++) {
-    IH[m]=hi;
-    mi = m*(7+varDim*derivDim);
-    i = obsVector[mi+2]; j = obsVector[mi+3]; k = obsVector[mi+4];
-    ii = (int)((i - iMin)*DIrecip);iis=max(0,ii-1);iie=min(ii+2,iDim-1);
-    jj = (int)((j - jMin)*DJrecip);jjs=max(0,jj-1);jje=min(jj+2,jDim-1);
-    kk = (int)((k - kMin)*DKrecip);kks=max(0,kk-1);kke=min(kk+2,kDim-1);
-    ibasis = 0; jbasis = 0; kbasis = 0;
-    for (var = 0; var < varDim; var++) {
-      for (d = 0; d < derivDim; d++) {
-        wgt_index = mi + (7*(d+1)) + var;
-        if (!obsVector[wgt_index]) continue;
-        for (iiNode=iis;iiNode<=iie;++iiNode) {
-          iNode = iiNode;
-          ibasis = Basis(iNode, i, iDim-1, iMin, DI, DIrecip, derivative[d][0], iBCL[var], iBCR[var]);
-          if (!ibasis) continue;
-          for (jjNode=jjs;jjNode<=jje;++jjNode) {
-	    			jNode = jjNode;
-            jbasis = Basis(jNode, j, jDim-1, jMin, DJ, DJrecip, derivative[d][1], jBCL[var], jBCR[var]);
-            if (!jbasis) continue;
-            for (kkNode=kks;kkNode<=kke;++kkNode) {
-              kNode = kkNode;
-              kbasis = Basis(kNode, k, kDim-1, kMin, DK, DKrecip, derivative[d][2], kBCL[var], kBCR[var]);
-              if (!kbasis) continue;
-	  					cIndex = INDEX(iNode, jNode, kNode, iDim, jDim, varDim, var);
-              weight = ibasis * jbasis * kbasis * obsVector[wgt_index];
-              H[hi] = weight;
-              JH[hi] = cIndex;
-              mIncr[cIndex]+=1;
-              // if(cIndex==0) {cout << "cindex==0 m: " << m << "\n";}
-              mTmp[hi]=m;
-              hi++;
+  // Pass 2: each row fills its own disjoint range IH[m]..IH[m+1]
+  #pragma omp parallel for //[8.1]
+  for (int64_t m0 = 0; m0 < mObs; m0 += OBS_BLOCK) {
+    int count = (int)min((int64_t)OBS_BLOCK, mObs - m0);
+    int base[3*OBS_BLOCK];
+    real weights[24*OBS_BLOCK];
+    obsBasisWeights(m0, count, base, weights);
+    for (int o = 0; o < count; o++) {
+      int64_t m = m0 + o;
+      integer hi = IH[m];
+      integer mi = m*(7+varDim*derivDim);
+      for (int var = 0; var < varDim; var++) {
+        for (int d = 0; d < derivDim; d++) {
+          integer wgt_index = mi + (7*(d+1)) + var;
+          if (!obsVector[wgt_index]) continue;
+          for (int in = 0; in < 4; in++) {
+            real ibasis = BWEIGHT(weights, 0, derivative[d][0], in, o);
+            if (!ibasis) continue;
+            int iNode = base[o] + in;
+            for (int jn = 0; jn < 4; jn++) {
+              real jbasis = BWEIGHT(weights, 1, derivative[d][1], jn, o);
+              if (!jbasis) continue;
+              int jNode = base[OBS_BLOCK + o] + jn;
+              for (int kn = 0; kn < 4; kn++) {
+                real kbasis = BWEIGHT(weights, 2, derivative[d][2], kn, o);
+                if (!kbasis) continue;
+                int kNode = base[2*OBS_BLOCK + o] + kn;
+                H[hi] = ibasis * jbasis * kbasis * obsVector[wgt_index];
+                JH[hi] = SINDEX(iNode, jNode, kNode, var);
+                mTmp[hi] = m;
+                hi++;
+              }
             }
           }
         }
@@ -2627,21 +3825,37 @@ void CostFunction3D::calcHmatrix()
   }
   I2H = new integer [nonzeros];
 
-  //for (n=0;n<=8;n++) {cout << " mIncr: " << mIncr[n] << " \n"; }
-  mPtr[0]=0;
-  for (n=1;n<=nState;n++){
-     mPtr[n] = mPtr[n-1]+mIncr[n-1];
-  }
-  //for (n=0;n<=12;n++) {cout << " mPtr: " << mPtr[n] << " \n"; }
-  //cout << "mPtr[nState]: " << mPtr[nState] << " \n";
+  // Transpose by counting sort on the column index: count the entries per column,
+  // scan into mPtr, then scatter each nonzero into its column
+  #pragma omp parallel for
   for (n=0;n<nState;n++){mIncr[n]=0;}
+  #pragma omp parallel for private(cIndex)
   for (hi=0;hi<nonzeros;hi++){
     cIndex = JH[hi];
-    dst = mPtr[cIndex]+mIncr[cIndex];
-    I2H[dst] = hi;
-    mVal[dst] = mTmp[hi];
+    #pragma omp atomic
     mIncr[cIndex]+=1;
   }
+  exclusiveScan(mIncr, mPtr, nState);
+
+  #pragma omp parallel for
+  for (n=0;n<nState;n++){mIncr[n]=0;}
+  #pragma omp parallel for private(cIndex,dst)
+  for (hi=0;hi<nonzeros;hi++){
+    cIndex = JH[hi];
+    #pragma omp atomic capture
+    dst = mIncr[cIndex]++;
+    I2H[mPtr[cIndex]+dst] = hi;
+  }
+
+  // The scatter order within a column depends on the threads, so restore ascending
+  // row order to keep the transpose identical to a serial build
+  #pragma omp parallel for schedule(dynamic,1024)
+  for (n=0;n<nState;n++){
+    std::sort(I2H+mPtr[n], I2H+mPtr[n+1]);
+    for (integer p=mPtr[n];p<mPtr[n+1];p++) {
+      mVal[p] = mTmp[I2H[p]];
+    }
+  }
   //
   // copy H matrix stuff to the GPU Device
   #pragma acc enter data copyin(mPtr,mVal,I2H)
@@ -2657,12 +3871,25 @@ void CostFunction3D::calcHmatrix()
   delete[] mIncr;
   delete[] mTmp;
   //GPTLstop("CostFunction3D::calcHmatrix:deallocate");
-
-  GPTLstop("CostFunction3D::calcHmatrix");
 }
 
 void CostFunction3D::Htransform(const real* Cstate, real* Hstate)
 {
+  if (hOperator == H_MATRIX_FREE) {
+    HtransformMatrixFree(Cstate, Hstate);
+    return;
+  }
+  if (Hcompact) {
+    GPTLstart("CostFunction3D::Htransform");
+    if (Hsingle != NULL) {
+      compactHtransform(mObs, IH32, JH32, Hsingle, Cstate, Hstate);
+    } else {
+      compactHtransform(mObs, IH32, JH32, H, Cstate, Hstate);
+    }
+    GPTLstop("CostFunction3D::Htransform");
+    return;
+  }
+
   integer i,j;
   integer begin,end;
   real tmp;
@@ -2686,6 +3913,607 @@ void CostFunction3D::Htransform(const real* Cstate, real* Hstate)
 	}
 }
 
+void CostFunction3D::transposeHvalues()
+{
+  // Gather the values into the transposed order once, so calcHTranspose reads them contiguously
+  integer nonzeros = IH[mObs];
+  HT = new real[nonzeros];
+  #pragma omp parallel for
+  for (int64_t p = 0; p < (int64_t)nonzeros; p++) HT[p] = H[I2H[p]];
+  #pragma acc exit data delete(I2H)
+  delete[] I2H;
+  I2H = NULL;
+  #pragma acc enter data copyin(HT[:nonzeros])
+  cout << "Memory usage for [HT]            (Mbytes): " << sizeof(real)*(nonzeros)/(1024.0*1024.0) << "\n";
+}
+
+// Replace a 64-bit index array with a 32-bit copy
+static uint32_t* narrowIndex(integer*& src, const int64_t& length)
+{
+  uint32_t* dst = new uint32_t[length];
+  #pragma omp parallel for
+  for (int64_t n = 0; n < length; n++) dst[n] = (uint32_t)src[n];
+  delete[] src;
+  src = NULL;
+  return dst;
+}
+
+void CostFunction3D::compactHmatrix()
+{
+  integer nonzeros = IH[mObs];
+  if (((integer)nState >= UINT32_MAX) or ((integer)mObs >= UINT32_MAX) or (nonzeros >= UINT32_MAX)) {
+    cout << "H matrix is too large for 32-bit indices, keeping the 64-bit sparse format\n";
+    return;
+  }
+
+  // Convert one array at a time to limit the peak memory
+  #pragma acc exit data delete(mPtr,mVal,I2H,H)
+  IH32 = narrowIndex(IH, mObs+1);
+  JH32 = narrowIndex(JH, nonzeros);
+  mPtr32 = narrowIndex(mPtr, nState+1);
+  mVal32 = narrowIndex(mVal, nonzeros);
+  I2H32 = narrowIndex(I2H, nonzeros);
+  if (HsinglePrecision) {
+    Hsingle = new float[nonzeros];
+    #pragma omp parallel for
+    for (int64_t n = 0; n < (int64_t)nonzeros; n++) Hsingle[n] = (float)H[n];
+    delete[] H;
+    H = NULL;
+    #pragma acc enter data copyin(Hsingle[:nonzeros])
+  } else {
+    #pragma acc enter data copyin(H[:nonzeros])
+  }
+  #pragma acc enter data copyin(IH32[:mObs+1],JH32[:nonzeros],mPtr32[:nState+1],mVal32[:nonzeros],I2H32[:nonzeros])
+  Hcompact = true;
+
+  size_t valueSize = HsinglePrecision ? sizeof(float) : sizeof(real);
+  cout << "Compact H matrix with 32-bit indices" << (HsinglePrecision ? " and single precision values" : "") << "\n";
+  cout << "Memory usage for [H]             (Mbytes): " << valueSize*(nonzeros)/(1024.0*1024.0) << "\n";
+  cout << "Memory usage for [mPtr,mVal,I2H] (Mbytes): " << sizeof(uint32_t)*(nState+2.*nonzeros+1)/(1024.*1024.) << "\n";
+  cout << "Memory usage for [IH,JH]         (Mbytes): " << sizeof(uint32_t)*(mObs+nonzeros+1)/(1024.*1024.) << "\n";
+}
+
+bool CostFunction3D::sameBasisBC(const int& var1, const int& var2)
+{
+  return ((iBCL[var1] == iBCL[var2]) and (iBCR[var1] == iBCR[var2])
+          and (jBCL[var1] == jBCL[var2]) and (jBCR[var1] == jBCR[var2])
+          and (kBCL[var1] == kBCL[var2]) and (kBCR[var1] == kBCR[var2]));
+}
+
+void CostFunction3D::buildHmatrixFree()
+{
+  std::cout << "Build matrix-free H transform...\n";
+  std::cout << "calcHmatrix: Grid dimensions: (" << iDim << ", " << jDim << ", " << kDim << ")" << std::endl;
+
+  int *nTerms = new int[mObs];
+  int *nBlocks = new int[mObs];
+  integer *blockPtr = new integer[mObs+1];
+  Hterm = new integer[mObs+1];
+  Hnode = new int[3*mObs];
+
+  // Count the weighted (variable, derivative) terms of each observation, and the distinct
+  // 1-D basis blocks they need. Terms share a block when they have the same derivative and
+  // boundary conditions
+  #pragma omp parallel for
+  for (int64_t m = 0; m < mObs; m++) {
+    integer mi = m*(7+varDim*derivDim);
+    int terms = 0;
+    int blocks = 0;
+    int blockVar[7*4], blockDeriv[7*4];
+    for (int var = 0; var < varDim; var++) {
+      for (int d = 0; d < derivDim; d++) {
+        if (!obsVector[mi + (7*(d+1)) + var]) continue;
+        terms++;
+        bool found = false;
+        for (int b = 0; b < blocks; b++) {
+          if ((blockDeriv[b] == d) and sameBasisBC(blockVar[b], var)) found = true;
+        }
+        if (!found) {
+          blockVar[blocks] = var;
+          blockDeriv[blocks] = d;
+          blocks++;
+        }
+      }
+    }
+    nTerms[m] = terms;
+    nBlocks[m] = blocks;
+  }
+
+  exclusiveScan(nTerms, Hterm, mObs);
+  exclusiveScan(nBlocks, blockPtr, mObs);
+  integer terms = Hterm[mObs];
+  integer blocks = blockPtr[mObs];
+
+  Hbasis = new real[12*blocks];
+  HtermBasis = new integer[terms];
+  HtermVar = new int[terms];
+  HtermWeight = new real[terms];
+
+  // Fill the basis blocks and terms in the same (var, derivative) order as the sparse H rows
+  #pragma omp parallel for
+  for (int64_t m0 = 0; m0 < mObs; m0 += OBS_BLOCK) {
+    int count = (int)min((int64_t)OBS_BLOCK, mObs - m0);
+    int base[3*OBS_BLOCK];
+    real weights[24*OBS_BLOCK];
+    obsBasisWeights(m0, count, base, weights);
+    for (int o = 0; o < count; o++) {
+      int64_t m = m0 + o;
+      integer mi = m*(7+varDim*derivDim);
+      Hnode[3*m] = base[o];
+      Hnode[3*m+1] = base[OBS_BLOCK + o];
+      Hnode[3*m+2] = base[2*OBS_BLOCK + o];
+
+      integer t = Hterm[m];
+      int blocks = 0;
+      int blockVar[7*4], blockDeriv[7*4];
+      for (int var = 0; var < varDim; var++) {
+        for (int d = 0; d < derivDim; d++) {
+          int slot = (7*(d+1)) + var;
+          if (!obsVector[mi + slot]) continue;
+          int b = 0;
+          while ((b < blocks) and !((blockDeriv[b] == d) and sameBasisBC(blockVar[b], var))) b++;
+          real* basis = &Hbasis[12*(blockPtr[m] + b)];
+          if (b == blocks) {
+            // Nodes outside of the domain have a zero weight so they are skipped by the transforms
+            for (int n = 0; n < 4; n++) {
+              basis[n] = BWEIGHT(weights, 0, derivative[d][0], n, o);
+              basis[4+n] = BWEIGHT(weights, 1, derivative[d][1], n, o);
+              basis[8+n] = BWEIGHT(weights, 2, derivative[d][2], n, o);
+            }
+            blockVar[blocks] = var;
+            blockDeriv[blocks] = d;
+            blocks++;
+          }
+          HtermBasis[t] = 12*(blockPtr[m] + b);
+          HtermVar[t] = var;
+          HtermWeight[t] = obsVector[mi + slot];
+          t++;
+        }
+      }
+    }
+  }
+
+  // Bin the observations by the (j, k) origin of their stencil so the transpose can be
+  // computed one (j, k) line of nodes at a time. Base nodes range from -1 to Dim-1
+  int64_t bins = (int64_t)(jDim+1)*(kDim+1);
+  integer *binCount = new integer[bins];
+  HbinPtr = new integer[bins+1];
+  HbinObs = new integer[mObs];
+  for (int64_t b = 0; b < bins; b++) binCount[b] = 0;
+  for (int64_t m = 0; m < mObs; m++) {
+    binCount[(Hnode[3*m+1]+1)*(kDim+1) + Hnode[3*m+2]+1]++;
+  }
+  exclusiveScan(binCount, HbinPtr, bins);
+  for (int64_t b = 0; b < bins; b++) binCount[b] = 0;
+  for (int64_t m = 0; m < mObs; m++) {
+    int64_t b = (Hnode[3*m+1]+1)*(kDim+1) + Hnode[3*m+2]+1;
+    HbinObs[HbinPtr[b] + binCount[b]] = m;
+    binCount[b]++;
+  }
+
+  #pragma acc enter data copyin(Hnode[:3*mObs],Hbasis[:12*blocks],Hterm[:mObs+1],HtermBasis[:terms],HtermVar[:terms],HtermWeight[:terms],HbinPtr[:bins+1],HbinObs[:mObs])
+  std::cout << "Weighted terms in matrix-free H: " << terms << ", 1-D basis blocks: " << blocks << "\n";
+  cout << "Memory usage for [Hbasis,Hnode]  (Mbytes): " << (sizeof(real)*12.*blocks + sizeof(int)*3.*mObs)/(1024.*1024.) << "\n";
+  cout << "Memory usage for [Hterm]         (Mbytes): " << ((sizeof(integer)+sizeof(int)+sizeof(real))*terms + sizeof(integer)*(mObs+1.))/(1024.*1024.) << "\n";
+  cout << "Memory usage for [HbinPtr,HbinObs] (Mbytes): " << sizeof(integer)*(bins+1.+mObs)/(1024.*1024.) << "\n";
+  cout << "Memory usage for [obsVector]     (Mbytes): " << sizeof(real)*(mObs*(7+varDim*derivDim))/(1024.0*1024.0) << "\n";
+  cout << "Memory usage for [state]         (Mbytes): " << sizeof(real)*(nState)/(1024.*1024.) << "\n";
+
+  delete[] nTerms;
+  delete[] nBlocks;
+  delete[] blockPtr;
+  delete[] binCount;
+}
+
+void CostFunction3D::HtransformMatrixFree(const real* Cstate, real* Hstate)
+{
+	#pragma acc data present(Cstate,Hstate)
+	{
+  	GPTLstart("CostFunction3D::Htransform");
+  	// Evaluate each row of H as the tensor product of the 1-D basis values,
+  	// in the same order as the sparse rows
+  	#pragma omp parallel for
+  	#pragma acc parallel loop vector gang vector_length(32)
+  	for (int64_t m = 0; m < mObs; m++) {
+    	real tmp = 0.0;
+    	int i0 = Hnode[3*m];
+    	int j0 = Hnode[3*m+1];
+    	int k0 = Hnode[3*m+2];
+    	for (integer t = Hterm[m]; t < Hterm[m+1]; t++) {
+      	int var = HtermVar[t];
+      	const real* ibasis = &Hbasis[HtermBasis[t]];
+      	const real* jbasis = ibasis + 4;
+      	const real* kbasis = ibasis + 8;
+      	real weight = HtermWeight[t];
+      	for (int a = 0; a < 4; a++) {
+        	if (!ibasis[a]) continue;
+        	for (int b = 0; b < 4; b++) {
+          	if (!jbasis[b]) continue;
+          	for (int c = 0; c < 4; c++) {
+            	if (!kbasis[c]) continue;
+            	tmp += (ibasis[a] * jbasis[b] * kbasis[c] * weight)
+              	* Cstate[SINDEX(i0+a, j0+b, k0+c, var)];
+          	}
+        	}
+      	}
+    	}
+    	Hstate[m] = tmp;
+  	}
+
+  	GPTLstop("CostFunction3D::Htransform");
+	}
+}
+
+void CostFunction3D::calcHTransposeMatrixFree(const real* yhat, const real* obsWeight, real* Astate)
+{
+	#pragma acc data present(yhat,Astate)
+	{
+  	GPTLstart("CostFunction3D::calcHTranspose");
+  	// Each (j, k) line of nodes is owned by one thread, which gathers the contributions of the
+  	// observations whose stencils overlap it. No atomics are needed and the summation order
+  	// does not depend on the number of threads
+  	#pragma omp parallel for collapse(2) schedule(dynamic)
+  	#pragma acc parallel loop gang vector vector_length(32) collapse(2)
+  	for (int kNode = 0; kNode < kDim; kNode++) {
+    	for (int jNode = 0; jNode < jDim; jNode++) {
+      	int64_t line = SINDEX(0, jNode, kNode, 0);
+      	for (int var = 0; var < varDim; var++)
+        	for (int i = 0; i < iDim; i++) Astate[line + i*iStride + var*varStride] = 0.0;
+      	for (int k0 = max(kNode-3,-1); k0 <= kNode; k0++) {
+        	for (int j0 = max(jNode-3,-1); j0 <= jNode; j0++) {
+          	int64_t bin = (int64_t)(j0+1)*(kDim+1) + k0+1;
+          	int b = jNode - j0;
+          	int c = kNode - k0;
+          	for (integer p = HbinPtr[bin]; p < HbinPtr[bin+1]; p++) {
+            	integer m = HbinObs[p];
+            	int i0 = Hnode[3*m];
+            	real val = (obsWeight != NULL) ? yhat[m] * obsWeight[m] : yhat[m];
+            	for (integer t = Hterm[m]; t < Hterm[m+1]; t++) {
+              	const real* ibasis = &Hbasis[HtermBasis[t]];
+              	real jbasis = ibasis[4+b];
+              	real kbasis = ibasis[8+c];
+              	if (!jbasis or !kbasis) continue;
+              	int var = HtermVar[t];
+              	real weight = HtermWeight[t];
+              	for (int a = 0; a < 4; a++) {
+                	if (!ibasis[a]) continue;
+                	Astate[line + (i0+a)*iStride + var*varStride] += (ibasis[a] * jbasis * kbasis * weight) * val;
+              	}
+            	}
+          	}
+        	}
+      	}
+    	}
+  	}
+  	GPTLstop("CostFunction3D::calcHTranspose");
+	}
+}
+
+// Make room for blocks of k states and observation vectors
+void CostFunction3D::reserveBlock(const int& k)
+{
+  if (k <= blockWidth) return;
+  delete[] blockState;
+  delete[] blockObs;
+  blockState = new real[(int64_t)k*nState];
+  blockObs = new real[(int64_t)k*mObs];
+  blockWidth = k;
+}
+
+// CX = C*X for the whole block, the same transforms as updateHCq without the fused path.
+// Each pencil is transformed for all the members at once
+void CostFunction3D::transformBlock(const int& k, const real* X, real* CX)
+{
+  SCtransformBlock(k, X, CX);
+  SAtransformBlock(k, CX, CX);
+  FFtransformBlock(k, CX, CX);
+}
+
+// X = C^T*CX for the whole block, in the order used by funcHessian
+void CostFunction3D::transposeBlock(const int& k, const real* CX, real* X)
+{
+  FFtransformBlock(k, CX, X);
+  SAtransformBlock(k, X, X);
+  SCtransformBlock(k, X, X);
+}
+
+// SCtransform of k interleaved states. The members of a node are adjacent, so each pencil
+// gathers as k interleaved pencils for filterPencils. Each pencil is read before it is
+// written, so Cstate may be Astate
+void CostFunction3D::SCtransformBlock(const int& k, const real* Astate, real* Cstate)
+{
+  TransformSchedule transformSchedule(scheduleKind, scheduleChunk);
+  GPTLstart("CostFunction3D::SCtransformBlock");
+  if ((iFilterScale < 0) and (jFilterScale < 0) and (kFilterScale < 0)) {
+    #pragma omp parallel for
+    for (int64_t n = 0; n < nState; n++) {
+      for (int b = 0; b < k; b++) Cstate[n*k+b] = Astate[n*k+b] * bgStdDev[n];
+    }
+    GPTLstop("CostFunction3D::SCtransformBlock");
+    return;
+  }
+  int maxDim = max(iDim, max(jDim, kDim));
+  #pragma omp parallel
+  {
+    real* temp = new real[(int64_t)maxDim*k];
+    real* q = new real[(int64_t)maxDim*k];
+
+    // k pencils
+    #pragma omp for collapse(3) schedule(runtime)
+    for (int var = 0; var < varDim; var++) {
+      for (int iIndex = 0; iIndex < iDim; iIndex++) {
+	for (int jIndex = 0; jIndex < jDim; jIndex++) {
+	  for (int kIndex = 0; kIndex < kDim; kIndex++) {
+	    const real* a = Astate + SINDEX(iIndex, jIndex, kIndex, var)*k;
+	    for (int b = 0; b < k; b++) temp[kIndex*k + b] = a[b];
+	  }
+	  if (kFilterScale > 0) kFilter->filterPencils(temp, q, kDim, k);
+	  for (int kIndex = 0; kIndex < kDim; kIndex++) {
+	    real* c = Cstate + SINDEX(iIndex, jIndex, kIndex, var)*k;
+	    for (int b = 0; b < k; b++) c[b] = temp[kIndex*k + b];
+	  }
+	}
+      }
+    }
+
+    // j pencils
+    #pragma omp for collapse(3) schedule(runtime)
+    for (int var = 0; var < varDim; var++) {
+      for (int iIndex = 0; iIndex < iDim; iIndex++) {
+	for (int kIndex = 0; kIndex < kDim; kIndex++) {
+	  if (jFilterScale <= 0) continue;
+	  for (int jIndex = 0; jIndex < jDim; jIndex++) {
+	    const real* c = Cstate + SINDEX(iIndex, jIndex, kIndex, var)*k;
+	    for (int b = 0; b < k; b++) temp[jIndex*k + b] = c[b];
+	  }
+	  jFilter->filterPencils(temp, q, jDim, k);
+	  for (int jIndex = 0; jIndex < jDim; jIndex++) {
+	    real* c = Cstate + SINDEX(iIndex, jIndex, kIndex, var)*k;
+	    for (int b = 0; b < k; b++) c[b] = temp[jIndex*k + b];
+	  }
+	}
+      }
+    }
+
+    // i pencils, then D
+    #pragma omp for collapse(3) schedule(runtime)
+    for (int var = 0; var < varDim; var++) {
+      for (int jIndex = 0; jIndex < jDim; jIndex++) {
+	for (int kIndex = 0; kIndex < kDim; kIndex++) {
+	  for (int iIndex = 0; iIndex < iDim; iIndex++) {
+	    const real* c = Cstate + SINDEX(iIndex, jIndex, kIndex, var)*k;
+	    for (int b = 0; b < k; b++) temp[iIndex*k + b] = c[b];
+	  }
+	  if (iFilterScale > 0) iFilter->filterPencils(temp, q, iDim, k);
+	  for (int iIndex = 0; iIndex < iDim; iIndex++) {
+	    int64_t index = SINDEX(iIndex, jIndex, kIndex, var);
+	    real* c = Cstate + index*k;
+	    for (int b = 0; b < k; b++) c[b] = temp[iIndex*k + b] * bgStdDev[index];
+	  }
+	}
+      }
+    }
+    delete[] temp;
+    delete[] q;
+  }
+  GPTLstop("CostFunction3D::SCtransformBlock");
+}
+
+// SAtransform of k interleaved states, with the spline solve of each pencil done for all the
+// members at once. Bstate may be Astate
+void CostFunction3D::SAtransformBlock(const int& k, const real* Bstate, real* Astate)
+{
+  TransformSchedule transformSchedule(scheduleKind, scheduleChunk);
+  GPTLstart("CostFunction3D::SAtransformBlock");
+  int maxDim = max(iDim, max(jDim, kDim));
+  #pragma omp parallel
+  {
+    real* pencil = new real[(int64_t)maxDim*k];
+    real* x = new real[(int64_t)maxDim*k];
+    real* tmp = new real[k];
+
+    #pragma omp for collapse(3) schedule(runtime)
+    for (int var = 0; var < varDim; var++) {
+      for (int iIndex = 0; iIndex < iDim; iIndex++) {
+	for (int jIndex = 0; jIndex < jDim; jIndex++) {
+	  for (int kIndex = 0; kIndex < kDim; kIndex++) {
+	    const real* a = Bstate + SINDEX(iIndex, jIndex, kIndex, var)*k;
+	    for (int b = 0; b < k; b++) pencil[kIndex*k + b] = a[b];
+	  }
+	  splinePencilBlock(pencil, x, tmp, k, kDim, kRank[var], kLDim, kL[var], kGamma[var],
+			    kGammaRow[var], kGammaCol[var], kGammaIndex[var]);
+	  for (int kIndex = 0; kIndex < kDim; kIndex++) {
+	    real* a = Astate + SINDEX(iIndex, jIndex, kIndex, var)*k;
+	    for (int b = 0; b < k; b++) a[b] = pencil[kIndex*k + b];
+	  }
+	}
+      }
+    }
+
+    #pragma omp for collapse(3) schedule(runtime)
+    for (int var = 0; var < varDim; var++) {
+      for (int iIndex = 0; iIndex < iDim; iIndex++) {
+	for (int kIndex = 0; kIndex < kDim; kIndex++) {
+	  for (int jIndex = 0; jIndex < jDim; jIndex++) {
+	    const real* a = Astate + SINDEX(iIndex, jIndex, kIndex, var)*k;
+	    for (int b = 0; b < k; b++) pencil[jIndex*k + b] = a[b];
+	  }
+	  splinePencilBlock(pencil, x, tmp, k, jDim, jRank[var], jLDim, jL[var], jGamma[var],
+			    jGammaRow[var], jGammaCol[var], jGammaIndex[var]);
+	  for (int jIndex = 0; jIndex < jDim; jIndex++) {
+	    real* a = Astate + SINDEX(iIndex, jIndex, kIndex, var)*k;
+	    for (int b = 0; b < k; b++) a[b] = pencil[jIndex*k + b];
+	  }
+	}
+      }
+    }
+
+    #pragma omp for collapse(3) schedule(runtime)
+    for (int var = 0; var < varDim; var++) {
+      for (int jIndex = 0; jIndex < jDim; jIndex++) {
+	for (int kIndex = 0; kIndex < kDim; kIndex++) {
+	  for (int iIndex = 0; iIndex < iDim; iIndex++) {
+	    const real* a = Astate + SINDEX(iIndex, jIndex, kIndex, var)*k;
+	    for (int b = 0; b < k; b++) pencil[iIndex*k + b] = a[b];
+	  }
+	  splinePencilBlock(pencil, x, tmp, k, iDim, iRank[var], iLDim, iL[var], iGamma[var],
+			    iGammaRow[var], iGammaCol[var], iGammaIndex[var]);
+	  for (int iIndex = 0; iIndex < iDim; iIndex++) {
+	    real* a = Astate + SINDEX(iIndex, jIndex, kIndex, var)*k;
+	    for (int b = 0; b < k; b++) a[b] = pencil[iIndex*k + b];
+	  }
+	}
+      }
+    }
+    delete[] pencil;
+    delete[] x;
+    delete[] tmp;
+  }
+  GPTLstop("CostFunction3D::SAtransformBlock");
+}
+
+// FFtransform of k interleaved states. The FFTW plans are for one slab, so each member of a
+// slab is transformed in turn, but all the slabs and members of a variable share one parallel loop
+void CostFunction3D::FFtransformBlock(const int& k, const real* Astate, real* Cstate)
+{
+  GPTLstart("CostFunction3D::FFtransformBlock");
+  if (Cstate != Astate) {
+    #pragma omp parallel for
+    for (int64_t n = 0; n < (int64_t)k*nState; n++) Cstate[n] = Astate[n];
+  }
+  if (UseFFT) {
+    int iHalf = iDim/2+1, jHalf = jDim/2+1, kHalf = kDim/2+1;
+    for (int var = 0; var < varDim; var++) {
+      // Enforce max wavenumber on the k pencils of each i slab
+      if ((kBCL[var] == PERIODIC) and (kMaxWavenumber[var] >= 0)) {
+        #pragma omp parallel for collapse(2) num_threads(FFTthreads)
+        for (int iIndex = 0; iIndex < iDim; iIndex++) {
+          for (int b = 0; b < k; b++) {
+            double* in = FFTin[fftThread()];
+            fftw_complex* out = FFTout[fftThread()];
+            for (int jIndex = 0; jIndex < jDim; jIndex++)
+              for (int kIndex = 0; kIndex < kDim; kIndex++)
+                in[jIndex*kDim + kIndex] = Cstate[SINDEX(iIndex, jIndex, kIndex, var)*k + b];
+            fftw_execute_dft_r2c(kForward, in, out);
+            for (int jIndex = 0; jIndex < jDim; jIndex++) {
+              for (int kIndex = kMaxWavenumber[var]+1; kIndex < kHalf; kIndex++) {
+                out[jIndex*kHalf + kIndex][0] = 0.0;
+                out[jIndex*kHalf + kIndex][1] = 0.0;
+              }
+            }
+            fftw_execute_dft_c2r(kBackward, out, in);
+            for (int jIndex = 0; jIndex < jDim; jIndex++)
+              for (int kIndex = 0; kIndex < kDim; kIndex++)
+                Cstate[SINDEX(iIndex, jIndex, kIndex, var)*k + b] = in[jIndex*kDim + kIndex]/kDim;
+          }
+        }
+      }
+
+      // Enforce max wavenumber on the j pencils of each k slab
+      if ((jBCL[var] == PERIODIC) and (jMaxWavenumber[var] >= 0)) {
+        #pragma omp parallel for collapse(2) num_threads(FFTthreads)
+        for (int kIndex = 0; kIndex < kDim; kIndex++) {
+          for (int b = 0; b < k; b++) {
+            double* in = FFTin[fftThread()];
+            fftw_complex* out = FFTout[fftThread()];
+            for (int jIndex = 0; jIndex < jDim; jIndex++)
+              for (int iIndex = 0; iIndex < iDim; iIndex++)
+                in[iIndex*jDim + jIndex] = Cstate[SINDEX(iIndex, jIndex, kIndex, var)*k + b];
+            fftw_execute_dft_r2c(jForward, in, out);
+            for (int iIndex = 0; iIndex < iDim; iIndex++) {
+              for (int jIndex = jMaxWavenumber[var]+1; jIndex < jHalf; jIndex++) {
+                out[iIndex*jHalf + jIndex][0] = 0.0;
+                out[iIndex*jHalf + jIndex][1] = 0.0;
+              }
+            }
+            fftw_execute_dft_c2r(jBackward, out, in);
+            for (int jIndex = 0; jIndex < jDim; jIndex++)
+              for (int iIndex = 0; iIndex < iDim; iIndex++)
+                Cstate[SINDEX(iIndex, jIndex, kIndex, var)*k + b] = in[iIndex*jDim + jIndex]/jDim;
+          }
+        }
+      }
+
+      // Enforce max wavenumber on the i pencils of each k slab
+      if ((iBCL[var] == PERIODIC) and (iMaxWavenumber[var] >= 0)) {
+        #pragma omp parallel for collapse(2) num_threads(FFTthreads)
+        for (int kIndex = 0; kIndex < kDim; kIndex++) {
+          for (int b = 0; b < k; b++) {
+            double* in = FFTin[fftThread()];
+            fftw_complex* out = FFTout[fftThread()];
+            for (int jIndex = 0; jIndex < jDim; jIndex++)
+              for (int iIndex = 0; iIndex < iDim; iIndex++)
+                in[jIndex*iDim + iIndex] = Cstate[SINDEX(iIndex, jIndex, kIndex, var)*k + b];
+            fftw_execute_dft_r2c(iForward, in, out);
+            for (int jIndex = 0; jIndex < jDim; jIndex++) {
+              for (int iIndex = iMaxWavenumber[var]+1; iIndex < iHalf; iIndex++) {
+                out[jIndex*iHalf + iIndex][0] = 0.0;
+                out[jIndex*iHalf + iIndex][1] = 0.0;
+              }
+            }
+            fftw_execute_dft_c2r(iBackward, out, in);
+            for (int jIndex = 0; jIndex < jDim; jIndex++)
+              for (int iIndex = 0; iIndex < iDim; iIndex++)
+                Cstate[SINDEX(iIndex, jIndex, kIndex, var)*k + b] = in[jIndex*iDim + iIndex]/iDim;
+          }
+        }
+      }
+    }
+  }
+  GPTLstop("CostFunction3D::FFtransformBlock");
+}
+
+void CostFunction3D::HtransformBlock(const int& k, const real* Cstate, real* Hstate)
+{
+  GPTLstart("CostFunction3D::HtransformBlock");
+  if (hOperator == H_MATRIX_FREE) {
+    // No stored matrix to share, so apply it one member at a time
+    for (int b = 0; b < k; b++) {
+      #pragma omp parallel for
+      for (int64_t n = 0; n < nState; n++) stateC[n] = Cstate[n*k+b];
+      HtransformMatrixFree(stateC, HCq);
+      #pragma omp parallel for
+      for (int64_t m = 0; m < mObs; m++) Hstate[m*k+b] = HCq[m];
+    }
+  } else if (Hcompact) {
+    if (Hsingle != NULL) {
+      blockHtransform(mObs, k, IH32, JH32, Hsingle, Cstate, Hstate);
+    } else {
+      blockHtransform(mObs, k, IH32, JH32, H, Cstate, Hstate);
+    }
+  } else {
+    blockHtransform(mObs, k, IH, JH, H, Cstate, Hstate);
+  }
+  GPTLstop("CostFunction3D::HtransformBlock");
+}
+
+// H^T*R^-1*yhat for a block of observation vectors. R^-1 is applied in the kernel, so the
+// prescaling option is not needed here
+void CostFunction3D::calcHTransposeBlock(const int& k, const real* yhat, real* Astate)
+{
+  GPTLstart("CostFunction3D::calcHTransposeBlock");
+  if (hOperator == H_MATRIX_FREE) {
+    for (int b = 0; b < k; b++) {
+      #pragma omp parallel for
+      for (int64_t m = 0; m < mObs; m++) HCq[m] = yhat[m*k+b];
+      calcHTransposeMatrixFree(HCq, obsData, stateC);
+      #pragma omp parallel for
+      for (int64_t n = 0; n < nState; n++) Astate[n*k+b] = stateC[n];
+    }
+  } else if (Hcompact) {
+    if (Hsingle != NULL) {
+      blockHTranspose(nState, k, mPtr32, mVal32, I2H32, Hsingle, yhat, obsData, Astate);
+    } else {
+      blockHTranspose(nState, k, mPtr32, mVal32, I2H32, H, yhat, obsData, Astate);
+    }
+  } else if (HT != NULL) {
+    blockHTranspose(nState, k, mPtr, mVal, (const integer*)NULL, HT, yhat, obsData, Astate);
+  } else {
+    blockHTranspose(nState, k, mPtr, mVal, I2H, H, yhat, obsData, Astate);
+  }
+  GPTLstop("CostFunction3D::calcHTransposeBlock");
+}
+
 // Copy the final results into the given arrays
 // Source is row major order (C)
 // Dest is column major order (Fortran)
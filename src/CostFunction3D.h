@@ -48,6 +48,7 @@ CostFunction3D(const Projection& proj, const int& numObs = 0, const int& stateSi
 	void initState(const int iteration);
 	bool copyResults(int iDim, int jDim, int kDim,
 			 float *u, float *v, float *w, float *th, float *p);
+	void ensembleSpread(const int& members);
 
 protected:
 	double funcValue(double* state);
@@ -55,6 +56,8 @@ protected:
 	void updateHCq(double* state);
 	double funcValueAndGradient(double *state, double *gradient);
 	void funcHessian(double *x, double *hessian);
+	bool funcPreconditioner(double *Minv);
+	void funcHessianBlock(const int& k, real* X, real* HX);
 	void updateHCq(double* state, double* HCq);
 	real Basis(const int& m, const real& x, const int& M,const real& xmin,
 			   const real& DX, const real& DXrecip, const int& derivative,
@@ -63,9 +66,23 @@ protected:
 			   const real& DX, const real& DXrecip, const int& derivative,
 			   const int& BL, const int& BR, const real& lambda = 0);
 	void fillBasisLookup();
+	real* fillBasisTable(const int& Dim, const real& xMin, const real& DX, const real& DXrecip,
+			     const int* BCL, const int* BCR);
+	void basisWeights(const real* x, const int& count, const int& Dim, const real& xMin,
+			  const real& DX, const real& DXrecip, const int& stride,
+			  int* base, real* value, real* slope);
+	void obsBasisWeights(const int64_t& m0, const int& count, int* base, real* weights);
+	// Basis at a grid or mish point from the tables filled in initialize. The point is 0 on the
+	// node, and half*(2+mu) for the mish (mu = -1, 1) and cell center (mu = 0) points of the
+	// cell, n is the node offset from the base node - 1 of the point
+	inline real tableBasis(const real* table, const int& index, const int& point, const int& var,
+			       const int& n, const int& derivative) {
+	  return table[(((int64_t)(index*4 + point)*varDim + var)*4 + n)*2 + derivative];
+	}
 	bool filterArray(real* array, const int& arrLength);
 	bool setupSplines();
 	void obAdjustments();
+	void sortObservations();
 	void solveBC(real* A, real* B);
 	bool SAtransform(const real* Bstate, real* Astate);
 	bool SAtranspose(const real* Astate, real* Bstate);
@@ -77,6 +94,11 @@ protected:
 	void SCtransform(const real* Astate, real* Cstate);
 	void SCtranspose(const real* Cstate, real* Astate);
 	void FFtransform(const real* Astate, real* Cstate);
+	void fusedTransform(const real* state, real* Cstate);
+	void setStateLayout();
+	void interleaveState(const real* state, real* interleaved);
+	void deinterleaveState(const real* interleaved, real* state);
+	real* interleavedState(real* state);
 
 	bool writeAsi(const std::string& asiFileName);
 	bool writeNetCDF(const std::string& netcdfFileName);
@@ -84,10 +106,30 @@ protected:
 	void adjustInternalDomain(int increment);
 	void calcSplineCoefficients(const int& Dim, const real& eq, const int* BCL, const int* BCR,
                                 const real& xmin, const real& DX, const real& DXrecip, const int& LDim,
-                                real* L[7], real* gamma[7]);
+                                real* L[7], real* gamma[7], int* gammaRow[7], int* gammaCol[7],
+                                int* gammaIndex[7]);
 	bool copy3DArray(real *src, float *dest, int iDim, int jDim, int kDim);
 	void calcHmatrix();
+	void setupFFT();
+	void setupFusedScratch();
+	void buildHmatrix();
+	void freeHmatrix();
+	std::vector<real> HmatrixInputs();
+	void buildHmatrixFree();
+	void compactHmatrix();
+	void transposeHvalues();
+	bool sameBasisBC(const int& var1, const int& var2);
 	void Htransform(const real* Cstate, real* Hstate);
+	void HtransformMatrixFree(const real* Cstate, real* Hstate);
+	void calcHTransposeMatrixFree(const real* yhat, const real* obsWeight, real* Astate);
+	void reserveBlock(const int& k);
+	void transformBlock(const int& k, const real* X, real* CX);
+	void transposeBlock(const int& k, const real* CX, real* X);
+	void SCtransformBlock(const int& k, const real* Astate, real* Cstate);
+	void SAtransformBlock(const int& k, const real* Bstate, real* Astate);
+	void FFtransformBlock(const int& k, const real* Astate, real* Cstate);
+	void HtransformBlock(const int& k, const real* Cstate, real* Hstate);
+	void calcHTransposeBlock(const int& k, const real* yhat, real* Astate);
 
 	// A couple of utilities functions to help query config values
   bool isTrue(const char *flag_in) {
@@ -108,8 +150,17 @@ protected:
 
 	void initBkgdErrors();
 
+	// Position in obsVector of the n-th observation in the input order
+	int64_t sortedObIndex(const int64_t& n) {
+		return (obsRank != NULL) ? obsRank[n] : n;
+	}
+
 	bool mishFlag;
 	int iDim, jDim, kDim;
+	// Strides of the node and variable indices in the state vectors
+	bool stateVarMajor;
+	int64_t iStride, jStride, kStride, varStride;
+	real* ioState;
 	int iLDim, jLDim, kLDim;
 	int iRank[7], jRank[7], kRank[7];
   int kRankMax;
@@ -122,6 +173,9 @@ protected:
 	real* obsVector;
   real* obsData;  // This only contains data that is needed by the calcHTranspose2 subroutine
 	real* rawObs;
+	// Permutation from obsVector to rawObs order (and its inverse) when the obs are reordered
+	integer* obsOrder;
+	integer* obsRank;
 	real* stateA;
 	real* stateB;
 	real* stateC;
@@ -132,9 +186,23 @@ protected:
 	real* iL[7];
 	real* jL[7];
 	real* kL[7];
+	// gamma is the identity plus a few boundary condition entries, so only its nonzeros are
+	// kept, first by row and then by column. Row m is the entries [gammaRow[2m], gammaRow[2m+1])
+	// of gamma, with their columns in gammaIndex, and column n is the entries
+	// [gammaCol[2n], gammaCol[2n+1]), with their rows. A row has at most gammaEntries nonzeros
+	static const int gammaEntries = 5;
 	real* iGamma[7];
 	real* jGamma[7];
 	real* kGamma[7];
+	int* iGammaRow[7];
+	int* jGammaRow[7];
+	int* kGammaRow[7];
+	int* iGammaCol[7];
+	int* jGammaCol[7];
+	int* kGammaCol[7];
+	int* iGammaIndex[7];
+	int* jGammaIndex[7];
+	int* kGammaIndex[7];
   real* kGammaL;
 	real* kLL;
 	real* finalAnalysis;
@@ -148,12 +216,58 @@ protected:
 	real latReference, lonReference;
 	int iMaxWavenumber[7], jMaxWavenumber[7], kMaxWavenumber[7];
 	fftw_plan iForward, jForward, iBackward, jBackward, kForward, kBackward;
-	double *iFFTin, *jFFTin, *kFFTin;
-	fftw_complex *iFFTout, *jFFTout, *kFFTout;
-        bool UseFFT;
+	// fusedTransform's plans for tiles of fusedRows interleaved i pencils and slabs of kDim
+	// interleaved j pencils
+	fftw_plan iTileForward, iTileBackward, jSlabForward, jSlabBackward;
+	// Per-thread buffers holding one slab of pencils for the batched plans. The parallel
+	// regions that use them are limited to FFTthreads, the count when they were allocated
+	int FFTthreads;
+	double **FFTin;
+	fftw_complex **FFTout;
+        bool UseFFT, FFTplanned;
 	real *H;
 	integer *IH, *I2H,*JH;
   integer *mPtr, *mVal;
+  // The settings used to build H, so it can be reused between outer iterations
+  std::vector<real> Hinputs;
+  bool Hvalid;
+  int hOperator;
+  // Matrix-free H: base node of each observation stencil, the 1-D basis values (4 i, 4 j, 4 k)
+  // for each derivative, and the (variable, derivative) terms that use them as their basis
+  // block, state variable and weight
+  int *Hnode;
+  real *Hbasis;
+  integer *Hterm, *HtermBasis;
+  int *HtermVar;
+  real *HtermWeight;
+  // Observations binned by the (j, k) base node of their stencil, used by the matrix-free transpose
+  integer *HbinPtr, *HbinObs;
+  // Compact H: the same CSR and transpose with 32-bit indices, and optionally single precision values
+  bool Hcompact, HsinglePrecision;
+  uint32_t *IH32, *JH32, *I2H32, *mPtr32, *mVal32;
+  float *Hsingle;
+  // Values of H in the transposed (mPtr) order, replacing I2H when H_CSC is used
+  real *HT;
+  // Observations multiplied by R^-1 once per call to calcHTranspose
+  bool HprescaleObs;
+  real *obsScaled;
+  // Apply SC, SA and FF in updateHCq with fusedTransform, and its per-thread scratch. The
+  // filter tiles hold fusedPencils i pencils, and the i tiles fusedRows j rows of a k level
+  bool fuseTransforms;
+  real** fusedScratch;
+  int fusedPencils, fusedRows;
+  // Blocks of up to blockWidth states and observation vectors interleaved as X[n*k+b],
+  // for the Hessian products of several right-hand sides at once
+  int blockWidth;
+  real *blockState, *blockObs;
+  // Diagonal preconditioner of the truncated Newton inner iterations, and the number of
+  // Hessian products used to estimate it
+  int preconditioner, preconditionerProbes;
+  // OpenMP schedule kind and chunk of the transforms, from thread_schedule
+  int scheduleKind, scheduleChunk;
+
+	// Values and first derivatives of the basis at the grid and mish points of each axis
+	real *iBasisTable, *jBasisTable, *kBasisTable;
 
 	int basisappx;
 	real* basis0;
@@ -161,6 +275,7 @@ protected:
 	HashMap* configHash;
 	std::unordered_map<std::string, int> bcHash;
 	std::unordered_map<int, int> rankHash;
+	std::unordered_map<std::string, int> hOperatorHash;
 
 	enum BoundaryConditionTypes {
 		RX = -1,
@@ -181,6 +296,19 @@ protected:
 		FULL = 2
 	};
 
+	enum ObservationOperatorTypes {
+		H_CSR = 0,
+		H_MATRIX_FREE = 1,
+		H_COMPACT = 2,
+		H_CSC = 3
+	};
+
+	enum PreconditionerTypes {
+		PRECONDITION_NONE = 0,
+		PRECONDITION_COLUMN_NORM = 1,
+		PRECONDITION_DIAGONAL = 2
+	};
+
 	real iFilterScale,jFilterScale, kFilterScale;
 	RecursiveFilter* iFilter;
 	RecursiveFilter* jFilter;
@@ -191,6 +319,7 @@ protected:
 
 	ErrorData variance;
 	#pragma acc declare copyin(iDim,jDim,kDim,varDim,kLDim)
+	#pragma acc declare copyin(iStride,jStride,kStride,varStride)
 	#pragma acc declare copyin(iFilterScale,jFilterScale,kFilterScale)
 	#pragma acc declare copyin(kRankMax)
 };
@@ -70,6 +70,25 @@ bool CostFunctionCOAMPS::outputAnalysis(const std::string& suffix, real* Astate)
   }
   real gausspoint = 0.5 * sqrt(1. / 3.);
 
+  // The sigma levels are not grid or mish points, so their basis is tabulated here in the
+  // layout of the grid tables, using only the node point of each level
+  real* sigmaBasisTable = new real[(int64_t)sDim*4*varDim*4*2]();
+  for (int kIndex = 1; kIndex < sDim - 1; kIndex++) {
+    real k = (sigma[kIndex] * (sigma[0] - sigma[41])/sigma[0] + sigma[41]) / 1000.0;
+    if ((k < kMin) or (k > ((kDim - 1) * DK + kMin))) continue;
+    int kk = (int)((k - kMin) * DKrecip);
+    for (int var = 0; var < varDim; var++) {
+      for (int n = 0; n < 4; n++) {
+	int kNode = kk - 1 + n;
+	if ((kNode < 0) or (kNode >= kDim)) continue;
+	for (int d = 0; d < 2; d++) {
+	  sigmaBasisTable[(((int64_t)(kIndex*4)*varDim + var)*4 + n)*2 + d] =
+	    Basis(kNode, k, kDim-1, kMin, DK, DKrecip, d, kBCL[var], kBCR[var]);
+	}
+      }
+    }
+  }
+
 
   for (int iIndex = 1; iIndex < iDim - 1; iIndex++) {
     for (int ihalf = 0; ihalf <= mishFlag; ihalf++) {
@@ -88,8 +107,9 @@ bool CostFunctionCOAMPS::outputAnalysis(const std::string& suffix, real* Astate)
 	      real tpw = 0;
 	      for (int kIndex = 1; kIndex < sDim - 1; kIndex++) {
 		real k = (sigma[kIndex] * (sigma[0] - sigma[41])/sigma[0] + sigma[41]) / 1000.0;
-		real imu, jmu, kmu, ihalf, jhalf, khalf;
-		imu = jmu = kmu = ihalf = jhalf = khalf = 0.0;
+		// The sigma levels are never on the mish, so the output point flags are all zero
+		real iOutMu, jOutMu, kOutMu, iOutHalf, jOutHalf, kOutHalf;
+		iOutMu = jOutMu = kOutMu = iOutHalf = jOutHalf = kOutHalf = 0.0;
 		if (k < kMin) continue;
 		if (k > ((kDim - 1) * DK + kMin)) continue;
 
@@ -130,12 +150,12 @@ bool CostFunctionCOAMPS::outputAnalysis(const std::string& suffix, real* Astate)
 		      for (int jjNode = (jj - 1); jjNode <= (jj + 2); ++jjNode) {
 			int jNode = jjNode;
 			if ((jNode < 0) or (jNode >= jDim)) continue;
-			ibasis = Basis(iNode, i, iDim-1, iMin, DI, DIrecip, 0, iBCL[var], iBCR[var]);
-			jbasis = Basis(jNode, j, jDim-1, jMin, DJ, DJrecip, 0, jBCL[var], jBCR[var]);
-			kbasis = Basis(kNode, k, kDim-1, kMin, DK, DKrecip, 0, kBCL[var], kBCR[var]);
-			idbasis = Basis(iNode, i, iDim-1, iMin, DI, DIrecip, 1, iBCL[var], iBCR[var]);
-			jdbasis = Basis(jNode, j, jDim-1, jMin, DJ, DJrecip, 1, jBCL[var], jBCR[var]);
-			kdbasis = Basis(kNode, k, kDim-1, kMin, DK, DKrecip, 1, kBCL[var], kBCR[var]);
+			ibasis = tableBasis(iBasisTable, iIndex, ihalf*(2+imu), var, iNode-ii+1, 0);
+			jbasis = tableBasis(jBasisTable, jIndex, jhalf*(2+jmu), var, jNode-jj+1, 0);
+			kbasis = tableBasis(sigmaBasisTable, kIndex, 0, var, kNode-kk+1, 0);
+			idbasis = tableBasis(iBasisTable, iIndex, ihalf*(2+imu), var, iNode-ii+1, 1);
+			jdbasis = tableBasis(jBasisTable, jIndex, jhalf*(2+jmu), var, jNode-jj+1, 1);
+			kdbasis = tableBasis(sigmaBasisTable, kIndex, 0, var, kNode-kk+1, 1);
 			real basis3x = ibasis*jbasis*kbasis;
 			int aIndex = varDim * iDim * jDim * kNode + varDim * iDim * jNode + varDim * iNode;
 			switch (var) {
@@ -186,10 +206,10 @@ bool CostFunctionCOAMPS::outputAnalysis(const std::string& suffix, real* Astate)
 
 		// Save mish values for future iterations
 		std::string gridref = (*configHash)["qr_variable"];
-		if ((imu != 0) and (jmu != 0) and (kmu != 0)) {
-		  int uJ = jIndex * 2 + (jmu+1)/2;
-		  int uI = iIndex * 2 + (imu+1)/2;
-		  int uK = kIndex * 2 + (kmu+1)/2;
+		if ((iOutMu != 0) and (jOutMu != 0) and (kOutMu != 0)) {
+		  int uJ = jIndex * 2 + (jOutMu+1)/2;
+		  int uI = iIndex * 2 + (iOutMu+1)/2;
+		  int uK = kIndex * 2 + (kOutMu+1)/2;
 		  int uIndex = varDim * (iDim - 1) * 2 * (jDim - 1) * 2 * uK
 		    + varDim * (iDim - 1) * 2 * uJ + varDim * uI;
 
@@ -203,7 +223,7 @@ bool CostFunctionCOAMPS::outputAnalysis(const std::string& suffix, real* Astate)
 		}
 
 		if (((*configHash)["output_mish"] == "false")
-		    and (ihalf or jhalf or khalf)) continue;
+		    and (iOutHalf or jOutHalf or kOutHalf)) continue;
 
 		// Output it
 		real rhoa = rhoBar + rhoprime / 100;
@@ -371,7 +391,7 @@ bool CostFunctionCOAMPS::outputAnalysis(const std::string& suffix, real* Astate)
 		tpw += qv * rhoa * DK;
 
 		// On the nodes
-		if (!ihalf and !jhalf and !khalf) {
+		if (!iOutHalf and !jOutHalf and !kOutHalf) {
 		  int fIndex = (iDim - 2) * (jDim - 2) * (sDim - 2);
 		  int posIndex = (iDim - 2) * (jDim - 2) * (kIndex - 1) + (iDim - 2) * (jIndex - 1) + (iIndex - 1);
 
@@ -469,8 +489,10 @@ bool CostFunctionCOAMPS::outputAnalysis(const std::string& suffix, real* Astate)
     qcstream.precision(10);
 
     ostream_iterator<real> od(qcstream, "\t ");
-    for (int m = 0; m < mObs; m++) {
-      int mi = m*(7+varDim*derivDim);
+    for (int n = 0; n < mObs; n++) {
+      // Write the obs in their input order
+      int64_t m = sortedObIndex(n);
+      int64_t mi = m*(7+varDim*derivDim);
       real i = obsVector[mi + 2];
       real j = obsVector[mi + 3];
       real k = obsVector[mi + 4];
@@ -556,6 +578,7 @@ bool CostFunctionCOAMPS::outputAnalysis(const std::string& suffix, real* Astate)
   sDim += 2;
 
   // Free the memory for the analysis variables
+  delete[] sigmaBasisTable;
 
 
   if (suffix != "analysis") 	// TODO: Need the keep analysis for return arrays
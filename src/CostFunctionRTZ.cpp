@@ -99,12 +99,12 @@ bool CostFunctionRTZ::outputAnalysis(const std::string& suffix, real* Astate)
                                                     for (int jjNode = (jj-1); jjNode <= (jj+2); ++jjNode) {
                                                         int jNode = jjNode;
                                                         if ((jNode < 0) or (jNode >= jDim)) continue;
-														ibasis = Basis(iNode, i, iDim-1, iMin, DI, DIrecip, 0, iBCL[var], iBCR[var]);
-														jbasis = Basis(jNode, j, jDim-1, jMin, DJ, DJrecip, 0, jBCL[var], jBCR[var]);
-														kbasis = Basis(kNode, k, kDim-1, kMin, DK, DKrecip, 0, kBCL[var], kBCR[var]);
-														idbasis = Basis(iNode, i, iDim-1, iMin, DI, DIrecip, 1, iBCL[var], iBCR[var]);
-														jdbasis = Basis(jNode, j, jDim-1, jMin, DJ, DJrecip, 1, jBCL[var], jBCR[var]);
-														kdbasis = Basis(kNode, k, kDim-1, kMin, DK, DKrecip, 1, kBCL[var], kBCR[var]);
+														ibasis = tableBasis(iBasisTable, iIndex, ihalf*(2+imu), var, iNode-ii+1, 0);
+														jbasis = tableBasis(jBasisTable, jIndex, jhalf*(2+jmu), var, jNode-jj+1, 0);
+														kbasis = tableBasis(kBasisTable, kIndex, khalf*(2+kmu), var, kNode-kk+1, 0);
+														idbasis = tableBasis(iBasisTable, iIndex, ihalf*(2+imu), var, iNode-ii+1, 1);
+														jdbasis = tableBasis(jBasisTable, jIndex, jhalf*(2+jmu), var, jNode-jj+1, 1);
+														kdbasis = tableBasis(kBasisTable, kIndex, khalf*(2+kmu), var, kNode-kk+1, 1);
 														real basis3x = ibasis*jbasis*kbasis;
 														int64_t aIndex = varDim*iDim*jDim*kNode + varDim*iDim*jNode +varDim*iNode;
 														switch (var) {
@@ -476,7 +476,9 @@ bool CostFunctionRTZ::outputAnalysis(const std::string& suffix, real* Astate)
         qcstream.precision(10);
 
         ostream_iterator<real> od(qcstream, "\t ");
-        for (int m = 0; m < mObs; m++) {
+        for (int n = 0; n < mObs; n++) {
+            // Write the obs in their input order
+            int64_t m = sortedObIndex(n);
             int64_t mi = m*(7+varDim*derivDim);
             real i = obsVector[mi+2];
             real j = obsVector[mi+3];
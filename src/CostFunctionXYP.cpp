@@ -61,6 +61,9 @@ bool CostFunctionXYP::outputAnalysis(const std::string& suffix, real* Astate)
 		minLat = int(lat*invIncr)/invIncr;
 		minLon = int(lon*invIncr)/invIncr;
 	}
+	// Points projected from the lat lon increments are not on the grid, so only the Cartesian
+	// output can read the i and j basis from the tables
+	bool tabulated = (latlonIncr <= 0);
 	for (int n = 0; n < analysisSize*analysisDim; n++) finalAnalysis[n] = -999.0;
 	for (int iIndex = 1; iIndex < iDim-1; iIndex++) {
 		for (int ihalf = 0; ihalf <= mishFlag; ihalf++) {
@@ -123,8 +126,10 @@ bool CostFunctionXYP::outputAnalysis(const std::string& suffix, real* Astate)
                                             for (int jjNode = (jj-1); jjNode <= (jj+2); ++jjNode) {
                                                 int jNode = jjNode;
                                                 if ((jNode < 0) or (jNode >= jDim)) continue;
-												ibasis = Basis(iNode, i, iDim-1, iMin, DI, DIrecip, 0, iBCL[var], iBCR[var]);
-												jbasis = Basis(jNode, j, jDim-1, jMin, DJ, DJrecip, 0, jBCL[var], jBCR[var]);
+												ibasis = tabulated ? tableBasis(iBasisTable, iIndex, ihalf*(2+imu), var, iNode-ii+1, 0)
+												  : Basis(iNode, i, iDim-1, iMin, DI, DIrecip, 0, iBCL[var], iBCR[var]);
+												jbasis = tabulated ? tableBasis(jBasisTable, jIndex, jhalf*(2+jmu), var, jNode-jj+1, 0)
+												  : Basis(jNode, j, jDim-1, jMin, DJ, DJrecip, 0, jBCL[var], jBCR[var]);
 												kbasis = Basis(kNode, height, kDim-1, kMin, DK, DKrecip, 0, kBCL[var], kBCR[var]);
 												kdbasis = Basis(kNode, height, kDim-1, kMin, DK, DKrecip, 1, kBCL[var], kBCR[var]);
 												real basis3x = ibasis*jbasis*kbasis;
@@ -219,11 +224,18 @@ bool CostFunctionXYP::outputAnalysis(const std::string& suffix, real* Astate)
                                             for (int jjNode = (jj-1); jjNode <= (jj+2); ++jjNode) {
                                                 int jNode = jjNode;
                                                 if ((jNode < 0) or (jNode >= jDim)) continue;
-												ibasis = Basis(iNode, i, iDim-1, iMin, DI, DIrecip, 0, iBCL[var], iBCR[var]);
-												jbasis = Basis(jNode, j, jDim-1, jMin, DJ, DJrecip, 0, jBCL[var], jBCR[var]);
+												if (tabulated) {
+													ibasis = tableBasis(iBasisTable, iIndex, ihalf*(2+imu), var, iNode-ii+1, 0);
+													jbasis = tableBasis(jBasisTable, jIndex, jhalf*(2+jmu), var, jNode-jj+1, 0);
+													idbasis = tableBasis(iBasisTable, iIndex, ihalf*(2+imu), var, iNode-ii+1, 1);
+													jdbasis = tableBasis(jBasisTable, jIndex, jhalf*(2+jmu), var, jNode-jj+1, 1);
+												} else {
+													ibasis = Basis(iNode, i, iDim-1, iMin, DI, DIrecip, 0, iBCL[var], iBCR[var]);
+													jbasis = Basis(jNode, j, jDim-1, jMin, DJ, DJrecip, 0, jBCL[var], jBCR[var]);
+													idbasis = Basis(iNode, i, iDim-1, iMin, DI, DIrecip, 1, iBCL[var], iBCR[var]);
+													jdbasis = Basis(jNode, j, jDim-1, jMin, DJ, DJrecip, 1, jBCL[var], jBCR[var]);
+												}
 												kbasis = Basis(kNode, k, kDim-1, kMin, DK, DKrecip, 0, kBCL[var], kBCR[var]);
-												idbasis = Basis(iNode, i, iDim-1, iMin, DI, DIrecip, 1, iBCL[var], iBCR[var]);
-												jdbasis = Basis(jNode, j, jDim-1, jMin, DJ, DJrecip, 1, jBCL[var], jBCR[var]);
 												kdbasis = Basis(kNode, k, kDim-1, kMin, DK, DKrecip, 1, kBCL[var], kBCR[var]);
 												real basis3x = ibasis*jbasis*kbasis;
 												int aIndex = varDim*iDim*jDim*kNode + varDim*iDim*jNode +varDim*iNode;
@@ -568,8 +580,10 @@ bool CostFunctionXYP::outputAnalysis(const std::string& suffix, real* Astate)
       qcstream.precision(10);
 
         ostream_iterator<real> od(qcstream, "\t ");
-        for (int m = 0; m < mObs; m++) {
-            int mi = m*(7+varDim*derivDim);
+        for (int n = 0; n < mObs; n++) {
+            // Write the obs in their input order
+            int64_t m = sortedObIndex(n);
+            int64_t mi = m*(7+varDim*derivDim);
             real i = obsVector[mi+2];
             real j = obsVector[mi+3];
             real k = obsVector[mi+4];
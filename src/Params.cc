@@ -2502,6 +2502,210 @@
     tt->single_val.s = tdrpStrDup("none");
     tt++;
     
+    // Parameter 'h_operator'
+    // ctype is 'char*'
+    
+    memset(tt, 0, sizeof(TDRPtable));
+    tt->ptype = STRING_TYPE;
+    tt->param_name = tdrpStrDup("h_operator");
+    tt->descr = tdrpStrDup("Storage of the observation operator H");
+    tt->help = tdrpStrDup("csr stores H as an explicit sparse matrix. compact is the same sparse matrix with 32-bit indices when the problem size allows. matrix_free stores the 1-D spline basis values at each observation and evaluates H on the fly, using much less memory. csc is the csr matrix with a second copy of the values in column order, which speeds up the adjoint at the same memory cost");
+    tt->val_offset = (char *) &h_operator - &_start_;
+    tt->single_val.s = tdrpStrDup("csr");
+    tt++;
+    
+    // Parameter 'h_single_precision'
+    // ctype is 'tdrp_bool_t'
+    
+    memset(tt, 0, sizeof(TDRPtable));
+    tt->ptype = BOOL_TYPE;
+    tt->param_name = tdrpStrDup("h_single_precision");
+    tt->descr = tdrpStrDup("Store the compact H values in single precision");
+    tt->help = tdrpStrDup("Only used with h_operator = compact. Products are still accumulated in double precision");
+    tt->val_offset = (char *) &h_single_precision - &_start_;
+    tt->single_val.b = pFALSE;
+    tt++;
+    
+    // Parameter 'obs_ordering'
+    // ctype is 'char*'
+    
+    memset(tt, 0, sizeof(TDRPtable));
+    tt->ptype = STRING_TYPE;
+    tt->param_name = tdrpStrDup("obs_ordering");
+    tt->descr = tdrpStrDup("Order of the observations in the analysis");
+    tt->help = tdrpStrDup("morton sorts the observations along a space filling curve through the grid cells, which keeps the memory accesses of the observation operator local. input keeps the order in which they were read. QC output is always written in the input order");
+    tt->val_offset = (char *) &obs_ordering - &_start_;
+    tt->single_val.s = tdrpStrDup("input");
+    tt++;
+    
+    // Parameter 'h_prescale_obs'
+    // ctype is 'tdrp_bool_t'
+    
+    memset(tt, 0, sizeof(TDRPtable));
+    tt->ptype = BOOL_TYPE;
+    tt->param_name = tdrpStrDup("h_prescale_obs");
+    tt->descr = tdrpStrDup("Multiply the observations by their inverse error once per adjoint");
+    tt->help = tdrpStrDup("Saves a multiply per nonzero of H in the adjoint of the observation operator at the cost of one extra observation sized array");
+    tt->val_offset = (char *) &h_prescale_obs - &_start_;
+    tt->single_val.b = pTRUE;
+    tt++;
+    
+    // Parameter 'superob_radar'
+    // ctype is 'tdrp_bool_t'
+    
+    memset(tt, 0, sizeof(TDRPtable));
+    tt->ptype = BOOL_TYPE;
+    tt->param_name = tdrpStrDup("superob_radar");
+    tt->descr = tdrpStrDup("Combine radar and lidar Doppler observations into superobservations");
+    tt->help = tdrpStrDup("Observations of the same type that fall in the same Gaussian mish sub-cell and see the wind from a similar direction are replaced by one observation with their error weighted mean value, geometry and position");
+    tt->val_offset = (char *) &superob_radar - &_start_;
+    tt->single_val.b = pFALSE;
+    tt++;
+    
+    // Parameter 'superob_max_angle'
+    // ctype is 'float'
+    
+    memset(tt, 0, sizeof(TDRPtable));
+    tt->ptype = FLOAT_TYPE;
+    tt->param_name = tdrpStrDup("superob_max_angle");
+    tt->descr = tdrpStrDup("Width in degrees of the azimuth and elevation bins used for superobservations");
+    tt->help = tdrpStrDup("Only used with superob_radar = true. Doppler observations are only combined when their viewing directions fall in the same bin");
+    tt->val_offset = (char *) &superob_max_angle - &_start_;
+    tt->single_val.f = 10;
+    tt++;
+    
+    // Parameter 'fftw_wisdom_file'
+    // ctype is 'char*'
+    
+    memset(tt, 0, sizeof(TDRPtable));
+    tt->ptype = STRING_TYPE;
+    tt->param_name = tdrpStrDup("fftw_wisdom_file");
+    tt->descr = tdrpStrDup("File used to save and restore FFTW wisdom");
+    tt->help = tdrpStrDup("When set, the FFTW plans for the Fourier filter are measured once and saved to this file, so later runs on the same grid start without the planning cost. none disables it");
+    tt->val_offset = (char *) &fftw_wisdom_file - &_start_;
+    tt->single_val.s = tdrpStrDup("none");
+    tt++;
+    
+    // Parameter 'state_layout'
+    // ctype is 'char*'
+    
+    memset(tt, 0, sizeof(TDRPtable));
+    tt->ptype = STRING_TYPE;
+    tt->param_name = tdrpStrDup("state_layout");
+    tt->descr = tdrpStrDup("Memory layout of the spline coefficients during the minimization");
+    tt->help = tdrpStrDup("interleaved stores the variables of each node together. variable stores each variable as a separate contiguous grid, so the spline and filter transforms work on unit stride pencils. Files and output always use the interleaved layout");
+    tt->val_offset = (char *) &state_layout - &_start_;
+    tt->single_val.s = tdrpStrDup("interleaved");
+    tt++;
+    
+    // Parameter 'fuse_transforms'
+    // ctype is 'tdrp_bool_t'
+    
+    memset(tt, 0, sizeof(TDRPtable));
+    tt->ptype = BOOL_TYPE;
+    tt->param_name = tdrpStrDup("fuse_transforms");
+    tt->descr = tdrpStrDup("Apply the filter, spline and Fourier transforms of the cost function in one cache blocked pass");
+    tt->help = tdrpStrDup("The k and j filters are applied together on a few i pencils at a time, the i filter and transforms on a few j rows of a k level at a time, and the j and k transforms on one i slab at a time, with the tiles sized from the L2 cache. Results match the separate transforms to within rounding");
+    tt->val_offset = (char *) &fuse_transforms - &_start_;
+    tt->single_val.b = pFALSE;
+    tt++;
+    
+    // Parameter 'thread_schedule'
+    // ctype is 'char*'
+    
+    memset(tt, 0, sizeof(TDRPtable));
+    tt->ptype = STRING_TYPE;
+    tt->param_name = tdrpStrDup("thread_schedule");
+    tt->descr = tdrpStrDup("OpenMP schedule of the loops over the pencils of the transforms");
+    tt->help = tdrpStrDup("static, dynamic or guided, optionally followed by a chunk size as in dynamic,4. The loops cover the pencils of all the variables, so dynamic or guided can balance thin domains on many threads");
+    tt->val_offset = (char *) &thread_schedule - &_start_;
+    tt->single_val.s = tdrpStrDup("static");
+    tt++;
+    
+    // Parameter 'tn_preconditioner'
+    // ctype is 'char*'
+    
+    memset(tt, 0, sizeof(TDRPtable));
+    tt->ptype = STRING_TYPE;
+    tt->param_name = tdrpStrDup("tn_preconditioner");
+    tt->descr = tdrpStrDup("Diagonal preconditioner for the inner CG iterations of the truncated Newton solver");
+    tt->help = tdrpStrDup("none runs unpreconditioned CG. column_norm builds the diagonal from the column norms of H, weighted by the observation errors and scaled by the background error, at about the cost of one transpose of H. It leaves out the spline, filter and Fourier transforms. The Jacobi preconditioner pays off when observations outnumber the nodes they touch, and can slow CG where they are sparse. diagonal estimates the diagonal of the Hessian by probing it with random sign vectors, optionally followed by the number of probes as in diagonal,8. The preconditioner is computed once per minimization. If <r, z> loses sign in an inner CG solve, that solve stops with a warning and keeps its current step");
+    tt->val_offset = (char *) &tn_preconditioner - &_start_;
+    tt->single_val.s = tdrpStrDup("none");
+    tt++;
+    
+    // Parameter 'deterministic_reductions'
+    // ctype is 'tdrp_bool_t'
+    
+    memset(tt, 0, sizeof(TDRPtable));
+    tt->ptype = BOOL_TYPE;
+    tt->param_name = tdrpStrDup("deterministic_reductions");
+    tt->descr = tdrpStrDup("Sum the solver dot products in a fixed order so the results do not depend on the number of threads");
+    tt->help = tdrpStrDup("The dot products and norms of the truncated Newton and conjugate gradient solvers are summed in fixed blocks that are then added in order. This costs a little speed. Ignored in OpenACC builds");
+    tt->val_offset = (char *) &deterministic_reductions - &_start_;
+    tt->single_val.b = pFALSE;
+    tt++;
+    
+    // Parameter 'exact_line_search'
+    // ctype is 'tdrp_bool_t'
+    
+    memset(tt, 0, sizeof(TDRPtable));
+    tt->ptype = BOOL_TYPE;
+    tt->param_name = tdrpStrDup("exact_line_search");
+    tt->descr = tdrpStrDup("Compute the solver step lengths analytically for the quadratic cost function");
+    tt->help = tdrpStrDup("The cost function is quadratic in the control vector, so the step along a search direction is -g.d/d.Hd and the new gradient is g + step*Hd. This replaces the More-Thuente line search of the truncated Newton solver and the Brent line minimization of the conjugate gradient solver, which evaluate the cost function and gradient several times per direction");
+    tt->val_offset = (char *) &exact_line_search - &_start_;
+    tt->single_val.b = pFALSE;
+    tt++;
+    
+    // Parameter 'solver_type'
+    // ctype is 'char*'
+    
+    memset(tt, 0, sizeof(TDRPtable));
+    tt->ptype = STRING_TYPE;
+    tt->param_name = tdrpStrDup("solver_type");
+    tt->descr = tdrpStrDup("Minimization algorithm");
+    tt->help = tdrpStrDup("default uses the solver selected at build time by SOLVER_SAMURAI. truncated_newton and conjugate_gradient select those solvers. lbfgs selects the limited-memory BFGS solver, optionally followed by the number of stored correction pairs as in lbfgs,8 (default 5). Each pair holds two state-sized vectors");
+    tt->val_offset = (char *) &solver_type - &_start_;
+    tt->single_val.s = tdrpStrDup("default");
+    tt++;
+    
+    // Parameter 'tn_recycle_vectors'
+    // ctype is 'int'
+    
+    memset(tt, 0, sizeof(TDRPtable));
+    tt->ptype = INT_TYPE;
+    tt->param_name = tdrpStrDup("tn_recycle_vectors");
+    tt->descr = tdrpStrDup("Number of Ritz vectors recycled between the inner CG solves of the truncated Newton solver");
+    tt->help = tdrpStrDup("0 disables recycling. Otherwise the largest Ritz vectors of the first inner solve, taken from its first 4 times as many Lanczos steps, deflate the later inner solves and give their initial guess. The Hessian products of the recycled vectors are refreshed once per outer analysis iteration. Uses 2 state-sized vectors per Ritz vector, plus 4 per Ritz vector while it is built. Ignored in OpenACC builds");
+    tt->val_offset = (char *) &tn_recycle_vectors - &_start_;
+    tt->single_val.i = 0;
+    tt++;
+    
+    // Parameter 'ensemble_size'
+    // ctype is 'int'
+    
+    memset(tt, 0, sizeof(TDRPtable));
+    tt->ptype = INT_TYPE;
+    tt->param_name = tdrpStrDup("ensemble_size");
+    tt->descr = tdrpStrDup("Number of perturbed analyses solved together after the final iteration");
+    tt->help = tdrpStrDup("0 disables the ensemble. Otherwise each member perturbs the observations by a draw from their error distribution and the background by a draw from the background error covariance, and the analysis perturbations of all the members are solved together by block conjugate gradient with one blocked Hessian product per iteration. The RMS spread of the perturbations at the observations is printed as an estimate of the analysis error, including the background error that the observations leave. Each member's analysis increment is written only when output_ensemble_members is set. Uses up to 8 state-sized and 2 observation-sized vectors per member. Ignored in OpenACC builds");
+    tt->val_offset = (char *) &ensemble_size - &_start_;
+    tt->single_val.i = 0;
+    tt++;
+    
+    // Parameter 'output_ensemble_members'
+    // ctype is 'tdrp_bool_t'
+    
+    memset(tt, 0, sizeof(TDRPtable));
+    tt->ptype = BOOL_TYPE;
+    tt->param_name = tdrpStrDup("output_ensemble_members");
+    tt->descr = tdrpStrDup("Write the analysis increment of each ensemble member");
+    tt->help = tdrpStrDup("Each member's analysis increment is written with the suffix ensemble_increment_N through the same output as the analysis, one full set of output files per member. Only used when ensemble_size is positive");
+    tt->val_offset = (char *) &output_ensemble_members - &_start_;
+    tt->single_val.b = pFALSE;
+    tt++;
+    
     // Parameter 'Comment 12'
     
     memset(tt, 0, sizeof(TDRPtable));
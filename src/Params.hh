@@ -680,6 +680,40 @@ public:
 
   char* bg_interpolation;
 
+  char* h_operator;
+
+  tdrp_bool_t h_single_precision;
+
+  char* obs_ordering;
+
+  tdrp_bool_t h_prescale_obs;
+
+  tdrp_bool_t superob_radar;
+
+  float superob_max_angle;
+
+  char* fftw_wisdom_file;
+
+  char* state_layout;
+
+  tdrp_bool_t fuse_transforms;
+
+  char* thread_schedule;
+
+  char* tn_preconditioner;
+
+  tdrp_bool_t deterministic_reductions;
+
+  tdrp_bool_t exact_line_search;
+
+  char* solver_type;
+
+  int tn_recycle_vectors;
+
+  int ensemble_size;
+
+  tdrp_bool_t output_ensemble_members;
+
   float bkgd_kd_max_distance;
 
   int bkgd_kd_num_neighbors;
@@ -755,7 +789,7 @@ private:
 
   void _init();
 
-  mutable TDRPtable _table[191];
+  mutable TDRPtable _table[208];
 
   const char *_className;
 
@@ -227,7 +227,8 @@ void RecursiveFilter::getIsotropicFilterCoefficients()
 			Sn[i-1][j-1] = (LT[i][j] - tmp2[i][j])/beta;
 		}
 	}
-  #pragma acc enter data copyin(Sn)
+	factorBC();
+  #pragma acc enter data copyin(Sn,SnLU)
 	
 }
 
@@ -328,21 +329,13 @@ bool RecursiveFilter::filterArray(double* array, double *q, double *s, const int
 		+ alpha[2]*q[i-2] + alpha[3]*q[i-3] + alpha[4]*q[i-4];
 	}
 	
-    // Invert Sn
-	// Create a temporary copy of Sn just in case it gets thrashed in the Gaussian Elimination
-	double Stmp[5][5];
-	for (int i=0;i<=4;i++) {
-		for (int j=0;j<=4;j++) {
-			Stmp[i][j] = Sn[i][j];
-		}
-	}
-
+    // Invert Sn with its precomputed factorization
 	//double* A = new double[4];
 	//double* B = new double[4];
 	for (int i=maxi-order+1; i<= maxi; i++) {
 		B[i-(maxi-order+1)] = q[i];
 	}
-	solveBC(A, B, Stmp);
+	solveFactoredBC(A, B);
 	for (int i=maxi; i>= (maxi-order+1); i--) {
 		s[i] = A[i-(maxi-order+1)];
 	}
@@ -374,6 +367,52 @@ bool RecursiveFilter::filterArray(double* array, double *q, double *s, const int
 	
 }
 
+#pragma acc routine seq
+bool RecursiveFilter::filterPencils(double* array, double* q, const int& arrLength, const int& numPencils)
+{
+	// Same recurrences as filterArray, with the pencils in the inner loop so they run in SIMD lanes
+	int maxi = arrLength-1;
+	int np = numPencils;
+	double* p = array;
+
+	#pragma omp simd
+	for (int n=0; n<np; n++) {
+		q[n]=beta*p[n];
+		q[np+n]=beta*p[np+n] + alpha[1]*q[n];
+		q[2*np+n]=beta*p[2*np+n] + alpha[1]*q[np+n] + alpha[2]*q[n];
+		q[3*np+n]=beta*p[3*np+n] + alpha[1]*q[2*np+n] + alpha[2]*q[np+n] + alpha[3]*q[n];
+	}
+	for (int i=order; i<= maxi; i++) {
+		#pragma omp simd
+		for (int n=0; n<np; n++) {
+			q[i*np+n] = beta*p[i*np+n] + alpha[1]*q[(i-1)*np+n]
+			+ alpha[2]*q[(i-2)*np+n] + alpha[3]*q[(i-3)*np+n] + alpha[4]*q[(i-4)*np+n];
+		}
+	}
+
+	// The input is no longer needed, so the backward pass writes into it directly
+	double* s = array;
+	for (int n=0; n<np; n++) {
+		double A[4],B[4];
+		for (int i=maxi-order+1; i<= maxi; i++) {
+			B[i-(maxi-order+1)] = q[i*np+n];
+		}
+		solveFactoredBC(A, B);
+		for (int i=maxi; i>= (maxi-order+1); i--) {
+			s[i*np+n] = A[i-(maxi-order+1)];
+		}
+	}
+	for (int i=maxi-order;i>=0;i--) {
+		#pragma omp simd
+		for (int n=0; n<np; n++) {
+			s[i*np+n] = beta*q[i*np+n] + alpha[1]*s[(i+1)*np+n]
+			+ alpha[2]*s[(i+2)*np+n] + alpha[3]*s[(i+3)*np+n] + alpha[4]*s[(i+4)*np+n];
+		}
+	}
+
+	return true;
+}
+
 double RecursiveFilter::factorial(const double& max) 
 {
 	double n = 1;
@@ -410,6 +449,46 @@ void RecursiveFilter::solveBC(double* A, double* B, double S[5][5])
 	}
 }
 
+void RecursiveFilter::factorBC()
+{
+	// The elimination in solveBC without the right hand side, done once per filter
+	for (int i=0;i<=4;i++) {
+		for (int j=0;j<=4;j++) {
+			SnLU[i][j] = Sn[i][j];
+		}
+	}
+	int n = order-1;
+	for(int j=0;j<=n-1;j++) {
+		for (int i=j+1;i<=n;i++) {
+			SnLU[i][j]=SnLU[i][j]/SnLU[j][j];
+		}
+		for	(int i=j+1;i<=n;i++) {
+			for (int k=j+1;k<=n;k++) {
+				SnLU[i][k]=SnLU[i][k]-SnLU[i][j]*SnLU[j][k];
+			}
+		}
+	}
+}
+
+#pragma acc routine seq
+void RecursiveFilter::solveFactoredBC(double* A, double* B)
+{
+	int n = order-1;
+	for(int j=0;j<=n-1;j++) {
+		for	(int i=j+1;i<=n;i++) {
+			B[i]=B[i]-SnLU[i][j]*B[j];
+		}
+	}
+	A[n]=B[n]/SnLU[n][n];
+	for(int j=n-1;j>=0;j--) {
+		A[j]=B[j];
+		for(int k=n;k>=j+1;k--) {
+			A[j]=A[j]-A[k]*SnLU[j][k];
+		}
+		A[j]=A[j]/SnLU[j][j];
+	}
+}
+
 void RecursiveFilter::getAnisotropicFilterCoefficients(const double* tau, const int& arr)
 {
 	double sigma = (lengthScale*lengthScale)/2;
@@ -775,6 +854,7 @@ void RecursiveFilter::getAnisotropicFilterCoefficients(const double* tau, const
 			Sn[i-1][j-1] = (LT[i][j] - tmp2[i][j])/beta;
 		}
 	}
+	factorBC();
 	
 	for (int i=0; i<arrLength;i++) {
 		delete[] K1[i];
@@ -785,7 +865,7 @@ void RecursiveFilter::getAnisotropicFilterCoefficients(const double* tau, const
 		delete[] sqv[i];
 	}
 
-  #pragma acc enter data copyin(Sn)
+  #pragma acc enter data copyin(Sn,SnLU)
 	delete[] tau;
 	delete[] K1;
 	delete[] K2;
@@ -23,6 +23,11 @@ public:
 	#pragma acc routine seq 
 	bool filterArray(double* array, double *q, double *s, const int& arrLength);
 	bool filterArray(double* array, const int& arrLength);
+	// Filter numPencils pencils at once, interleaved so element i of pencil n is array[i*numPencils + n]
+	#pragma acc routine seq
+	bool filterPencils(double* array, double* q, const int& arrLength, const int& numPencils);
+	// Number of pencils callers should interleave for filterPencils
+	static const int pencilBatch = 8;
 	bool aniFilterArray(double* array, const int& arrLength);
 
 private:
@@ -33,11 +38,16 @@ private:
 	double* abeta;
 	double* aalpha[5];
 	double Sn[5][5];
+	// Sn after the elimination in solveBC, which only depends on the filter
+	double SnLU[5][5];
 	void getIsotropicFilterCoefficients();
 	void getAnisotropicFilterCoefficients(const double* tau, const int& arrLength);
 	double factorial(const double& max); 		
   #pragma acc routine seq
 	void solveBC(double* A, double* B, double S[5][5]);	
+	void factorBC();
+  #pragma acc routine seq
+	void solveFactoredBC(double* A, double* B);
 };
 
 #endif
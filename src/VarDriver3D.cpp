@@ -13,6 +13,8 @@
 #include <string>
 #include <regex>
 #include <set>
+#include <unordered_map>
+#include <algorithm>
 
 #include <iomanip>
 // #include <netcdfcpp.h>
@@ -396,6 +398,14 @@ bool VarDriver3D::run()
 		obCost3D->minimize();
 		PRINT_TIMER("Cost3D minimize", timem);
 
+		// Spread of the analyses with perturbed observations, on the final iteration
+		int ensembleSize = std::stoi(configHash["ensemble_size"]);
+		if ((iter == maxIter) and (ensembleSize > 0)) {
+		  START_TIMER(timee);
+		  obCost3D->ensembleSpread(ensembleSize);
+		  PRINT_TIMER("Cost3D ensemble", timee);
+		}
+
 		START_TIMER(timeu);
 		obCost3D->updateBG();
 		PRINT_TIMER("Cost3d update", timeu);
@@ -1822,6 +1832,9 @@ bool VarDriver3D::preProcessMetObs()
 
   delete metData;
 
+  if (configHash["superob_radar"] == "true")
+    superobMetObs();
+
   // Finish reflectivity interpolation
 
   Observation varOb;
@@ -2526,6 +2539,63 @@ bool VarDriver3D::validateConfig()
       configHash.insert("bkgd_kd_max_distance", "100");
     }
 
+    if ( configHash.exists("h_operator") == false)
+      configHash.insert("h_operator", "csr");
+
+    if ( configHash.exists("h_single_precision") == false)
+      configHash.insert("h_single_precision", "false");
+
+    if ( configHash.exists("obs_ordering") == false)
+      configHash.insert("obs_ordering", "input");
+
+    if ( configHash.exists("h_prescale_obs") == false)
+      configHash.insert("h_prescale_obs", "true");
+
+    if ( configHash.exists("superob_radar") == false)
+      configHash.insert("superob_radar", "false");
+
+    if ( configHash.exists("superob_max_angle") == false)
+      configHash.insert("superob_max_angle", "10.0");
+
+    if ( configHash.exists("fftw_wisdom_file") == false)
+      configHash.insert("fftw_wisdom_file", "none");
+
+    if ( configHash.exists("state_layout") == false)
+      configHash.insert("state_layout", "interleaved");
+
+    if ( configHash.exists("fuse_transforms") == false)
+      configHash.insert("fuse_transforms", "false");
+
+    if ( configHash.exists("thread_schedule") == false)
+      configHash.insert("thread_schedule", "static");
+
+    if ( configHash.exists("tn_preconditioner") == false)
+      configHash.insert("tn_preconditioner", "none");
+
+    if ( configHash.exists("deterministic_reductions") == false)
+      configHash.insert("deterministic_reductions", "false");
+
+    if ( configHash.exists("exact_line_search") == false)
+      configHash.insert("exact_line_search", "false");
+
+    if ( configHash.exists("solver_type") == false)
+      configHash.insert("solver_type", "default");
+
+    if ( configHash.exists("tn_recycle_vectors") == false)
+      configHash.insert("tn_recycle_vectors", "0");
+    if ( configHash.exists("ensemble_size") == false)
+      configHash.insert("ensemble_size", "0");
+
+    if ( configHash.exists("output_ensemble_members") == false)
+      configHash.insert("output_ensemble_members", "false");
+
+    // The cost function only matches the prefix, so check the whole value here
+    std::regex solverTypes("default|truncated_newton|conjugate_gradient|lbfgs(,[1-9][0-9]*)?");
+    if ( ! std::regex_match(configHash["solver_type"], solverTypes) ) {
+      std::cout << "Unrecognized solver_type <" << configHash["solver_type"] << "> aborting..." << std::endl;
+      return false;
+    }
+
     // All done
 
     return true;
@@ -2834,6 +2904,150 @@ bool VarDriver3D::validateGrid()
   return true;
 }
 
+/* Combine dense radar and lidar observations into superobservations.
+   Obs of the same type in the same Gaussian mish sub-cell whose viewing directions
+   fall in the same azimuth and elevation bin are replaced by their inverse variance
+   weighted mean. Neighboring gates have correlated errors, so the combined error is
+   the harmonic mean of the individual variances plus the spread of the obs in the bin
+   rather than the much smaller error of independent obs */
+void VarDriver3D::superobMetObs()
+{
+  GPTLstart("VarDriver3D::superobMetObs");
+
+  real binAngle = std::stof(configHash["superob_max_angle"]);
+  if (binAngle <= 0) binAngle = 10.0;
+  int64_t numAz = (int64_t)ceil(360.0/binAngle);
+  int64_t numEl = (int64_t)ceil(180.0/binAngle) + 1;
+  int64_t numGeometry = numAz*numEl + 1;
+  int64_t iCells = 2*(idim-1) + 1;
+  int64_t jCells = 2*(jdim-1) + 1;
+  int64_t kCells = 2*(kdim-1) + 1;
+
+  struct Superob {
+    real sumWeight, sumOb, sumObSquare;
+    real sumI, sumJ, sumK, sumTime;
+    real weight[7];
+    int count;
+  };
+  std::vector<Observation> superobVector;
+  std::vector<Superob> superobs;
+  std::vector<size_t> superobSlot;
+  std::unordered_map<uint64_t, size_t> binIndex;
+  superobVector.reserve(obVector.size());
+
+  for (size_t n = 0; n < obVector.size(); n++) {
+    Observation& ob = obVector[n];
+    int type = ob.getType();
+    real error = ob.getError();
+    bool eligible = ((type == MetObs::radar) or (type == MetObs::lidar)) and (error > 0);
+
+    // Only single point Doppler (rhou,rhov,rhow) or reflectivity (qr) obs can be combined
+    bool doppler = false;
+    bool reflectivity = false;
+    for (unsigned int var = 0; eligible and (var < numVars); var++) {
+      for (unsigned int d = 0; d < numDerivatives; d++) {
+	if (ob.getWeight(var, d) == 0) continue;
+	if (d > 0) eligible = false;
+	else if (var <= 2) doppler = true;
+	else if (var == 6) reflectivity = true;
+	else eligible = false;
+      }
+    }
+    if (doppler == reflectivity) eligible = false;
+    if (!eligible) {
+      superobVector.push_back(ob);
+      continue;
+    }
+
+    real obI, obJ;
+    if (runMode == XYZ) {
+      obI = ob.getCartesianX();
+      obJ = ob.getCartesianY();
+    } else {
+      obI = ob.getRadius();
+      obJ = ob.getTheta();
+    }
+    real obK = ob.getAltitude();
+    int64_t iCell = std::min(std::max((int64_t)floor(2.0*(obI - imin)/iincr), (int64_t)0), iCells-1);
+    int64_t jCell = std::min(std::max((int64_t)floor(2.0*(obJ - jmin)/jincr), (int64_t)0), jCells-1);
+    int64_t kCell = std::min(std::max((int64_t)floor(2.0*(obK - kmin)/kincr), (int64_t)0), kCells-1);
+
+    // Viewing direction from the weights, reflectivity goes in its own bin
+    int64_t geometry = numGeometry - 1;
+    if (doppler) {
+      real uWgt = ob.getWeight(0, 0);
+      real vWgt = ob.getWeight(1, 0);
+      real wWgt = ob.getWeight(2, 0);
+      real az = 180.0 * atan2(uWgt, vWgt) / Pi;
+      if (az < 0) az += 360.0;
+      real el = 180.0 * atan2(wWgt, sqrt(uWgt*uWgt + vWgt*vWgt)) / Pi;
+      int64_t azBin = std::min((int64_t)floor(az/binAngle), numAz-1);
+      int64_t elBin = std::min((int64_t)floor((el + 90.0)/binAngle), numEl-1);
+      geometry = azBin*numEl + elBin;
+    }
+    uint64_t key = (((kCell*jCells + jCell)*iCells + iCell)*numGeometry + geometry)*32 + (type & 31);
+
+    auto bin = binIndex.find(key);
+    size_t s;
+    if (bin == binIndex.end()) {
+      s = superobs.size();
+      binIndex[key] = s;
+      Superob empty = {};
+      superobs.push_back(empty);
+      superobSlot.push_back(superobVector.size());
+      superobVector.push_back(ob);
+    } else {
+      s = bin->second;
+    }
+
+    Superob& so = superobs[s];
+    real obWeight = 1.0/(error*error);
+    real value = ob.getOb();
+    so.sumWeight += obWeight;
+    so.sumOb += obWeight*value;
+    so.sumObSquare += obWeight*value*value;
+    so.sumI += obWeight*obI;
+    so.sumJ += obWeight*obJ;
+    so.sumK += obWeight*obK;
+    so.sumTime += obWeight*ob.getTime();
+    for (unsigned int var = 0; var < numVars; var++)
+      so.weight[var] += obWeight*ob.getWeight(var, 0);
+    so.count++;
+  }
+
+  // Replace the first ob of each bin with the combined one
+  for (size_t s = 0; s < superobs.size(); s++) {
+    Superob& so = superobs[s];
+    if (so.count == 1) continue;
+    Observation& ob = superobVector[superobSlot[s]];
+    real mean = so.sumOb/so.sumWeight;
+    real spread = so.sumObSquare/so.sumWeight - mean*mean;
+    if (spread < 0) spread = 0;
+    ob.setOb(mean);
+    ob.setError(sqrt(so.count/so.sumWeight + spread));
+    if (runMode == XYZ) {
+      ob.setCartesianX(so.sumI/so.sumWeight);
+      ob.setCartesianY(so.sumJ/so.sumWeight);
+      ob.setRadius(sqrt(ob.getCartesianX()*ob.getCartesianX() + ob.getCartesianY()*ob.getCartesianY()));
+    } else {
+      ob.setRadius(so.sumI/so.sumWeight);
+      ob.setTheta(so.sumJ/so.sumWeight);
+    }
+    ob.setAltitude(so.sumK/so.sumWeight);
+    ob.setTime((int64_t)(so.sumTime/so.sumWeight));
+    for (unsigned int var = 0; var < numVars; var++)
+      ob.setWeight(so.weight[var]/so.sumWeight, var);
+  }
+
+  size_t before = obVector.size();
+  obVector.swap(superobVector);
+  cout << "Superobbing reduced " << before << " observations to " << obVector.size()
+       << " (" << 100.0*(1.0 - (float)obVector.size()/(float)std::max(before, (size_t)1))
+       << "% reduction)" << endl;
+
+  GPTLstop("VarDriver3D::superobMetObs");
+}
+
 bool VarDriver3D::loadMetObs()
 {
   // Read in the meteorological observations, process them into weights and positions
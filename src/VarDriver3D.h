@@ -94,6 +94,7 @@ private:
 	bool initObCost3D();
 	bool gridDependentInit();
 	bool preProcessMetObs();
+	void superobMetObs();
 	bool loadMetObs();
 	bool loadPreProcessMetObs();
 	bool loadBGfromFile();
@@ -0,0 +1,640 @@
+/*
+ *  TransformTests.cpp
+ *  samurai
+ *
+ *  Checks the banded spline coefficients, the separable SB transform, the batched
+ *  recursive filter, the matrix-free H and the fused SC, SA and FF transforms against
+ *  the dense, 64-point, single pencil, sparse and separate versions they replaced, that
+ *  the sparse H built on several threads is identical to the serial build, and that the
+ *  variable-major state layout gives the same results as the interleaved layout
+ *
+ */
+
+#include <cmath>
+#include <algorithm>
+#include <cstdio>
+#include <string>
+#include <vector>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#include "CostFunction3D.h"
+#include "HashMap.h"
+#include "RecursiveFilter.h"
+#include "ReferenceState.h"
+
+class TransformTests : public CostFunction3D
+{
+public:
+  TransformTests(const Projection& proj, const int& numObs, const int& stateSize)
+    : CostFunction3D(proj, numObs, stateSize) {}
+  bool outputAnalysis(const std::string& suffix, real* Astate) { return true; }
+
+  bool checkSplineCoefficients(const int& Dim, const real& DX);
+  bool checkSBtransform(const std::string& bcs);
+  bool checkMatrixFreeH(const std::string& bcs);
+  bool checkParallelHmatrix(const std::string& bcs);
+  bool checkFusedTransform(const std::string& bcs);
+  bool checkStateLayout(const std::string& bcs, TransformTests& varMajor);
+
+private:
+  void denseSplineCoefficients(const int& Dim, const real& eq, const int& BCL, const int& BCR,
+			       const real& xMin, const real& DX, const real& DXrecip, const int& LDim,
+			       real* L, real* gamma);
+  void pointSBtransform(const real* Ustate, real* Bstate);
+  bool validSplineAxis(const int& Dim, const int& BCL, const int& BCR);
+  void loadObservations();
+  void setupFilteredTransforms();
+};
+
+static real maxRelativeError(const real* a, const real* b, const int64_t& n)
+{
+  real err = 0, mag = 0;
+  for (int64_t i = 0; i < n; i++) {
+    err = std::max(err, (real)fabs(a[i] - b[i]));
+    mag = std::max(mag, (real)fabs(b[i]));
+  }
+  return (mag > 0) ? err/mag : err;
+}
+
+static const real tolerance = 1.0e-12;
+
+// The dense G PP GT and Cholesky decomposition that calcSplineCoefficients used before it was banded
+void TransformTests::denseSplineCoefficients(const int& Dim, const real& eq, const int& BCL, const int& BCR,
+					     const real& xMin, const real& DX, const real& DXrecip, const int& LDim,
+					     real* L, real* gamma)
+{
+  int pDim = Dim;
+  int mDim = Dim - rankHash[BCL] - rankHash[BCR];
+  real pMin = xMin;
+  if (BCL == PERIODIC) mDim--;
+
+  std::vector<std::vector<real> > P(mDim, std::vector<real>(mDim, 0.));
+  std::vector<std::vector<real> > G(mDim, std::vector<real>(pDim, 0.));
+  std::vector<std::vector<real> > GT(pDim, std::vector<real>(mDim, 0.));
+  std::vector<std::vector<real> > tmp(pDim, std::vector<real>(mDim, 0.));
+  std::vector<std::vector<real> > PP(pDim, std::vector<real>(pDim, 0.));
+  std::vector<real> p(mDim, 0.);
+
+  switch (BCL) {
+  case R1T0: G[0][0] = -4.0; G[1][0] = -1.0; break;
+  case R1T1: G[1][0] = 1.0; break;
+  case R1T2: G[0][0] = 2.0; G[1][0] = -1.0; break;
+  case R2T10: G[0][0] = 1.0; G[0][1] = -0.5; break;
+  case R2T20: G[0][0] = -1.0; break;
+  case PERIODIC: G[mDim-1][0] = 1; break;
+  default: break;
+  }
+  switch (BCR) {
+  case R1T0: G[mDim-1][pDim-1] = -4.0; G[mDim-2][pDim-1] = -1.0; break;
+  case R1T1: G[mDim-2][pDim-1] = 1.0; break;
+  case R1T2: G[mDim-1][pDim-1] = 2.0; G[mDim-2][pDim-1] = -1.0; break;
+  case R2T10: G[mDim-1][pDim-1] = 1.0; G[mDim-1][pDim-2] = -0.5; break;
+  case R2T20: G[mDim-1][pDim-1] = -1.0; break;
+  case PERIODIC: G[0][pDim-2] = 1; G[1][pDim-1] = 1; break;
+  default: break;
+  }
+  for (int i = 0; i < mDim; i++) {
+    G[i][i+rankHash[BCL]] = 1;
+  }
+  for (int i = 0; i < mDim; i++) {
+    for (int j = 0; j < pDim; j++) {
+      GT[j][i] = G[i][j];
+      gamma[Dim*i + j] = G[i][j];
+    }
+  }
+
+  for (int Index = std::min(rankHash[BCL],1); Index < std::max(pDim-1-rankHash[BCR],pDim-2); Index++) {
+    for (int mu = -1; mu <= 1; mu += 2) {
+      real i = pMin + DX * (Index + (0.5*sqrt(1./3.) * mu + 0.5));
+      int ii = (int)((i - pMin)*DXrecip);
+      for (int Node = std::max(ii-1,0); Node <= std::min(ii+2,pDim-1); ++Node) {
+	real pm = Basis(Node, i, mDim-1, pMin, DX, DXrecip, 0, RX, RX);
+	real qm = Basis(Node, i, mDim-1, pMin, DX, DXrecip, 3, RX, RX);
+	PP[Node][Node] += 0.5 * ((pm * pm) + eq * (qm * qm));
+	for (int d = 1; d <= 3; d++) {
+	  if ((Node+d) >= pDim) break;
+	  real pn = Basis(Node+d, i, mDim-1, pMin, DX, DXrecip, 0, RX, RX);
+	  real qn = Basis(Node+d, i, mDim-1, pMin, DX, DXrecip, 3, RX, RX);
+	  PP[Node][Node+d] += 0.5 * ((pm * pn) + eq * (qm * qn));
+	  PP[Node+d][Node] += 0.5 * ((pm * pn) + eq * (qm * qn));
+	}
+      }
+    }
+  }
+
+  for (int i = 0; i < pDim; i++)
+    for (int j = 0; j < mDim; j++)
+      for (int k = 0; k < pDim; k++)
+	tmp[i][j] += PP[i][k]*GT[k][j];
+  for (int i = 0; i < mDim; i++)
+    for (int j = 0; j < mDim; j++)
+      for (int k = 0; k < pDim; k++)
+	P[i][j] += G[i][k]*tmp[k][j];
+
+  for (int i = 0; i < mDim; i++) {
+    for (int j = i; j < mDim; j++) {
+      real sum = P[i][j];
+      for (int k = i-1; k >= 0; k--) {
+	sum -= P[i][k]*P[j][k];
+      }
+      if (i == j) {
+	p[i] = sqrt(sum);
+      } else {
+	P[j][i] = sum/p[i];
+      }
+    }
+  }
+
+  for (int i = 0; i < mDim*LDim; i++) {
+    L[i] = 0;
+  }
+  for (int i = 0; i < mDim; i++) {
+    L[i*LDim] = p[i];
+    for (int n = 1; n < LDim; n++) {
+      if ((i-n) >= 0) L[i*LDim+n] = P[i][i-n];
+    }
+  }
+}
+
+// The boundary conditions place entries on the first and last two rows of gamma
+bool TransformTests::validSplineAxis(const int& Dim, const int& BCL, const int& BCR)
+{
+  int mDim = Dim - rankHash[BCL] - rankHash[BCR];
+  if (BCL == PERIODIC) mDim--;
+  bool twoRows = (BCL == R1T0) or (BCL == R1T1) or (BCL == R1T2) or (BCL == PERIODIC)
+    or (BCR == R1T0) or (BCR == R1T1) or (BCR == R1T2) or (BCR == PERIODIC);
+  return (mDim >= (twoRows ? 2 : 1));
+}
+
+bool TransformTests::checkSplineCoefficients(const int& Dim, const real& DX)
+{
+  // Every left and right pair of the non-periodic conditions, then periodic on both sides
+  std::vector<int> bcTypes = { R0, R1T0, R1T1, R1T2, R2T10, R2T20, R3 };
+  std::vector<std::pair<int, int> > pairs, periodicPairs;
+  for (int left : bcTypes)
+    for (int right : bcTypes)
+      if (validSplineAxis(Dim, left, right)) pairs.push_back(std::make_pair(left, right));
+  if (validSplineAxis(Dim, PERIODIC, PERIODIC)) periodicPairs.push_back(std::make_pair((int)PERIODIC, (int)PERIODIC));
+
+  real Pi = acos(-1.);
+  real eq = pow((2.0*DX/(2*Pi)), 6);
+  real xMin = -3.0;
+  real DXrecip = 1.0/DX;
+  bool passed = true;
+  std::vector<real> Lbuf(7*Dim*Dim), gammaBuf(7*2*gammaEntries*Dim), Lref(Dim*Dim), gammaRef(Dim*Dim);
+  std::vector<real> gammaRows(Dim*Dim), gammaCols(Dim*Dim);
+  std::vector<int> rowBuf(7*2*Dim), colBuf(7*2*Dim), indexBuf(7*2*gammaEntries*Dim);
+  real *L[7], *gamma[7];
+  int *gammaRow[7], *gammaCol[7], *gammaIndex[7];
+  for (int var = 0; var < 7; var++) {
+    L[var] = &Lbuf[var*Dim*Dim];
+    gamma[var] = &gammaBuf[var*2*gammaEntries*Dim];
+    gammaRow[var] = &rowBuf[var*2*Dim];
+    gammaCol[var] = &colBuf[var*2*Dim];
+    gammaIndex[var] = &indexBuf[var*2*gammaEntries*Dim];
+  }
+
+  // calcSplineCoefficients takes one pair per variable, so run the pairs seven at a time.
+  // The periodic factor is full, so it is stored with every column
+  for (const std::vector<std::pair<int, int> >& group : { pairs, periodicPairs }) {
+    for (size_t first = 0; first < group.size(); first += varDim) {
+      int LDim = (group[first].first == PERIODIC) ? Dim-2 : 4;
+      int BCL[7], BCR[7];
+      for (int var = 0; var < varDim; var++) {
+	const std::pair<int, int>& bc = group[std::min(first + var, group.size() - 1)];
+	BCL[var] = bc.first;
+	BCR[var] = bc.second;
+      }
+      calcSplineCoefficients(Dim, eq, BCL, BCR, xMin, DX, DXrecip, LDim, L, gamma, gammaRow, gammaCol, gammaIndex);
+      for (int var = 0; (var < varDim) and (first + var < group.size()); var++) {
+	int mDim = Dim - rankHash[BCL[var]] - rankHash[BCR[var]];
+	if (BCL[var] == PERIODIC) mDim--;
+	denseSplineCoefficients(Dim, eq, BCL[var], BCR[var], xMin, DX, DXrecip, LDim, Lref.data(), gammaRef.data());
+	real Lerr = maxRelativeError(L[var], Lref.data(), (int64_t)mDim*LDim);
+	// Expand the banded rows and columns of gamma, which must both give the dense gamma
+	std::fill(gammaRows.begin(), gammaRows.end(), 0.);
+	std::fill(gammaCols.begin(), gammaCols.end(), 0.);
+	for (int m = 0; m < mDim; m++) {
+	  for (int e = gammaRow[var][2*m]; e < gammaRow[var][2*m+1]; e++) {
+	    gammaRows[Dim*m + gammaIndex[var][e]] = gamma[var][e];
+	  }
+	}
+	for (int n = 0; n < Dim; n++) {
+	  for (int e = gammaCol[var][2*n]; e < gammaCol[var][2*n+1]; e++) {
+	    gammaCols[Dim*gammaIndex[var][e] + n] = gamma[var][e];
+	  }
+	}
+	real gammaErr = std::max(maxRelativeError(gammaRows.data(), gammaRef.data(), (int64_t)mDim*Dim),
+			    maxRelativeError(gammaCols.data(), gammaRef.data(), (int64_t)mDim*Dim));
+	bool ok = (Lerr <= tolerance) and (gammaErr == 0);
+	printf("Spline Dim %2d BC %d/%d: L error %.3g, gamma error %.3g %s\n", Dim, BCL[var], BCR[var],
+	       Lerr, gammaErr, ok ? "" : "FAILED");
+	passed = passed and ok;
+      }
+    }
+  }
+  return passed;
+}
+
+// The 64-point loop that SBtransform used before the separable contraction
+void TransformTests::pointSBtransform(const real* Ustate, real* Bstate)
+{
+  for (int64_t n = 0; n < nState; n++) {
+    Bstate[n] = 0.;
+  }
+  real gausspoint = 0.5*sqrt(1./3.);
+  int iMish = (iDim-1)*2, jMish = (jDim-1)*2;
+  for (int var = 0; var < varDim; var++) {
+    for (int iIndex = std::min(rankHash[iBCL[var]],1); iIndex < std::max(iDim-1-rankHash[iBCR[var]],iDim-2); iIndex++) {
+      for (int imu = -1; imu <= 1; imu += 2) {
+	real i = iMin + DI * (iIndex + (gausspoint * imu + 0.5));
+	int ii = (int)((i - iMin)*DIrecip);
+	for (int iNode = ii-1; iNode <= ii+2; ++iNode) {
+	  if ((iNode < 0) or (iNode >= iDim)) continue;
+	  real ibasis = Basis(iNode, i, iDim-1, iMin, DI, DIrecip, 0, iBCL[var], iBCR[var]);
+	  int uI = iIndex*2 + (imu+1)/2;
+	  for (int jIndex = std::min(rankHash[jBCL[var]],1); jIndex < std::max(jDim-1-rankHash[jBCR[var]],jDim-2); jIndex++) {
+	    for (int jmu = -1; jmu <= 1; jmu += 2) {
+	      real j = jMin + DJ * (jIndex + (gausspoint * jmu + 0.5));
+	      int jj = (int)((j - jMin)*DJrecip);
+	      for (int jNode = jj-1; jNode <= jj+2; ++jNode) {
+		if ((jNode < 0) or (jNode >= jDim)) continue;
+		real jbasis = Basis(jNode, j, jDim-1, jMin, DJ, DJrecip, 0, jBCL[var], jBCR[var]);
+		int uJ = jIndex*2 + (jmu+1)/2;
+		for (int kIndex = std::min(rankHash[kBCL[var]],1); kIndex < std::max(kDim-1-rankHash[kBCR[var]],kDim-2); kIndex++) {
+		  for (int kmu = -1; kmu <= 1; kmu += 2) {
+		    real k = kMin + DK * (kIndex + (gausspoint * kmu + 0.5));
+		    int kk = (int)((k - kMin)*DKrecip);
+		    for (int kNode = kk-1; kNode <= kk+2; ++kNode) {
+		      if ((kNode < 0) or (kNode >= kDim)) continue;
+		      real kbasis = Basis(kNode, k, kDim-1, kMin, DK, DKrecip, 0, kBCL[var], kBCR[var]);
+		      int uK = kIndex*2 + (kmu+1)/2;
+		      int64_t ui = varDim * ((int64_t)iMish * ((int64_t)jMish * uK + uJ) + uI) + var;
+		      int64_t bi = iNode * iStride + jNode * jStride + kNode * kStride + var * varStride;
+		      Bstate[bi] += Ustate[ui] * 0.125 * ibasis * jbasis * kbasis;
+		    }
+		  }
+		}
+	      }
+	    }
+	  }
+	}
+      }
+    }
+  }
+}
+
+bool TransformTests::checkSBtransform(const std::string& bcs)
+{
+  int64_t uSize = (int64_t)(iDim-1)*2 * (jDim-1)*2 * (kDim-1)*2 * varDim;
+  std::vector<real> Ustate(uSize), Bstate(nState), Bref(nState);
+  unsigned long long seed = 88172645463325252ULL;
+  for (int64_t u = 0; u < uSize; u++) {
+    seed ^= seed << 13; seed ^= seed >> 7; seed ^= seed << 17;
+    real r = (seed >> 11) * (1.0/9007199254740992.0);
+    Ustate[u] = (r < 0.3) ? 0. : r - 0.65;
+  }
+  SBtransform(Ustate.data(), Bstate.data());
+  pointSBtransform(Ustate.data(), Bref.data());
+  real err = maxRelativeError(Bstate.data(), Bref.data(), nState);
+  bool ok = (err <= tolerance);
+  printf("SBtransform %s BCs: error %.3g %s\n", bcs.c_str(), err, ok ? "" : "FAILED");
+  return ok;
+}
+
+// The obs as obAdjustments loads them, without the background weighting
+void TransformTests::loadObservations()
+{
+  int row = 7 + varDim*derivDim;
+  for (int64_t m = 0; m < mObs; m++) {
+    int64_t ri = (obsOrder != NULL) ? obsOrder[m]*row : m*row;
+    for (int ob = 0; ob < row; ob++) obsVector[m*row + ob] = rawObs[ri + ob];
+    obsData[m] = obsVector[m*row + 1];
+  }
+}
+
+// Hx and H^T y of the matrix-free operator against the sparse H it replaces
+bool TransformTests::checkMatrixFreeH(const std::string& bcs)
+{
+  loadObservations();
+  std::vector<real> x(nState), y(mObs), Hx(mObs), HxRef(mObs), HTy(nState), HTyRef(nState);
+  unsigned long long seed = 1181783497276652981ULL;
+  for (int64_t n = 0; n < nState; n++) {
+    seed ^= seed << 13; seed ^= seed >> 7; seed ^= seed << 17;
+    x[n] = (seed >> 11) * (1.0/9007199254740992.0) - 0.5;
+  }
+  for (int64_t m = 0; m < mObs; m++) {
+    seed ^= seed << 13; seed ^= seed >> 7; seed ^= seed << 17;
+    y[m] = (seed >> 11) * (1.0/9007199254740992.0) - 0.5;
+  }
+
+  hOperator = H_CSR;
+  calcHmatrix();
+  Htransform(x.data(), HxRef.data());
+  calcHTranspose(y.data(), HTyRef.data());
+  hOperator = H_MATRIX_FREE;
+  calcHmatrix();
+  Htransform(x.data(), Hx.data());
+  calcHTranspose(y.data(), HTy.data());
+
+  real HxErr = maxRelativeError(Hx.data(), HxRef.data(), mObs);
+  real HTyErr = maxRelativeError(HTy.data(), HTyRef.data(), nState);
+  bool ok = (HxErr <= tolerance) and (HTyErr <= tolerance);
+  printf("Matrix-free H %s BCs: Hx error %.3g, H^T y error %.3g %s\n", bcs.c_str(), HxErr, HTyErr,
+	 ok ? "" : "FAILED");
+  return ok;
+}
+
+// The sparse H and its transpose (IH, JH, H, mPtr, mVal and I2H) built on one thread
+// and on several, which must be bit-identical
+bool TransformTests::checkParallelHmatrix(const std::string& bcs)
+{
+#ifdef _OPENMP
+  loadObservations();
+  int maxThreads = omp_get_max_threads();
+  int threads = std::max(maxThreads, 4);
+  hOperator = H_CSR;
+  omp_set_num_threads(1);
+  Hvalid = false;
+  calcHmatrix();
+  integer nonzeros = IH[mObs];
+  std::vector<integer> IHref(IH, IH + mObs + 1), JHref(JH, JH + nonzeros);
+  std::vector<integer> mPtrRef(mPtr, mPtr + nState + 1), mValRef(mVal, mVal + nonzeros);
+  std::vector<integer> I2Href(I2H, I2H + nonzeros);
+  std::vector<real> Href(H, H + nonzeros);
+  omp_set_num_threads(threads);
+  Hvalid = false;
+  calcHmatrix();
+  omp_set_num_threads(maxThreads);
+  bool ok = (IH[mObs] == nonzeros)
+    and std::equal(IHref.begin(), IHref.end(), IH) and std::equal(JHref.begin(), JHref.end(), JH)
+    and std::equal(Href.begin(), Href.end(), H) and std::equal(mPtrRef.begin(), mPtrRef.end(), mPtr)
+    and std::equal(mValRef.begin(), mValRef.end(), mVal) and std::equal(I2Href.begin(), I2Href.end(), I2H);
+  printf("Sparse H %s BCs: 1 and %d threads %s\n", bcs.c_str(), threads, ok ? "identical" : "differ FAILED");
+  return ok;
+#else
+  printf("Sparse H %s BCs: built without OpenMP, skipped\n", bcs.c_str());
+  return true;
+#endif
+}
+
+// Filter scales on all three axes and a maximum wavenumber on some of the periodic axes, so
+// that the recursive filter and both Fourier transforms are used
+void TransformTests::setupFilteredTransforms()
+{
+  iFilterScale = 2; jFilterScale = 2; kFilterScale = 1.5;
+  iFilter->setFilterLengthScale(iFilterScale);
+  jFilter->setFilterLengthScale(jFilterScale);
+  kFilter->setFilterLengthScale(kFilterScale);
+  UseFFT = false;
+  for (int var = 0; var < varDim; var++) {
+    iMaxWavenumber[var] = ((iBCL[var] == PERIODIC) and (var%3 != 2)) ? 2 + var%3 : -1;
+    jMaxWavenumber[var] = (jBCL[var] == PERIODIC) ? 3 : -1;
+    kMaxWavenumber[var] = -1;
+    if ((iMaxWavenumber[var] >= 0) or (jMaxWavenumber[var] >= 0)) UseFFT = true;
+  }
+  if (UseFFT and !FFTplanned) setupFFT();
+  setupSplines();
+}
+
+// fusedTransform against SCtransform, SAtransform and FFtransform in sequence
+bool TransformTests::checkFusedTransform(const std::string& bcs)
+{
+  setupFilteredTransforms();
+  std::vector<real> state(nState), Cstate(nState), Cref(nState), scratch(nState);
+  unsigned long long seed = 6364136223846793005ULL;
+  for (int64_t n = 0; n < nState; n++) {
+    seed ^= seed << 13; seed ^= seed >> 7; seed ^= seed << 17;
+    real r = (seed >> 11) * (1.0/9007199254740992.0);
+    state[n] = r - 0.5;
+    bgStdDev[n] = 0.5 + r;
+  }
+  SCtransform(state.data(), scratch.data());
+  SAtransform(scratch.data(), Cref.data());
+  FFtransform(Cref.data(), scratch.data());
+  Cref = scratch;
+  fusedTransform(state.data(), Cstate.data());
+  real err = maxRelativeError(Cstate.data(), Cref.data(), nState);
+  bool ok = (err <= tolerance);
+  printf("fusedTransform %s BCs: error %.3g %s\n", bcs.c_str(), err, ok ? "" : "FAILED");
+  return ok;
+}
+
+// The forward transforms, H and the transposes on a variable-major copy of this domain
+// against the interleaved layout, compared after interleavedState
+bool TransformTests::checkStateLayout(const std::string& bcs, TransformTests& varMajor)
+{
+  setupFilteredTransforms();
+  varMajor.setupFilteredTransforms();
+  loadObservations();
+  varMajor.loadObservations();
+  int64_t uSize = (int64_t)(iDim-1)*2 * (jDim-1)*2 * (kDim-1)*2 * varDim;
+  std::vector<real> x(nState), xv(nState), out(nState), outV(nState), Ustate(uSize);
+  std::vector<real> y(mObs), Hx(mObs), HxV(mObs);
+  unsigned long long seed = 2685821657736338717ULL;
+  for (int64_t n = 0; n < nState; n++) {
+    seed ^= seed << 13; seed ^= seed >> 7; seed ^= seed << 17;
+    real r = (seed >> 11) * (1.0/9007199254740992.0);
+    x[n] = r - 0.5;
+    bgStdDev[n] = 0.5 + r;
+  }
+  for (int64_t m = 0; m < mObs; m++) {
+    seed ^= seed << 13; seed ^= seed >> 7; seed ^= seed << 17;
+    y[m] = (seed >> 11) * (1.0/9007199254740992.0) - 0.5;
+  }
+  for (int64_t u = 0; u < uSize; u++) {
+    seed ^= seed << 13; seed ^= seed >> 7; seed ^= seed << 17;
+    Ustate[u] = (seed >> 11) * (1.0/9007199254740992.0) - 0.5;
+  }
+  varMajor.deinterleaveState(x.data(), xv.data());
+  varMajor.deinterleaveState(bgStdDev, varMajor.bgStdDev);
+
+  real stateErr = 0;
+  auto compare = [&]() {
+    stateErr = std::max(stateErr, maxRelativeError(varMajor.interleavedState(outV.data()), out.data(), nState));
+  };
+  SBtransform(Ustate.data(), out.data());
+  varMajor.SBtransform(Ustate.data(), outV.data());
+  compare();
+  SCtransform(x.data(), out.data());
+  varMajor.SCtransform(xv.data(), outV.data());
+  compare();
+  SAtransform(x.data(), out.data());
+  varMajor.SAtransform(xv.data(), outV.data());
+  compare();
+  FFtransform(x.data(), out.data());
+  varMajor.FFtransform(xv.data(), outV.data());
+  compare();
+  fusedTransform(x.data(), out.data());
+  varMajor.fusedTransform(xv.data(), outV.data());
+  compare();
+  SAtranspose(x.data(), out.data());
+  varMajor.SAtranspose(xv.data(), outV.data());
+  compare();
+  SCtranspose(x.data(), out.data());
+  varMajor.SCtranspose(xv.data(), outV.data());
+  compare();
+
+  // Two members of a block, adjacent at each state index
+  const int k = 2;
+  std::vector<real> X(nState*k), XV(nState*k), CX(nState*k), CXV(nState*k);
+  for (int64_t n = 0; n < nState; n++) {
+    X[n*k] = x[n];
+    X[n*k+1] = x[nState-1-n];
+  }
+  for (int b = 0; b < k; b++) {
+    for (int64_t n = 0; n < nState; n++) out[n] = X[n*k+b];
+    varMajor.deinterleaveState(out.data(), outV.data());
+    for (int64_t n = 0; n < nState; n++) XV[n*k+b] = outV[n];
+  }
+  real blockErr = 0;
+  for (int pass = 0; pass < 2; pass++) {
+    if (pass == 0) {
+      transformBlock(k, X.data(), CX.data());
+      varMajor.transformBlock(k, XV.data(), CXV.data());
+    } else {
+      transposeBlock(k, X.data(), CX.data());
+      varMajor.transposeBlock(k, XV.data(), CXV.data());
+    }
+    for (int b = 0; b < k; b++) {
+      for (int64_t n = 0; n < nState; n++) {
+	out[n] = CX[n*k+b];
+	outV[n] = CXV[n*k+b];
+      }
+      blockErr = std::max(blockErr, maxRelativeError(varMajor.interleavedState(outV.data()), out.data(), nState));
+    }
+  }
+
+  real HxErr = 0, HTyErr = 0;
+  for (int op : { H_CSR, H_MATRIX_FREE }) {
+    hOperator = varMajor.hOperator = op;
+    calcHmatrix();
+    varMajor.calcHmatrix();
+    Htransform(x.data(), Hx.data());
+    varMajor.Htransform(xv.data(), HxV.data());
+    HxErr = std::max(HxErr, maxRelativeError(HxV.data(), Hx.data(), mObs));
+    calcHTranspose(y.data(), out.data());
+    varMajor.calcHTranspose(y.data(), outV.data());
+    HTyErr = std::max(HTyErr, maxRelativeError(varMajor.interleavedState(outV.data()), out.data(), nState));
+  }
+
+  bool ok = (stateErr <= tolerance) and (blockErr <= tolerance) and (HxErr <= tolerance) and (HTyErr <= tolerance);
+  printf("State layouts %s BCs: transforms error %.3g, blocks error %.3g, Hx error %.3g, H^T y error %.3g %s\n",
+	 bcs.c_str(), stateErr, blockErr, HxErr, HTyErr, ok ? "" : "FAILED");
+  return ok;
+}
+
+// filterPencils on interleaved pencils against filterArray, which solves the boundary
+// conditions with an unfactored copy of Sn, on each pencil separately
+static bool checkFilterPencils(const int& numPencils, const int& arrLength, const double& lengthScale)
+{
+  RecursiveFilter filter(4);
+  filter.setFilterLengthScale(lengthScale);
+  std::vector<double> pencils((int64_t)arrLength*numPencils), q((int64_t)arrLength*numPencils);
+  std::vector<double> ref((int64_t)arrLength*numPencils), single(arrLength);
+  unsigned long long seed = 2463534242ULL + numPencils;
+  for (size_t n = 0; n < pencils.size(); n++) {
+    seed ^= seed << 13; seed ^= seed >> 7; seed ^= seed << 17;
+    pencils[n] = (seed >> 11) * (1.0/9007199254740992.0) - 0.5;
+  }
+  for (int p = 0; p < numPencils; p++) {
+    for (int i = 0; i < arrLength; i++) single[i] = pencils[(int64_t)i*numPencils + p];
+    filter.filterArray(single.data(), arrLength);
+    for (int i = 0; i < arrLength; i++) ref[(int64_t)i*numPencils + p] = single[i];
+  }
+  filter.filterPencils(pencils.data(), q.data(), arrLength, numPencils);
+  real err = maxRelativeError(pencils.data(), ref.data(), (int64_t)arrLength*numPencils);
+  bool ok = (err <= tolerance);
+  printf("filterPencils %d pencils of %d, length scale %g: error %.3g %s\n", numPencils, arrLength,
+	 lengthScale, err, ok ? "" : "FAILED");
+  return ok;
+}
+
+// A small analysis domain with mixed or periodic boundary conditions and a few observations
+static void configureDomain(HashMap& config, const std::string& bcs, std::vector<real>& obs, const int& mObs)
+{
+  int iNodes = 14, jNodes = 11, kNodes = 9;
+  const char* vars[7] = { "rhou", "rhov", "rhow", "tempk", "qv", "rhoa", "qr" };
+  for (int v = 0; v < 7; v++) {
+    for (std::string axis : { "i", "j", "k" }) {
+      std::string L = "R0", R = "R0";
+      if (bcs == "mixed") {
+	if ((v == 2) and (axis == "k")) { L = "R1T0"; R = "R1T0"; }
+	if ((v == 0) and (axis == "i")) { L = "R1T1"; R = "R2T20"; }
+	if ((v == 4) and (axis == "j")) { L = "R2T10"; R = "R1T2"; }
+	if (v == 3) { L = "R1T2"; R = "R3"; }
+      } else if ((axis == "i") or ((axis == "j") and (v%4 == 1))) {
+	L = "PERIODIC"; R = "PERIODIC";
+      }
+      config.insert(axis + "_" + vars[v] + "_bcL", L);
+      config.insert(axis + "_" + vars[v] + "_bcR", R);
+      config.insert(axis + "_max_wavenumber_" + vars[v], "-1");
+    }
+  }
+  config.insert("i_min", "-6"); config.insert("i_max", std::to_string(-6 + (iNodes-1)*1.0)); config.insert("i_incr", "1");
+  config.insert("j_min", "-4"); config.insert("j_max", std::to_string(-4 + (jNodes-1)*1.5)); config.insert("j_incr", "1.5");
+  config.insert("k_min", "0"); config.insert("k_max", std::to_string((kNodes-1)*0.5)); config.insert("k_incr", "0.5");
+  config.insert("i_filter_length", "2"); config.insert("j_filter_length", "2"); config.insert("k_filter_length", "1.5");
+  config.insert("i_spline_cutoff", "2"); config.insert("j_spline_cutoff", "3"); config.insert("k_spline_cutoff", "1");
+  config.insert("ref_lat", "0"); config.insert("ref_lon", "0"); config.insert("mc_weight", "1");
+  config.insert("output_directory", "."); config.insert("data_directory", ".");
+  config.insert("load_bg_coefficients", "false"); config.insert("output_mish", "false"); config.insert("save_mish", "false");
+  config.insert("fractl_nc_file", "");
+  config.insert("tn_recycle_vectors", "0"); config.insert("ensemble_size", "0");
+  config.insert("fuse_transforms", "true");
+
+  int row = 7 + 7*4;
+  obs.assign((int64_t)mObs*row, 0.);
+  for (int m = 0; m < mObs; m++) {
+    real* ob = &obs[(int64_t)m*row];
+    ob[0] = 1.0; ob[1] = 1.0;
+    ob[2] = -6 + (iNodes-1)*1.0*(m+0.5)/mObs;
+    ob[3] = -4 + (jNodes-1)*1.5*(m+0.5)/mObs;
+    ob[4] = (kNodes-1)*0.5*(m+0.5)/mObs;
+    ob[7 + m%7] = 1.0;
+    // Derivative terms, some sharing a basis block with the value term
+    if (m%2 == 0) ob[7 + 7*(1 + m%3) + (m+3)%7] = 0.5;
+    if (m%4 == 1) ob[7 + (m+4)%7] = 0.75;
+    if (m%3 == 0) ob[7 + 7*3 + m%7] = -0.25;
+  }
+}
+
+int main(int argc, char *argv[])
+{
+  bool passed = true;
+  Projection proj;
+  ReferenceState ref("");
+  for (int numPencils : { 1, 3, 8 }) {
+    passed = checkFilterPencils(numPencils, 9, 1.5) and passed;
+    passed = checkFilterPencils(numPencils, 40, 4.0) and passed;
+  }
+  for (std::string bcs : { "mixed", "periodic" }) {
+    HashMap config;
+    std::vector<real> obs;
+    int mObs = 21;
+    configureDomain(config, bcs, obs, mObs);
+    int nState = (14+2)*(11+2)*(9+2)*7;
+    std::vector<real> bgU((int64_t)8*(14+1)*(11+1)*(9+1)*7, 0.);
+    TransformTests tests(proj, mObs, nState);
+    tests.initialize(&config, bgU.data(), obs.data(), &ref);
+    if (bcs == "mixed") {
+      passed = tests.checkSplineCoefficients(5, 1.0) and passed;
+      passed = tests.checkSplineCoefficients(8, 1.5) and passed;
+      passed = tests.checkSplineCoefficients(17, 0.5) and passed;
+    }
+    passed = tests.checkSBtransform(bcs) and passed;
+    passed = tests.checkMatrixFreeH(bcs) and passed;
+    passed = tests.checkParallelHmatrix(bcs) and passed;
+    passed = tests.checkFusedTransform(bcs) and passed;
+    HashMap varMajorConfig = config;
+    varMajorConfig.insert("state_layout", "variable");
+    TransformTests varMajor(proj, mObs, nState);
+    varMajor.initialize(&varMajorConfig, bgU.data(), obs.data(), &ref);
+    passed = tests.checkStateLayout(bcs, varMajor) and passed;
+    varMajor.finalize();
+    tests.finalize();
+  }
+  printf("%s\n", passed ? "All transform tests passed" : "Transform tests FAILED");
+  return passed ? 0 : 1;
+}